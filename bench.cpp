@@ -0,0 +1,187 @@
+//
+//  bench.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "input.h"
+#include "nal.h"
+#include "bench.h"
+
+
+using namespace std;
+
+
+/******************************
+ * local function
+ */
+
+static uint8_t u8endCode[] = { 0xFC, 0xFD, 0xFE, 0xFF };
+
+
+static bool has_start_code
+(
+    const uint8_t *addr,
+    uint8_t  zeros
+)
+{
+    int i;
+    
+    for (i = 0; i < zeros; i++)
+    {
+        if (addr[i]) return false;
+    }
+    
+    return addr[i] == 0x01 ? true : false;
+}
+
+
+static bool has_end_code(const uint8_t *p)
+{
+    if (memcmp(p, u8endCode, sizeof(u8endCode)) == 0)
+    {
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+
+/**
+ * The scan the main loop used to run before FindStartCode(): the end code
+ * sentinel and both prefix lengths tested at every byte. The data needs
+ * u8endCode right behind end; an end code inside the data is stepped
+ * over so it cannot cut the count short.
+ */
+static const uint8_t *find_baseline(const uint8_t *p, const uint8_t *end)
+{
+    for (;;)
+    {
+        while (!has_end_code(p) && !has_start_code(p, 2) && !has_start_code(p, 3))
+        {
+            p++;
+        }
+
+        if (!has_end_code(p))
+        {
+            return p;
+        }
+
+        if (p >= end)
+        {
+            return end;
+        }
+
+        p++;
+    }
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint64_t count_start_codes(FindStartCode_t find, const uint8_t *data, uint64_t size)
+{
+    const uint8_t *end = data + size;
+    const uint8_t *sc  = find(data, end);
+    uint64_t num = 0;
+
+    while (sc != end)
+    {
+        num++;
+        sc = find(sc + 3, end);
+    }
+
+    return num;
+}
+
+
+static int run_scanner(const char *name, FindStartCode_t find, const uint8_t *data, uint64_t size, uint64_t expect, uint64_t &num)
+{
+    uint64_t passes = BENCH_MIN_BYTES / size;
+
+    if (passes < BENCH_MIN_PASSES)
+    {
+        passes = BENCH_MIN_PASSES;
+    }
+
+    double t0 = now();
+
+    for (uint64_t i = 0; i < passes; i++)
+    {
+        num = count_start_codes(find, data, size);
+    }
+
+    double secs = now() - t0;
+
+    printf("%-10s %8.2f GB/s  %llu start codes%s%s\n",
+           name,
+           (secs > 0) ? passes * size / secs / 1e9 : 0.0,
+           (unsigned long long) num,
+           (strcmp(name, StartCodeScannerName()) == 0) ? "  (in use)" : "",
+           (num != expect) ? "  MISMATCH" : "");
+
+    return (num != expect) ? -1 : 0;
+}
+
+
+/**
+ * Time every start code scanner this CPU can run over a copy of the input
+ * and check they all find the same start codes as the old main loop scan.
+ */
+int RunBench(Input_t &input)
+{
+    const StartCodeScanner_t *list;
+    int num_scanners = GetStartCodeScanners(&list);
+    uint64_t expect;
+    uint64_t num;
+    int ret = 0;
+
+    if (input.size == 0)
+    {
+        printf("empty input, nothing to scan\n");
+        return -1;
+    }
+
+    // every scanner runs over the same copy, it carries the sentinel the baseline needs
+    vector<uint8_t> buf(input.size + sizeof(u8endCode));
+
+    memcpy(buf.data(), input.data, input.size);
+    memcpy(buf.data() + input.size, u8endCode, sizeof(u8endCode));
+
+    expect = count_start_codes(find_baseline, buf.data(), input.size);
+
+    run_scanner("baseline", find_baseline, buf.data(), input.size, expect, num);
+
+    for (int i = 0; i < num_scanners; i++)
+    {
+        if (run_scanner(list[i].name, list[i].find, buf.data(), input.size, expect, num) < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,13 @@
+
+
+#ifndef ___I_AVC_BENCH_H___
+#define ___I_AVC_BENCH_H___
+
+
+#define BENCH_MIN_BYTES         (2ULL << 30)    // scan at least this much per scanner
+#define BENCH_MIN_PASSES        3
+
+
+extern int RunBench(Input_t &input);
+
+#endif
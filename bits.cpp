@@ -38,6 +38,8 @@ static uint32_t read_uvlc(InputBitstream_t &bitstream);
 
 static uint32_t read_bits(InputBitstream_t &bitstream, uint32_t uiNumberOfBits);
 
+static uint8_t next_byte(InputBitstream_t &bitstream);
+
 static uint32_t get_num_bits_left(InputBitstream_t &bitstream);
 
 static uint32_t peek_bits
@@ -52,6 +54,16 @@ static uint32_t pseudo_read
     uint32_t uiNumberOfBits
 );
 
+/**
+ * True once reading has gone past the end of the EBSP, everything read
+ * since then is made up.
+ */
+bool RBSP_OVERRUN(InputBitstream_t &bitstream)
+{
+    return bitstream.m_fifo_idx > bitstream.m_fifo_size;
+}
+
+
 static void write_uvlc
 (
     OutputBitstream_t &bitstream,
@@ -78,7 +90,8 @@ static int32_t read_svlc(InputBitstream_t &bitstream)
     int32_t  codeNum;           // codeNum in svlc
     bool     b;
     
-    for (b = 0; !b; leadingZeroBits++)
+    // a ue(v) has at most 31 leading zeros, more only come from an overrun
+    for (b = 0; !b && leadingZeroBits + 1 < 32; leadingZeroBits++)
     {
         b = (bool) (read_bits(bitstream, 1) & 0x01);
     }
@@ -97,7 +110,8 @@ static uint32_t read_uvlc(InputBitstream_t &bitstream)
     uint32_t codeNum = 0;
     bool     b;
     
-    for (b = 0; !b; leadingZeroBits++)
+    // a ue(v) has at most 31 leading zeros, more only come from an overrun
+    for (b = 0; !b && leadingZeroBits + 1 < 32; leadingZeroBits++)
     {
         b = (bool) (read_bits(bitstream, 1) & 0x01);
     }
@@ -154,14 +168,12 @@ static uint32_t read_bits(InputBitstream_t &bitstream, uint32_t uiNumberOfBits)
     uint32_t aligned_word = 0;
     uint32_t num_bytes_to_load = (uiNumberOfBits - 1) >> 3;
     
-    //assert(m_fifo_idx + num_bytes_to_load < m_fifo->size());
-    
     switch (num_bytes_to_load)
     {
-        case 3: aligned_word  = (bitstream.m_fifo)[bitstream.m_fifo_idx++] << 24;
-        case 2: aligned_word |= (bitstream.m_fifo)[bitstream.m_fifo_idx++] << 16;
-        case 1: aligned_word |= (bitstream.m_fifo)[bitstream.m_fifo_idx++] << 8;
-        case 0: aligned_word |= (bitstream.m_fifo)[bitstream.m_fifo_idx++];
+        case 3: aligned_word  = next_byte(bitstream) << 24;
+        case 2: aligned_word |= next_byte(bitstream) << 16;
+        case 1: aligned_word |= next_byte(bitstream) << 8;
+        case 0: aligned_word |= next_byte(bitstream);
     }
     
     /* resolve remainder bits */
@@ -180,9 +192,46 @@ static uint32_t read_bits(InputBitstream_t &bitstream, uint32_t uiNumberOfBits)
 }
 
 
+/**
+ * Next RBSP byte, straight from the EBSP. A 0x03 after two zero bytes is
+ * an emulation_prevention_three_byte (7.4.1) and is stepped over. Past
+ * the end it reads zeros and m_fifo_idx sticks at m_fifo_size + 1.
+ */
+static uint8_t next_byte(InputBitstream_t &bitstream)
+{
+    if (bitstream.m_fifo_idx >= bitstream.m_fifo_size)
+    {
+        bitstream.m_fifo_idx = bitstream.m_fifo_size + 1;
+        return 0;
+    }
+
+    uint8_t byte = bitstream.m_fifo[bitstream.m_fifo_idx++];
+
+    if (bitstream.m_zero_run >= 2 && byte == 0x03)
+    {
+        bitstream.m_num_escapes++;
+        bitstream.m_zero_run = 0;
+
+        if (bitstream.m_fifo_idx >= bitstream.m_fifo_size)
+        {
+            bitstream.m_fifo_idx = bitstream.m_fifo_size + 1;
+            return 0;
+        }
+
+        byte = bitstream.m_fifo[bitstream.m_fifo_idx++];
+    }
+
+    bitstream.m_zero_run = (byte == 0x00) ? bitstream.m_zero_run + 1 : 0;
+
+    return byte;
+}
+
+
 static uint32_t get_num_bits_left(InputBitstream_t &bitstream) 
 { 
-    return 8 * (bitstream.m_fifo_size - bitstream.m_fifo_idx) + bitstream.m_num_held_bits;
+    uint32_t bytes_left = (bitstream.m_fifo_idx < bitstream.m_fifo_size) ? bitstream.m_fifo_size - bitstream.m_fifo_idx : 0;
+
+    return 8 * bytes_left + bitstream.m_num_held_bits;
 }
 
 
@@ -209,6 +258,8 @@ static uint32_t pseudo_read
     uint32_t saved_num_held_bits;
     uint8_t  saved_held_bits;
     uint32_t saved_fifo_idx;
+    uint32_t saved_zero_run;
+    uint32_t saved_num_escapes;
 
     uint32_t retVal;
     
@@ -218,12 +269,16 @@ static uint32_t pseudo_read
     saved_num_held_bits = bitstream.m_num_held_bits;
     saved_held_bits     = bitstream.m_held_bits;
     saved_fifo_idx      = bitstream.m_fifo_idx;
+    saved_zero_run      = bitstream.m_zero_run;
+    saved_num_escapes   = bitstream.m_num_escapes;
     
     retVal = read_bits(bitstream, num_bits_to_read);
 
     retVal <<= (uiNumberOfBits - num_bits_to_read);
     
     bitstream.m_fifo_idx      = saved_fifo_idx;
+    bitstream.m_zero_run      = saved_zero_run;
+    bitstream.m_num_escapes   = saved_num_escapes;
     bitstream.m_held_bits     = saved_held_bits;
     bitstream.m_num_held_bits = saved_num_held_bits;
 
@@ -231,6 +286,24 @@ static uint32_t pseudo_read
 }
 
 
+void InitInputBitstream
+(
+    InputBitstream_t &bitstream,
+    const uint8_t *ebsp,
+    uint32_t size
+)
+{
+    bitstream.m_num_held_bits   = 0;
+    bitstream.m_held_bits       = 0;
+    bitstream.m_numBitsRead     = 0;
+    bitstream.m_fifo            = ebsp;
+    bitstream.m_fifo_idx        = 0;
+    bitstream.m_fifo_size       = size;
+    bitstream.m_zero_run        = 0;
+    bitstream.m_num_escapes     = 0;
+}
+
+
 uint32_t READ_CODE
 (
     InputBitstream_t &bitstream,
@@ -10,16 +10,22 @@
 #define ___I_AVC_BITS_H___
 
 
+/*
+ * Reads EBSP in place: emulation_prevention_three_bytes are skipped as
+ * the bytes are consumed, nothing is copied or unescaped ahead of time.
+ * Bytes past m_fifo_size read as zero, m_fifo_idx still counts them.
+ */
 typedef struct
 {
     uint32_t m_num_held_bits;
     uint8_t  m_held_bits;
     uint32_t m_numBitsRead;
 
-    uint8_t *m_fifo;
-    //std::vector<uint8_t> m_fifo;
-    uint32_t m_fifo_idx;
+    const uint8_t *m_fifo;
+    uint32_t m_fifo_idx;            // EBSP bytes consumed, escapes included
     uint32_t m_fifo_size;
+    uint32_t m_zero_run;            // zero bytes just consumed, after two a 0x03 is an escape
+    uint32_t m_num_escapes;         // emulation_prevention_three_bytes skipped
 } InputBitstream_t;
 
 
@@ -32,6 +38,14 @@ typedef struct
 } OutputBitstream_t;
 
 
+void InitInputBitstream
+(
+    InputBitstream_t &bitstream,
+    const uint8_t *ebsp,
+    uint32_t size
+);
+
+
 uint32_t READ_CODE
 (
     InputBitstream_t &bitstream,
@@ -67,6 +81,12 @@ bool MORE_RBSP_DATA
 );
 
 
+bool RBSP_OVERRUN
+(
+    InputBitstream_t &bitstream
+);
+
+
 void WRITE_CODE
 (
     OutputBitstream_t &bitstream,
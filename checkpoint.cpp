@@ -0,0 +1,234 @@
+//
+//  checkpoint.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "output.h"
+#include "checkpoint.h"
+
+
+using namespace std;
+
+
+static const char CHECKPOINT_MAGIC[8] = { 'I', 'A', 'V', 'C', 'C', 'K', 'P', '2' };
+
+
+typedef struct
+{
+    char     magic[8];
+    uint64_t input_size;
+    uint64_t input_dev;
+    uint64_t input_ino;
+    int64_t  input_mtime_sec;
+    int64_t  input_mtime_nsec;
+    uint64_t input_offset;
+    uint64_t output_offset;
+    uint32_t num_sets;
+    uint32_t reserved;
+} CheckpointHeader_t;
+
+
+/**
+ * Record which file the input is: size, device, inode and mtime.
+ */
+int NoteCheckpointInput(Checkpoint_t &ck, int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+    {
+        perror("fstat");
+        return -1;
+    }
+
+    ck.input_size       = st.st_size;
+    ck.input_dev        = st.st_dev;
+    ck.input_ino        = st.st_ino;
+    ck.input_mtime_sec  = st.st_mtim.tv_sec;
+    ck.input_mtime_nsec = st.st_mtim.tv_nsec;
+
+    return 0;
+}
+
+
+/**
+ * True when both describe the same, unmodified input file.
+ */
+bool SameCheckpointInput(const Checkpoint_t &a, const Checkpoint_t &b)
+{
+    return a.input_size == b.input_size
+        && a.input_dev == b.input_dev
+        && a.input_ino == b.input_ino
+        && a.input_mtime_sec == b.input_mtime_sec
+        && a.input_mtime_nsec == b.input_mtime_nsec;
+}
+
+
+/**
+ * Remember a parameter set NAL. Streams repeat their SPS/PPS in front of
+ * every IDR, so identical ones are kept once, at their latest position.
+ */
+void NoteParamSet(Checkpoint_t &ck, const uint8_t *nal, uint64_t len)
+{
+    for (size_t i = 0; i < ck.sets.size(); i++)
+    {
+        if (ck.sets[i].size() == len && memcmp(ck.sets[i].data(), nal, len) == 0)
+        {
+            ck.sets.erase(ck.sets.begin() + i);
+            break;
+        }
+    }
+
+    if (ck.sets.size() >= CHECKPOINT_MAX_SETS)
+    {
+        ck.sets.erase(ck.sets.begin());
+    }
+
+    ck.sets.push_back(vector<uint8_t>(nal, nal + len));
+}
+
+
+/**
+ * Write the checkpoint next to its final name, sync it and rename it over
+ * the previous one, so a crash leaves either the old or the new one.
+ */
+int SaveCheckpoint(const char *path, Checkpoint_t &ck)
+{
+    char tmp[PATH_MAX];
+    vector<uint8_t> buf;
+    CheckpointHeader_t hdr;
+
+    memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+    hdr.input_size      = ck.input_size;
+    hdr.input_dev       = ck.input_dev;
+    hdr.input_ino       = ck.input_ino;
+    hdr.input_mtime_sec = ck.input_mtime_sec;
+    hdr.input_mtime_nsec = ck.input_mtime_nsec;
+    hdr.input_offset    = ck.input_offset;
+    hdr.output_offset   = ck.output_offset;
+    hdr.num_sets        = ck.sets.size();
+    hdr.reserved        = 0;
+
+    buf.insert(buf.end(), (uint8_t *) &hdr, (uint8_t *) &hdr + sizeof(hdr));
+
+    for (size_t i = 0; i < ck.sets.size(); i++)
+    {
+        uint32_t len = ck.sets[i].size();
+
+        buf.insert(buf.end(), (uint8_t *) &len, (uint8_t *) &len + sizeof(len));
+        buf.insert(buf.end(), ck.sets[i].begin(), ck.sets[i].end());
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        perror(tmp);
+        return -1;
+    }
+
+    WriteAll(fd, buf.data(), buf.size());
+
+    if (fdatasync(fd) != 0 || rename(tmp, path) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+
+int LoadCheckpoint(const char *path, Checkpoint_t &ck)
+{
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    vector<uint8_t> buf(st.st_size);
+    bool ok = (read(fd, buf.data(), buf.size()) == (ssize_t) buf.size());
+
+    close(fd);
+
+    CheckpointHeader_t hdr;
+
+    if (!ok || buf.size() < sizeof(hdr))
+    {
+        fprintf(stderr, "%s: truncated checkpoint\n", path);
+        return -1;
+    }
+
+    memcpy(&hdr, buf.data(), sizeof(hdr));
+
+    if (memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a checkpoint\n", path);
+        return -1;
+    }
+
+    ck.input_size       = hdr.input_size;
+    ck.input_dev        = hdr.input_dev;
+    ck.input_ino        = hdr.input_ino;
+    ck.input_mtime_sec  = hdr.input_mtime_sec;
+    ck.input_mtime_nsec = hdr.input_mtime_nsec;
+    ck.input_offset     = hdr.input_offset;
+    ck.output_offset    = hdr.output_offset;
+    ck.sets.clear();
+
+    uint64_t pos = sizeof(hdr);
+
+    for (uint32_t i = 0; i < hdr.num_sets; i++)
+    {
+        uint32_t len;
+
+        if (pos + sizeof(len) > buf.size())
+        {
+            fprintf(stderr, "%s: truncated checkpoint\n", path);
+            return -1;
+        }
+
+        memcpy(&len, &buf[pos], sizeof(len));
+        pos += sizeof(len);
+
+        if (pos + len > buf.size())
+        {
+            fprintf(stderr, "%s: truncated checkpoint\n", path);
+            return -1;
+        }
+
+        ck.sets.push_back(vector<uint8_t>(buf.begin() + pos, buf.begin() + pos + len));
+        pos += len;
+    }
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+
+
+#ifndef ___I_AVC_CHECKPOINT_H___
+#define ___I_AVC_CHECKPOINT_H___
+
+
+#define CHECKPOINT_INTERVAL     (256ULL << 20)     // input bytes between checkpoints
+#define CHECKPOINT_MAX_SETS     (32 + 128)
+
+
+/*
+ * Progress of a file rewrite: both offsets sit on a NAL boundary, and
+ * replaying the parameter set NALs in order restores the parser state
+ * at that point.
+ */
+typedef struct
+{
+    uint64_t input_size;
+    uint64_t input_dev;                         // input identity, a checkpoint only resumes the same file
+    uint64_t input_ino;
+    int64_t  input_mtime_sec;
+    int64_t  input_mtime_nsec;
+    uint64_t input_offset;
+    uint64_t output_offset;
+    std::vector< std::vector<uint8_t> > sets;   // raw SPS/PPS NALs, start code included, oldest first
+} Checkpoint_t;
+
+
+extern int NoteCheckpointInput(Checkpoint_t &ck, int fd);
+
+extern bool SameCheckpointInput(const Checkpoint_t &a, const Checkpoint_t &b);
+
+extern void NoteParamSet(Checkpoint_t &ck, const uint8_t *nal, uint64_t len);
+
+extern int SaveCheckpoint(const char *path, Checkpoint_t &ck);
+
+extern int LoadCheckpoint(const char *path, Checkpoint_t &ck);
+
+#endif
+
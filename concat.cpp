@@ -0,0 +1,656 @@
+//
+//  concat.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "bits.h"
+#include "input.h"
+#include "nal.h"
+#include "output.h"
+#include "rewrite.h"
+#include "concat.h"
+
+
+using namespace std;
+
+
+typedef struct
+{
+    Input_t   input;
+    Output_t  out;
+    Output_t  pending;              // non-VCL NAL units in front of the next picture
+    Output_t  pending_sets;         // the parameter sets among them, kept when the picture is dropped
+    Rewrite_t rw;
+    int       index;                // input being joined
+    uint64_t  pending_from;         // input offset of the first NAL unit in pending
+
+    // parameter sets as written, by output id, and the input that wrote them
+    vector<uint8_t> sps[CONCAT_MAX_SPS];
+    vector<uint8_t> pps[CONCAT_MAX_PPS];
+    int       sps_owner[CONCAT_MAX_SPS];
+    int       pps_owner[CONCAT_MAX_PPS];
+
+    // output id of each id of the current input
+    uint32_t  sps_map[CONCAT_MAX_SPS];
+    uint32_t  pps_map[CONCAT_MAX_PPS];
+
+    // splice state of the current input
+    bool      started;              // first I picture seen, output runs
+    bool      converting;           // renumbering against the converted picture, until the next IDR
+    bool      leading;              // no picture after the converted one seen yet
+    bool      convert_pic;          // current picture is turned into an IDR picture
+    bool      drop_pic;             // current picture is not joined
+    uint32_t  base_frame_num;
+    uint32_t  base_poc_lsb;
+    uint32_t  idr_pic_id;           // of the current IDR picture
+
+    uint64_t  num_idr;
+    uint64_t  num_converted;
+    uint64_t  num_dropped;
+    uint64_t  num_remapped;
+} Concat_t;
+
+
+static const uint8_t start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+
+/******************************
+ * local function
+ */
+
+static uint32_t get_bit(const vector<uint8_t> &rbsp, size_t pos)
+{
+    return (rbsp[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+
+static uint32_t get_ue(const vector<uint8_t> &rbsp, size_t &pos)
+{
+    int zeros = 0;
+
+    while (pos < rbsp.size() * 8 && !get_bit(rbsp, pos) && zeros < 31)
+    {
+        zeros++;
+        pos++;
+    }
+
+    pos++;
+
+    uint32_t v = 0;
+
+    for (int i = 0; i < zeros && pos < rbsp.size() * 8; i++, pos++)
+    {
+        v = (v << 1) | get_bit(rbsp, pos);
+    }
+
+    return (1u << zeros) - 1 + v;
+}
+
+
+static void to_rbsp(const uint8_t *ebsp, size_t len, vector<uint8_t> &rbsp)
+{
+    int zeros = 0;
+
+    rbsp.clear();
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (zeros == 2 && ebsp[i] == 0x03)
+        {
+            zeros = 0;
+            continue;
+        }
+
+        rbsp.push_back(ebsp[i]);
+        zeros = (ebsp[i] == 0x00) ? zeros + 1 : 0;
+    }
+}
+
+
+/**
+ * Read the ids of a parameter set: nal is start code, NAL header and
+ * EBSP. An SPS has its id behind profile_idc, the constraint flags and
+ * level_idc; a PPS starts with its id and the id of its SPS.
+ */
+static void read_ids(const vector<uint8_t> &nal, uint32_t ids[2])
+{
+    vector<uint8_t> rbsp;
+    bool   is_sps = ((nal[sizeof(start_code)] & 0x1F) == NALU_TYPE_SPS);
+    size_t pos = is_sps ? 24 : 0;
+
+    to_rbsp(nal.data() + sizeof(start_code) + 1, nal.size() - sizeof(start_code) - 1, rbsp);
+
+    ids[0] = get_ue(rbsp, pos);
+    ids[1] = is_sps ? 0 : get_ue(rbsp, pos);
+}
+
+
+/**
+ * Write new ids into a parameter set. The fields in front are copied,
+ * the ids re-encoded and the rest of the RBSP shifted behind them.
+ */
+static void write_ids(vector<uint8_t> &nal, const uint32_t ids[2])
+{
+    vector<uint8_t> rbsp;
+    vector<uint8_t> ebsp;
+    bool   is_sps = ((nal[sizeof(start_code)] & 0x1F) == NALU_TYPE_SPS);
+    size_t pos = 0;
+    OutputBitstream_t obs;
+
+    obs.m_num_held_bits = 0;
+    obs.m_held_bits     = 0;
+
+    to_rbsp(nal.data() + sizeof(start_code) + 1, nal.size() - sizeof(start_code) - 1, rbsp);
+
+    if (is_sps)
+    {
+        for (; pos < 24; pos += 8)
+        {
+            WRITE_CODE(obs, rbsp[pos >> 3], 8, "profile_idc/constraint_flags/level_idc");
+        }
+
+        get_ue(rbsp, pos);
+        WRITE_UVLC(obs, ids[0], "seq_parameter_set_id");
+    }
+    else
+    {
+        get_ue(rbsp, pos);
+        get_ue(rbsp, pos);
+        WRITE_UVLC(obs, ids[0], "pic_parameter_set_id");
+        WRITE_UVLC(obs, ids[1], "seq_parameter_set_id");
+    }
+
+    // everything up to the rbsp_stop_one_bit
+    size_t stop = rbsp.size() * 8;
+
+    while (stop > pos && !get_bit(rbsp, stop - 1))
+    {
+        stop--;
+    }
+
+    stop--;
+
+    for (; pos + 8 <= stop; pos += 8)
+    {
+        uint32_t byte = 0;
+
+        for (int i = 0; i < 8; i++)
+        {
+            byte = (byte << 1) | get_bit(rbsp, pos + i);
+        }
+
+        WRITE_CODE(obs, byte, 8, "rbsp_byte");
+    }
+
+    for (; pos < stop; pos++)
+    {
+        WRITE_FLAG(obs, get_bit(rbsp, pos), "rbsp_bit");
+    }
+
+    WRITE_FLAG(obs, 1, "rbsp_stop_one_bit");
+
+    while (obs.m_num_held_bits)
+    {
+        WRITE_FLAG(obs, 0, "rbsp_alignment_zero_bit");
+    }
+
+    RBSPtoEBSP(ebsp, obs.m_fifo);
+
+    nal.resize(sizeof(start_code) + 1);
+    nal.insert(nal.end(), ebsp.begin(), ebsp.end());
+}
+
+
+/**
+ * Pick the output id of a parameter set of the current input. It keeps
+ * its own id unless an earlier input left a different set there; then
+ * it goes to a slot holding the same set, or to a free one.
+ */
+static int map_set(Concat_t &c, vector<uint8_t> *sets, int *owner, int num, uint32_t id, vector<uint8_t> &nal, const uint32_t ids[2])
+{
+    vector<uint8_t> cand;
+    uint32_t new_ids[2] = { id, ids[1] };
+
+    cand = nal;
+    write_ids(cand, new_ids);
+
+    if (sets[id].empty() || owner[id] == c.index || sets[id] == cand)
+    {
+        sets[id]  = cand;
+        owner[id] = c.index;
+        nal = cand;
+        return id;
+    }
+
+    int free_id = -1;
+
+    for (int i = 0; i < num; i++)
+    {
+        if (sets[i].empty())
+        {
+            free_id = (free_id < 0) ? i : free_id;
+            continue;
+        }
+
+        new_ids[0] = i;
+        cand = nal;
+        write_ids(cand, new_ids);
+
+        if (sets[i] == cand)
+        {
+            nal = cand;
+            return i;
+        }
+    }
+
+    if (free_id < 0)
+    {
+        return -1;
+    }
+
+    new_ids[0] = free_id;
+    write_ids(nal, new_ids);
+
+    sets[free_id]   = nal;
+    owner[free_id]  = c.index;
+
+    return free_id;
+}
+
+
+/**
+ * Hook between ParseSlice and GenerateSlice: decide about the picture on
+ * its first slice and renumber the header.
+ *
+ * Every input is joined from its first I picture on. An IDR picture
+ * only gets a fresh idr_pic_id, so two IDR pictures in a row never
+ * share one across the seam. A non-IDR I picture is turned into an IDR
+ * picture, and frame_num and pic_order_cnt_lsb of the pictures that
+ * follow are counted from it, up to the next real IDR picture. Pictures
+ * in front of it, and leading pictures that come out before it, refer to
+ * the other recording and are dropped.
+ */
+static void adjust_slice(Rewrite_t &rw, uint8_t &nal_header, void *arg)
+{
+    Concat_t &c = *(Concat_t *) arg;
+    Slice_t  &slice = rw.slice;
+    PPS_t    &pps = rw.ps->PPSs[slice.pic_parameter_set_id];
+    SPS_t    &sps = rw.ps->SPSs[pps.seq_parameter_set_id];
+    bool      idr = ((nal_header & 0x1F) == NALU_TYPE_IDR);
+    uint32_t  max_frame_num = 1u << (sps.log2_max_frame_num_minus4 + 4);
+    uint32_t  max_poc_lsb = 1u << (sps.log2_max_pic_order_cnt_lsb_minus4 + 4);
+
+    if (slice.first_mb_in_slice == 0)
+    {
+        c.convert_pic = false;
+        c.drop_pic = false;
+
+        if (idr)
+        {
+            c.started = true;
+            c.converting = false;
+            c.idr_pic_id = c.num_idr++ % CONCAT_IDR_PIC_ID_RANGE;
+        }
+        else if (!c.started)
+        {
+            if (slice.slice_type == I_SLICE)
+            {
+                c.started = true;
+                c.converting = true;
+                c.leading = true;
+                c.convert_pic = true;
+                c.base_frame_num = slice.frame_num;
+                c.base_poc_lsb = slice.pic_order_cnt_lsb;
+                c.idr_pic_id = c.num_idr++ % CONCAT_IDR_PIC_ID_RANGE;
+                c.num_converted++;
+            }
+            else
+            {
+                c.drop_pic = true;
+            }
+        }
+        else if (c.converting && c.leading)
+        {
+            uint32_t diff = (slice.pic_order_cnt_lsb - c.base_poc_lsb) & (max_poc_lsb - 1);
+
+            // output order before the converted picture
+            if (sps.pic_order_cnt_type == 0 && diff >= max_poc_lsb / 2)
+            {
+                c.drop_pic = true;
+            }
+            else
+            {
+                c.leading = false;
+            }
+        }
+
+        if (c.drop_pic)
+        {
+            c.num_dropped++;
+        }
+    }
+
+    if (c.drop_pic)
+    {
+        return;
+    }
+
+    if (c.convert_pic)
+    {
+        nal_header = (nal_header & 0xE0) | NALU_TYPE_IDR;
+
+        // an IDR picture is always a reference picture
+        if ((nal_header & 0x60) == 0)
+        {
+            nal_header |= 0x60;
+        }
+
+        slice.no_output_of_prior_pics_flag = false;
+        slice.long_term_reference_flag = false;
+        idr = true;
+    }
+
+    if (c.converting)
+    {
+        slice.frame_num = (slice.frame_num - c.base_frame_num) & (max_frame_num - 1);
+        slice.pic_order_cnt_lsb = (slice.pic_order_cnt_lsb - c.base_poc_lsb) & (max_poc_lsb - 1);
+    }
+
+    if (idr)
+    {
+        slice.idr_pic_id = c.idr_pic_id;
+    }
+
+    slice.pic_parameter_set_id = c.pps_map[slice.pic_parameter_set_id];
+}
+
+
+static void append(Output_t &dst, Output_t &src)
+{
+    for (size_t i = 0; i < src.segments.size(); i++)
+    {
+        Segment_t &seg = src.segments[i];
+
+        if (seg.isInput)
+        {
+            OutputRange(dst, seg.offset, seg.length);
+        }
+        else
+        {
+            OutputBytes(dst, &src.pool[seg.offset], seg.length);
+        }
+    }
+
+    src.segments.clear();
+    src.pool.clear();
+    src.queued = 0;
+}
+
+
+/**
+ * Join one input: its NAL units are rewritten and renumbered; parameter
+ * sets go out with their ids remapped, slices with the regenerated header
+ * and the slice data as a range of the input.
+ */
+static int join_input(Concat_t &c, const char *path, int ofd)
+{
+    if (OpenInput(path, c.input) < 0)
+    {
+        return -1;
+    }
+
+    ResetRewrite(c.rw);
+    InitOutput(c.out, ofd, c.input.fd, c.input.data);
+    InitOutput(c.pending, -1, c.input.fd, c.input.data);
+    InitOutput(c.pending_sets, -1, c.input.fd, c.input.data);
+
+    for (int i = 0; i < CONCAT_MAX_SPS; i++)
+    {
+        c.sps_map[i] = i;
+    }
+
+    for (int i = 0; i < CONCAT_MAX_PPS; i++)
+    {
+        c.pps_map[i] = i;
+    }
+
+    c.started       = false;
+    c.converting    = false;
+    c.leading       = false;
+    c.convert_pic   = false;
+    c.drop_pic      = false;
+
+    const uint8_t *data = c.input.data;
+    vector<uint8_t> patch;
+    vector<uint8_t> nal;
+    NalIter_t it;
+    NalUnit_t unit;
+    int ret = 0;
+
+    InitNalIter(it, data, c.input.size, 0);
+
+    while (NextNal(it, unit))
+    {
+        uint64_t start      = unit.offset;
+        uint32_t prefix_len = unit.prefix_len;
+        uint64_t stop       = unit.next;   // trailing_zero_8bits stay with the NAL
+
+        if (stop <= start + prefix_len)
+        {
+            continue;
+        }
+
+        uint8_t  nal_unit_type  = unit.nal_unit_type;
+        bool     is_slice       = (nal_unit_type == NALU_TYPE_SLICE || nal_unit_type == NALU_TYPE_IDR);
+        uint64_t replaced       = RewriteNal(c.rw, (uint8_t *) data + start, unit.size, prefix_len, start, patch);
+
+        if (nal_unit_type == NALU_TYPE_SPS || nal_unit_type == NALU_TYPE_PPS)
+        {
+            uint64_t body = replaced ? replaced : prefix_len;
+            uint32_t ids[2];
+
+            nal.assign(start_code, start_code + sizeof(start_code));
+            nal.insert(nal.end(), patch.begin() + (replaced ? prefix_len : patch.size()), patch.end());
+            nal.insert(nal.end(), data + start + body, data + stop);
+
+            // trailing_zero_8bits
+            while (nal.size() > sizeof(start_code) + 1 && nal.back() == 0x00)
+            {
+                nal.pop_back();
+            }
+
+            read_ids(nal, ids);
+
+            int id;
+
+            if (nal_unit_type == NALU_TYPE_SPS)
+            {
+                id = (ids[0] < CONCAT_MAX_SPS) ? map_set(c, c.sps, c.sps_owner, CONCAT_MAX_SPS, ids[0], nal, ids) : -1;
+            }
+            else if (ids[0] < CONCAT_MAX_PPS && ids[1] < CONCAT_MAX_SPS)
+            {
+                ids[1] = c.sps_map[ids[1]];
+                id = map_set(c, c.pps, c.pps_owner, CONCAT_MAX_PPS, ids[0], nal, ids);
+            }
+            else
+            {
+                id = -1;
+            }
+
+            if (id < 0)
+            {
+                printf("%s: no free id for the parameter set at 0x%llx\n", path, (unsigned long long) start);
+                ret = -1;
+                break;
+            }
+
+            uint32_t &mapped = ((nal_unit_type == NALU_TYPE_SPS) ? c.sps_map : c.pps_map)[ids[0]];
+
+            // repeated parameter sets are reported once
+            if ((uint32_t) id != mapped)
+            {
+                printf("%s: %s id %u -> %d\n", path, (nal_unit_type == NALU_TYPE_SPS) ? "SPS" : "PPS", ids[0], id);
+                c.num_remapped++;
+            }
+
+            mapped = id;
+
+            if (c.pending.queued == 0)
+            {
+                c.pending_from = start;
+            }
+
+            OutputBytes(c.pending, nal.data(), nal.size());
+            OutputBytes(c.pending_sets, nal.data(), nal.size());
+        }
+        else if (is_slice)
+        {
+            // a slice the parser could not handle stays as it is
+            if (!replaced && !c.started)
+            {
+                c.drop_pic = true;
+            }
+
+            if (c.drop_pic)
+            {
+                append(c.out, c.pending_sets);
+                c.pending.segments.clear();
+                c.pending.pool.clear();
+                c.pending.queued = 0;
+            }
+            else
+            {
+                append(c.out, c.pending);
+                c.pending_sets.segments.clear();
+                c.pending_sets.pool.clear();
+                c.pending_sets.queued = 0;
+
+                if (replaced)
+                {
+                    OutputBytes(c.out, patch.data(), patch.size());
+                    OutputRange(c.out, start + replaced, stop - start - replaced);
+                }
+                else
+                {
+                    OutputRange(c.out, start, stop - start);
+                }
+            }
+        }
+        else
+        {
+            if (c.pending.queued == 0)
+            {
+                c.pending_from = start;
+            }
+
+            if (replaced)
+            {
+                OutputBytes(c.pending, patch.data(), patch.size());
+                OutputRange(c.pending, start + replaced, stop - start - replaced);
+            }
+            else
+            {
+                OutputRange(c.pending, start, stop - start);
+            }
+        }
+
+        if (c.out.queued >= CONCAT_FLUSH_SIZE)
+        {
+            FlushOutput(c.out);
+            ReleaseInput(c.input, c.pending.queued ? c.pending_from : start);
+        }
+    }
+
+    // end of sequence/stream NAL units after the last picture
+    append(c.out, c.pending);
+
+    FlushOutput(c.out);
+    CloseOutput(c.out);
+    CloseInput(c.input);
+
+    if (!c.started)
+    {
+        printf("%s: no I picture, nothing joined\n", path);
+    }
+
+    return ret;
+}
+
+
+/**
+ * Join Annex-B recordings into one stream without touching slice data.
+ *
+ * The inputs are fixed and joined one after the other. Where they meet,
+ * the stream would break in three ways, which are all repaired in the
+ * headers: SPS/PPS ids that an earlier input used for different
+ * parameter sets are moved to free ids (and the slices referring to them
+ * follow); idr_pic_id is handed out afresh; and an input that does not
+ * start with an IDR picture gets its first I picture turned into one,
+ * with frame_num and pic_order_cnt_lsb renumbered from there through the
+ * ParseSlice/GenerateSlice round trip. Pictures that would need the
+ * other recording to decode are dropped. Only headers are regenerated,
+ * the slice data goes out as ranges of the inputs.
+ */
+int RunConcat(const char *paths[], int num, int ofd)
+{
+    Concat_t *c = new Concat_t;
+    int ret = 0;
+
+    if (InitRewrite(c->rw) < 0)
+    {
+        delete c;
+        return -1;
+    }
+
+    c->rw.adjust     = adjust_slice;
+    c->rw.adjust_arg = c;
+
+    for (int i = 0; i < CONCAT_MAX_SPS; i++)
+    {
+        c->sps_owner[i] = -1;
+    }
+
+    for (int i = 0; i < CONCAT_MAX_PPS; i++)
+    {
+        c->pps_owner[i] = -1;
+    }
+
+    c->num_idr       = 0;
+    c->num_converted = 0;
+    c->num_dropped   = 0;
+    c->num_remapped  = 0;
+
+    for (int i = 0; i < num && ret == 0; i++)
+    {
+        c->index = i;
+        ret = join_input(*c, paths[i], ofd);
+    }
+
+    printf("Joined %d inputs: %llu IDR pictures, %llu I pictures made IDR, %llu pictures dropped, %llu parameter set ids moved\n",
+           num,
+           (unsigned long long) c->num_idr,
+           (unsigned long long) c->num_converted,
+           (unsigned long long) c->num_dropped,
+           (unsigned long long) c->num_remapped);
+
+    FreeRewrite(c->rw);
+    delete c;
+
+    return ret;
+}
@@ -0,0 +1,15 @@
+
+
+#ifndef ___I_AVC_CONCAT_H___
+#define ___I_AVC_CONCAT_H___
+
+
+#define CONCAT_MAX_SPS              32
+#define CONCAT_MAX_PPS              128         // as many as ParamSets_t holds
+#define CONCAT_IDR_PIC_ID_RANGE     65536
+#define CONCAT_FLUSH_SIZE           (8 << 20)
+
+
+extern int RunConcat(const char *paths[], int num, int ofd);
+
+#endif
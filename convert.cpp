@@ -0,0 +1,415 @@
+//
+//  convert.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "inplace.h"
+#include "nal.h"
+#include "convert.h"
+
+
+using namespace std;
+
+
+typedef struct
+{
+    uint64_t start;         // first byte after the start code
+    uint64_t end;           // behind the last non-zero byte
+} NalRange_t;
+
+
+/*
+ * In-place rewrite state. Output is written at w while input is read at
+ * r; when the output runs ahead of the input, the input bytes about to be
+ * overwritten are parked in the carry buffer, which always holds input
+ * [r, max(r, w)).
+ */
+typedef struct
+{
+    uint8_t *data;
+    uint64_t r;
+    uint64_t w;
+
+    vector<uint8_t> carry;
+    size_t   head;              // first valid byte of carry
+
+    uint64_t moved;             // payload bytes that changed place
+} Convert_t;
+
+
+/******************************
+ * local function
+ */
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static uint64_t carried(Convert_t &c)
+{
+    return c.carry.size() - c.head;
+}
+
+
+static void pop_carry(Convert_t &c, uint64_t n)
+{
+    c.head += n;
+
+    if (c.head == c.carry.size())
+    {
+        c.carry.clear();
+        c.head = 0;
+    }
+    else if (c.head >= CONVERT_CHUNK_SIZE)
+    {
+        c.carry.erase(c.carry.begin(), c.carry.begin() + c.head);
+        c.head = 0;
+    }
+}
+
+
+/**
+ * Park the input bytes that writing [w, w + len) would destroy.
+ */
+static void save(Convert_t &c, uint64_t len)
+{
+    uint64_t from = (c.w > c.r) ? c.w : c.r;
+    uint64_t to   = c.w + len;
+
+    if (to > from)
+    {
+        c.carry.insert(c.carry.end(), c.data + from, c.data + to);
+    }
+}
+
+
+static void write_bytes(Convert_t &c, const uint8_t *p, uint64_t len)
+{
+    save(c, len);
+    memcpy(c.data + c.w, p, len);
+    c.w += len;
+}
+
+
+static void skip_input(Convert_t &c, uint64_t len)
+{
+    uint64_t n = carried(c);
+
+    pop_carry(c, (len < n) ? len : n);
+    c.r += len;
+}
+
+
+static void copy_input(Convert_t &c, uint64_t len)
+{
+    if (c.w <= c.r && carried(c) == 0)
+    {
+        // output behind input: one memmove, nothing still needed is in the way
+        if (c.w != c.r)
+        {
+            memmove(c.data + c.w, c.data + c.r, len);
+            c.moved += len;
+        }
+
+        c.w += len;
+        c.r += len;
+        return;
+    }
+
+    while (len > 0)
+    {
+        uint64_t n = (len < CONVERT_CHUNK_SIZE) ? len : CONVERT_CHUNK_SIZE;
+
+        save(c, n);
+        memcpy(c.data + c.w, &c.carry[c.head], n);
+        pop_carry(c, n);
+
+        c.w     += n;
+        c.r     += n;
+        c.moved += n;
+        len     -= n;
+    }
+}
+
+
+static uint8_t *map_file(int fd, uint64_t size)
+{
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    return (uint8_t *) addr;
+}
+
+
+static void report(const char *what, uint64_t size, uint64_t moved, double secs)
+{
+    printf("%s: %llu bytes in %.3f s, %.2f GB/s, %llu payload bytes moved\n",
+           what,
+           (unsigned long long) size,
+           secs,
+           secs > 0 ? size / secs / 1e9 : 0.0,
+           (unsigned long long) moved);
+}
+
+
+static int open_file(const char *path, bool backup, uint64_t &size)
+{
+    struct stat sb;
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &sb) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    size = sb.st_size;
+
+    if (size == 0 || (backup && BackupFile(path, fd, size) < 0))
+    {
+        if (size == 0)
+        {
+            printf("%s: empty\n", path);
+        }
+
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+/**
+ * Convert an Annex-B file into 4 byte length prefixed NAL units, in place.
+ *
+ * A 4 byte start code turns into the length with no payload moving at
+ * all. A 3 byte start code needs one more byte; trailing zero bytes,
+ * which cannot end a length prefixed NAL, give bytes back. Payload only
+ * moves where the two do not cancel out, and output that runs ahead of
+ * the input goes through a carry buffer as large as the accumulated
+ * surplus, so the whole file is rewritten in one forward pass. The file
+ * grows or shrinks by the difference.
+ *
+ * There is no undo journal, use backup to keep the original.
+ */
+int ConvertToAvcc(const char *path, bool backup)
+{
+    uint64_t in_size;
+
+    int fd = open_file(path, backup, in_size);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    double start = now();
+    uint8_t *data = map_file(fd, in_size);
+
+    if (data == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // index the NAL units first, their lengths give the output size
+    vector<NalRange_t> nals;
+    uint64_t out_size = 0;
+    NalIter_t it;
+    NalUnit_t unit;
+
+    InitNalIter(it, data, in_size, 0);
+
+    while (NextNal(it, unit))
+    {
+        NalRange_t nal = { unit.offset + unit.prefix_len, unit.offset + unit.size };
+
+        if (nal.end - nal.start > 0xFFFFFFFFull)
+        {
+            printf("NAL at 0x%llx too long for a 4 byte length\n", (unsigned long long) nal.start);
+            munmap(data, in_size);
+            close(fd);
+            return -1;
+        }
+
+        if (nal.end > nal.start)
+        {
+            nals.push_back(nal);
+            out_size += CONVERT_LENGTH_SIZE + (nal.end - nal.start);
+        }
+    }
+
+    if (out_size > in_size)
+    {
+        munmap(data, in_size);
+
+        if (ftruncate(fd, out_size) != 0 || (data = map_file(fd, out_size)) == NULL)
+        {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+
+    Convert_t c;
+
+    c.data  = data;
+    c.r     = 0;
+    c.w     = 0;
+    c.head  = 0;
+    c.moved = 0;
+
+    for (size_t i = 0; i < nals.size(); i++)
+    {
+        uint64_t len = nals[i].end - nals[i].start;
+        uint8_t prefix[CONVERT_LENGTH_SIZE] = { (uint8_t) (len >> 24), (uint8_t) (len >> 16), (uint8_t) (len >> 8), (uint8_t) len };
+
+        // start code, leading zeros and the previous trailing zeros are dropped
+        skip_input(c, nals[i].start - c.r);
+        write_bytes(c, prefix, sizeof(prefix));
+        copy_input(c, len);
+    }
+
+    msync(data, out_size > in_size ? out_size : in_size, MS_SYNC);
+    munmap(data, out_size > in_size ? out_size : in_size);
+
+    int ret = 0;
+
+    if ((out_size < in_size && ftruncate(fd, out_size) != 0) || fdatasync(fd) != 0)
+    {
+        perror(path);
+        ret = -1;
+    }
+
+    close(fd);
+
+    printf("%llu NAL units, %llu -> %llu bytes\n",
+           (unsigned long long) nals.size(),
+           (unsigned long long) in_size,
+           (unsigned long long) out_size);
+
+    report("Annex-B to AVCC", in_size, c.moved, now() - start);
+
+    return ret;
+}
+
+
+/**
+ * Convert 4 byte length prefixed NAL units into Annex-B, in place: every
+ * length becomes a 4 byte start code, nothing else changes. The lengths
+ * are all checked first, a file that does not parse is left as it is.
+ */
+int ConvertToAnnexB(const char *path, bool backup)
+{
+    static const uint8_t start_code[CONVERT_LENGTH_SIZE] = { 0x00, 0x00, 0x00, 0x01 };
+    uint64_t size;
+    uint64_t num = 0;
+    int ret = 0;
+
+    int fd = open_file(path, backup, size);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    double start = now();
+    uint8_t *data = map_file(fd, size);
+
+    if (data == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t p = 0;
+
+    if (size >= sizeof(start_code) && memcmp(data, start_code, sizeof(start_code)) == 0)
+    {
+        printf("%s: already starts with a start code, left unchanged\n", path);
+        ret = -1;
+    }
+
+    // walk the whole length chain before touching anything, a bad length
+    // must not leave a half converted file behind
+    while (ret == 0 && size - p >= CONVERT_LENGTH_SIZE)
+    {
+        uint64_t len = ((uint64_t) data[p] << 24) | (data[p + 1] << 16) | (data[p + 2] << 8) | data[p + 3];
+
+        if (len == 0 || len > size - p - CONVERT_LENGTH_SIZE)
+        {
+            printf("Bad NAL length %llu at 0x%llx, left unchanged\n", (unsigned long long) len, (unsigned long long) p);
+            ret = -1;
+            break;
+        }
+
+        p += CONVERT_LENGTH_SIZE + len;
+        num++;
+    }
+
+    if (ret < 0)
+    {
+        munmap(data, size);
+        close(fd);
+        return -1;
+    }
+
+    for (p = 0; size - p >= CONVERT_LENGTH_SIZE; )
+    {
+        uint64_t len = ((uint64_t) data[p] << 24) | (data[p + 1] << 16) | (data[p + 2] << 8) | data[p + 3];
+
+        memcpy(data + p, start_code, sizeof(start_code));
+
+        p += CONVERT_LENGTH_SIZE + len;
+    }
+
+    msync(data, size, MS_SYNC);
+    munmap(data, size);
+
+    if (fdatasync(fd) != 0)
+    {
+        perror(path);
+        ret = -1;
+    }
+
+    close(fd);
+
+    printf("%llu NAL units\n", (unsigned long long) num);
+
+    report("AVCC to Annex-B", size, 0, now() - start);
+
+    return ret;
+}
@@ -0,0 +1,15 @@
+
+
+#ifndef ___I_AVC_CONVERT_H___
+#define ___I_AVC_CONVERT_H___
+
+
+#define CONVERT_CHUNK_SIZE      (1024 * 1024)   // bytes moved through the carry buffer at a time
+#define CONVERT_LENGTH_SIZE     4
+
+
+extern int ConvertToAvcc(const char *path, bool backup);
+
+extern int ConvertToAnnexB(const char *path, bool backup);
+
+#endif
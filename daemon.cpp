@@ -0,0 +1,432 @@
+//
+//  daemon.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "output.h"
+#include "rewrite.h"
+#include "stream.h"
+#include "daemon.h"
+
+
+using namespace std;
+
+
+static volatile sig_atomic_t quit = 0;
+
+
+/******************************
+ * local function
+ */
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+
+/**
+ * True when a path has a ".." component.
+ */
+static bool has_dotdot(const char *path)
+{
+    for (const char *p = path; (p = strstr(p, "..")) != NULL; p += 2)
+    {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * Read the request line and up to two fds passed along with it.
+ */
+static int recv_request(int cfd, char *line, size_t size, int *fds, int &nfds)
+{
+    size_t len = 0;
+
+    nfds = 0;
+
+    while (len + 1 < size)
+    {
+        union
+        {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(2 * sizeof(int))];
+        } ctrl;
+
+        struct iovec iov = { line + len, size - 1 - len };
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov         = &iov;
+        msg.msg_iovlen      = 1;
+        msg.msg_control     = ctrl.buf;
+        msg.msg_controllen  = sizeof(ctrl.buf);
+
+        ssize_t rd_sz = recvmsg(cfd, &msg, MSG_CMSG_CLOEXEC);
+
+        if (rd_sz < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+
+            int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *p = (int *) CMSG_DATA(cmsg);
+
+            for (int i = 0; i < n; i++)
+            {
+                if (nfds < 2)
+                {
+                    fds[nfds++] = p[i];
+                }
+                else
+                {
+                    close(p[i]);
+                }
+            }
+        }
+
+        if (rd_sz <= 0)
+        {
+            return -1;
+        }
+
+        len += rd_sz;
+
+        if (memchr(line + len - rd_sz, '\n', rd_sz))
+        {
+            break;
+        }
+    }
+
+    line[len] = '\0';
+
+    return 0;
+}
+
+
+static void handle_job(int cfd, Stream_t &st)
+{
+    char line[DAEMON_LINE_MAX];
+    int fds[2];
+    int nfds;
+    int next_fd = 0;
+
+    if (recv_request(cfd, line, sizeof(line), fds, nfds) < 0)
+    {
+        for (int i = 0; i < nfds; i++)
+        {
+            close(fds[i]);
+        }
+        return;
+    }
+
+    char *save;
+    char *verb  = strtok_r(line, " \t\r\n", &save);
+    char *arg1  = verb ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+    char *arg2  = arg1 ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+    bool analyze = (verb && strcmp(verb, "ANALYZE") == 0);
+    int ifd = -1;
+    int ofd = -1;
+
+    if (verb == NULL || (!analyze && strcmp(verb, "FIX") != 0))
+    {
+        dprintf(cfd, "ERR unknown request\n");
+        goto done;
+    }
+
+    if (arg1)
+    {
+        ifd = open(arg1, O_RDONLY | O_CLOEXEC);
+    }
+    else if (next_fd < nfds)
+    {
+        ifd = fds[next_fd++];
+    }
+
+    if (ifd < 0)
+    {
+        dprintf(cfd, "ERR input: %s\n", arg1 ? strerror(errno) : "none");
+        goto done;
+    }
+
+    if (analyze)
+    {
+        ofd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    }
+    else if (arg2 && has_dotdot(arg2))
+    {
+        dprintf(cfd, "ERR output: .. not allowed\n");
+        goto done;
+    }
+    else if (arg2)
+    {
+        // a client only ever creates a new file, it never gets to truncate one
+        ofd = open(arg2, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+    else if (next_fd < nfds)
+    {
+        ofd = fds[next_fd++];
+    }
+    else
+    {
+        ofd = cfd;
+    }
+
+    if (ofd < 0)
+    {
+        dprintf(cfd, "ERR output: %s\n", strerror(errno));
+        goto done;
+    }
+
+    {
+        int saved = -1;
+
+        // the parse log is the answer to ANALYZE
+        if (analyze)
+        {
+            fflush(stdout);
+            saved = dup(STDOUT_FILENO);
+            dup2(cfd, STDOUT_FILENO);
+        }
+
+        // workers are processes, so the flag is this request's alone
+        rewrite_verbose = analyze;
+
+        ResetStream(st, ofd, false);
+
+        int64_t n = PumpStream(st, ifd);
+
+        if (analyze)
+        {
+            fflush(stdout);
+            dup2(saved, STDOUT_FILENO);
+            close(saved);
+        }
+
+        if (n < 0)
+        {
+            dprintf(cfd, "ERR read: %s\n", strerror(errno));
+        }
+        else if (!analyze && ofd != cfd)
+        {
+            dprintf(cfd, "OK %lld\n", (long long) n);
+        }
+    }
+
+done:
+    // passed fds are closed below, only close what was opened here
+    if (ifd >= 0 && arg1)
+    {
+        close(ifd);
+    }
+
+    if (ofd >= 0 && (analyze || arg2))
+    {
+        close(ofd);
+    }
+
+    for (int i = 0; i < nfds; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+
+/**
+ * Accept jobs one after the other until told to stop. The stream buffer
+ * stays allocated from one job to the next.
+ */
+static void worker(int lfd)
+{
+    Stream_t st;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // the per NAL log only goes out for ANALYZE
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0)
+    {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    if (InitStream(st, -1, false) < 0)
+    {
+        _exit(-1);
+    }
+
+    while (!quit)
+    {
+        int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (cfd < 0)
+        {
+            continue;
+        }
+
+        handle_job(cfd, st);
+        close(cfd);
+    }
+
+    FreeStream(st);
+
+    _exit(0);
+}
+
+
+static pid_t spawn_worker(int lfd)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        worker(lfd);
+    }
+
+    if (pid < 0)
+    {
+        perror("fork");
+    }
+
+    return pid;
+}
+
+
+/**
+ * Serve FIX and ANALYZE requests on a Unix domain socket.
+ *
+ * A pool of pre-forked workers accepts on the shared listening socket, so
+ * a request costs an accept() instead of a process start. Each worker
+ * runs one job at a time; a worker that dies on a bad stream takes only
+ * its own job down and is replaced.
+ */
+int RunDaemon(const char *sock_path, int workers)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", sock_path);
+        return -1;
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+
+    unlink(sock_path);
+
+    if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(lfd, SOMAXCONN) != 0)
+    {
+        perror(sock_path);
+        close(lfd);
+        return -1;
+    }
+
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fflush(stdout);
+
+    vector<pid_t> pids(workers);
+
+    for (int i = 0; i < workers; i++)
+    {
+        pids[i] = spawn_worker(lfd);
+    }
+
+    printf("Listening on %s with %d workers\n", sock_path, workers);
+    fflush(stdout);
+
+    while (!quit)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = 0; i < workers; i++)
+        {
+            if (pids[i] == pid && !quit)
+            {
+                printf("Worker %d exited, restarting\n", (int) pid);
+                fflush(stdout);
+                pids[i] = spawn_worker(lfd);
+            }
+        }
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (pids[i] > 0)
+        {
+            kill(pids[i], SIGTERM);
+        }
+    }
+
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+    {
+    }
+
+    close(lfd);
+    unlink(sock_path);
+
+    return 0;
+}
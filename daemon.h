@@ -0,0 +1,28 @@
+
+
+#ifndef ___I_AVC_DAEMON_H___
+#define ___I_AVC_DAEMON_H___
+
+
+#define DAEMON_WORKERS          4
+#define DAEMON_LINE_MAX         4096
+
+
+/*
+ * Requests are one text line, optionally with file descriptors attached
+ * (SCM_RIGHTS):
+ *
+ *   FIX [<input> [<output>]]
+ *   ANALYZE [<input>]
+ *
+ * A missing input is the first passed fd. A missing output is the second
+ * passed fd, and without one the fixed stream comes back over the
+ * connection, which is closed at its end. An output path must not exist
+ * yet and must not contain "..". FIX into a file or fd answers
+ * "OK <bytes read>". ANALYZE sends back the NAL log. Failures answer
+ * "ERR <reason>".
+ */
+extern int RunDaemon(const char *sock_path, int workers);
+
+#endif
+
@@ -0,0 +1,254 @@
+//
+//  direct.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "direct.h"
+
+
+/******************************
+ * local function
+ */
+
+static int pwrite_all(int fd, const uint8_t *buf, uint64_t len, uint64_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t wr_sz = pwrite(fd, buf, len, offset);
+
+        if (wr_sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buf     += wr_sz;
+        len     -= wr_sz;
+        offset  += wr_sz;
+    }
+
+    return 0;
+}
+
+
+static void *writer(void *arg)
+{
+    Direct_t *dw = (Direct_t *) arg;
+
+    pthread_mutex_lock(&dw->lock);
+
+    for (;;)
+    {
+        while (dw->job == NULL && !dw->quit)
+        {
+            pthread_cond_wait(&dw->cond, &dw->lock);
+        }
+
+        if (dw->job == NULL)
+        {
+            break;
+        }
+
+        uint8_t *buf    = dw->job;
+        uint64_t len    = dw->job_len;
+        uint64_t offset = dw->job_offset;
+
+        pthread_mutex_unlock(&dw->lock);
+
+        int err = (pwrite_all(dw->fd, buf, len, offset) < 0) ? errno : 0;
+
+        pthread_mutex_lock(&dw->lock);
+
+        if (err)
+        {
+            dw->error = err;
+        }
+
+        dw->job = NULL;
+        pthread_cond_broadcast(&dw->cond);
+    }
+
+    pthread_mutex_unlock(&dw->lock);
+
+    return NULL;
+}
+
+
+/**
+ * Wait for the buffer in flight, with the lock held on return.
+ */
+static void wait_idle(Direct_t *dw)
+{
+    pthread_mutex_lock(&dw->lock);
+
+    while (dw->job != NULL)
+    {
+        pthread_cond_wait(&dw->cond, &dw->lock);
+    }
+
+    if (dw->error)
+    {
+        errno = dw->error;
+        perror("O_DIRECT write");
+        exit(-1);
+    }
+}
+
+
+/**
+ * Hand the current buffer to the writer thread and switch to the other.
+ */
+static void submit(Direct_t *dw)
+{
+    wait_idle(dw);
+
+    dw->job         = dw->buf[dw->cur];
+    dw->job_len     = dw->fill;
+    dw->job_offset  = dw->offset;
+
+    pthread_cond_broadcast(&dw->cond);
+    pthread_mutex_unlock(&dw->lock);
+
+    dw->offset += dw->fill;
+    dw->cur    ^= 1;
+    dw->fill    = 0;
+}
+
+
+/**
+ * Set up the writer for fd, which was opened with O_DIRECT at offset 0.
+ */
+Direct_t *OpenDirect(int fd)
+{
+    Direct_t *dw = (Direct_t *) calloc(1, sizeof(Direct_t));
+
+    if (dw == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    dw->fd = fd;
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (posix_memalign((void **) &dw->buf[i], DIRECT_ALIGN, DIRECT_BUF_SIZE) != 0)
+        {
+            perror("posix_memalign");
+            free(dw->buf[0]);
+            free(dw);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&dw->lock, NULL);
+    pthread_cond_init(&dw->cond, NULL);
+
+    if (pthread_create(&dw->thread, NULL, writer, dw) != 0)
+    {
+        perror("pthread_create");
+        free(dw->buf[0]);
+        free(dw->buf[1]);
+        free(dw);
+        return NULL;
+    }
+
+    return dw;
+}
+
+
+void DirectWrite(Direct_t *dw, const uint8_t *data, uint64_t len)
+{
+    while (len > 0)
+    {
+        uint64_t n = DIRECT_BUF_SIZE - dw->fill;
+
+        if (n > len)
+        {
+            n = len;
+        }
+
+        memcpy(dw->buf[dw->cur] + dw->fill, data, n);
+
+        dw->fill += n;
+        data     += n;
+        len      -= n;
+
+        if (dw->fill == DIRECT_BUF_SIZE)
+        {
+            submit(dw);
+        }
+    }
+}
+
+
+/**
+ * Write what is left and stop the writer thread.
+ *
+ * The whole blocks still go out with O_DIRECT; the unaligned tail cannot,
+ * so O_DIRECT is switched off for it and its page dropped from the cache
+ * again once it is on disk.
+ */
+void CloseDirect(Direct_t *dw)
+{
+    wait_idle(dw);
+
+    dw->quit = true;
+    pthread_cond_broadcast(&dw->cond);
+    pthread_mutex_unlock(&dw->lock);
+
+    pthread_join(dw->thread, NULL);
+
+    uint8_t *buf  = dw->buf[dw->cur];
+    uint64_t body = dw->fill & ~((uint64_t) DIRECT_ALIGN - 1);
+    uint64_t tail = dw->fill - body;
+
+    if (body && pwrite_all(dw->fd, buf, body, dw->offset) < 0)
+    {
+        perror("O_DIRECT write");
+        exit(-1);
+    }
+
+    if (tail)
+    {
+        fcntl(dw->fd, F_SETFL, fcntl(dw->fd, F_GETFL) & ~O_DIRECT);
+
+        if (pwrite_all(dw->fd, buf + body, tail, dw->offset + body) < 0)
+        {
+            perror("write");
+            exit(-1);
+        }
+
+        fdatasync(dw->fd);
+        posix_fadvise(dw->fd, dw->offset + body, tail, POSIX_FADV_DONTNEED);
+    }
+
+    pthread_mutex_destroy(&dw->lock);
+    pthread_cond_destroy(&dw->cond);
+
+    free(dw->buf[0]);
+    free(dw->buf[1]);
+    free(dw);
+}
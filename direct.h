@@ -0,0 +1,42 @@
+
+
+#ifndef ___I_AVC_DIRECT_H___
+#define ___I_AVC_DIRECT_H___
+
+
+#define DIRECT_ALIGN            4096
+#define DIRECT_BUF_SIZE         (4 << 20)
+
+
+/*
+ * Double buffered O_DIRECT writer: one aligned buffer fills while the
+ * other is being written by a helper thread, so output bypasses the page
+ * cache without stalling the parser on every block.
+ */
+typedef struct Direct_t
+{
+    int      fd;
+    uint8_t *buf[2];
+    int      cur;                       // buffer being filled
+    uint64_t fill;
+    uint64_t offset;                    // file offset of buf[cur]
+
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    uint8_t        *job;                // buffer being written, NULL when idle
+    uint64_t        job_len;
+    uint64_t        job_offset;
+    bool            quit;
+    int             error;              // errno of a failed write
+} Direct_t;
+
+
+extern Direct_t *OpenDirect(int fd);
+
+extern void DirectWrite(Direct_t *dw, const uint8_t *data, uint64_t len);
+
+extern void CloseDirect(Direct_t *dw);
+
+#endif
+
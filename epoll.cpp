@@ -0,0 +1,283 @@
+//
+//  epoll.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "output.h"
+#include "rewrite.h"
+#include "stream.h"
+#include "epoll.h"
+
+
+using namespace std;
+
+
+typedef struct
+{
+    const char *name;
+    int      ifd;
+    int      ofd;
+    Stream_t st;
+    uint64_t bytes;
+    uint64_t reported;          // bytes at the last report
+    double   start;
+} Channel_t;
+
+
+/******************************
+ * local function
+ */
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+static int open_input(const char *name)
+{
+    if (strncmp(name, "fd:", 3) == 0)
+    {
+        int fd = atoi(name + 3);
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return fd;
+    }
+
+    // a FIFO without a writer yet must not block the others
+    return open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+
+static void finish(Channel_t *ch)
+{
+    StreamEnd(ch->st);
+    FlushOutput(ch->st.out);
+    FreeStream(ch->st);
+
+    double secs = now() - ch->start;
+
+    printf("%s: done, %llu bytes in %.2f s, %.1f MB/s\n",
+           ch->name,
+           (unsigned long long) ch->bytes,
+           secs,
+           secs > 0 ? ch->bytes / secs / 1e6 : 0.0);
+
+    close(ch->ifd);
+    close(ch->ofd);
+}
+
+
+/**
+ * Read what one stream has to offer, at most one chunk so that a busy
+ * stream cannot starve the others. Returns false at end of stream.
+ */
+static bool service(Channel_t *ch)
+{
+    for (;;)
+    {
+        uint8_t *p = StreamBuffer(ch->st);
+        ssize_t rd_sz = read(ch->ifd, p, STREAM_CHUNK_SIZE);
+
+        if (rd_sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+
+            perror(ch->name);
+            return false;
+        }
+
+        if (rd_sz == 0)
+        {
+            return false;
+        }
+
+        StreamData(ch->st, rd_sz);
+        FlushOutput(ch->st.out);
+
+        ch->bytes += rd_sz;
+
+        return true;
+    }
+}
+
+
+static void report(vector<Channel_t *> &channels, double interval)
+{
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        Channel_t *ch = channels[i];
+
+        if (ch == NULL)
+        {
+            continue;
+        }
+
+        printf("%s: %llu bytes, %.1f MB/s\n",
+               ch->name,
+               (unsigned long long) ch->bytes,
+               (ch->bytes - ch->reported) / interval / 1e6);
+
+        ch->reported = ch->bytes;
+    }
+
+    fflush(stdout);
+}
+
+
+/**
+ * Fix many live streams in one process.
+ *
+ * Every input (a path to a FIFO, device or file, or fd:N for an inherited
+ * pipe or socket) gets its own stream core and parser state, and is read
+ * without blocking whenever epoll reports data. Throughput per stream is
+ * printed every EPOLL_REPORT_INTERVAL seconds and when a stream ends.
+ */
+int RunEpoll(const char **inputs, const char **outputs, int num)
+{
+    vector<Channel_t *> channels(num, (Channel_t *) NULL);
+    int active = 0;
+    int ret = 0;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    for (int i = 0; i < num; i++)
+    {
+        Channel_t *ch = new Channel_t;
+
+        ch->name        = inputs[i];
+        ch->bytes       = 0;
+        ch->reported    = 0;
+        ch->start       = now();
+        ch->ifd         = open_input(inputs[i]);
+        ch->ofd         = open(outputs[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+        if (ch->ifd < 0 || ch->ofd < 0)
+        {
+            perror(ch->ifd < 0 ? inputs[i] : outputs[i]);
+            exit(-1);
+        }
+
+        if (InitStream(ch->st, ch->ofd, false) < 0)
+        {
+            exit(-1);
+        }
+
+        struct epoll_event ev;
+
+        ev.events   = EPOLLIN;
+        ev.data.u32 = i;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ch->ifd, &ev) != 0)
+        {
+            // regular files are always readable and cannot be polled
+            if (errno != EPERM)
+            {
+                perror(inputs[i]);
+                exit(-1);
+            }
+
+            while (service(ch))
+            {
+            }
+
+            finish(ch);
+            delete ch;
+            continue;
+        }
+
+        channels[i] = ch;
+        active++;
+    }
+
+    double last = now();
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (active > 0)
+    {
+        int n = epoll_wait(epfd, events, EPOLL_MAX_EVENTS, 1000);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("epoll_wait");
+            ret = -1;
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t id = events[i].data.u32;
+            Channel_t *ch = channels[id];
+
+            if (ch == NULL || service(ch))
+            {
+                continue;
+            }
+
+            epoll_ctl(epfd, EPOLL_CTL_DEL, ch->ifd, NULL);
+            finish(ch);
+            delete ch;
+
+            channels[id] = NULL;
+            active--;
+        }
+
+        double t = now();
+
+        if (t - last >= EPOLL_REPORT_INTERVAL)
+        {
+            report(channels, t - last);
+            last = t;
+        }
+    }
+
+    close(epfd);
+
+    return ret;
+}
@@ -0,0 +1,14 @@
+
+
+#ifndef ___I_AVC_EPOLL_H___
+#define ___I_AVC_EPOLL_H___
+
+
+#define EPOLL_MAX_EVENTS        64
+#define EPOLL_REPORT_INTERVAL   10      // seconds
+
+
+extern int RunEpoll(const char **inputs, const char **outputs, int num);
+
+#endif
+
@@ -0,0 +1,693 @@
+//
+//  fmp4.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "input.h"
+#include "nal.h"
+#include "output.h"
+#include "rewrite.h"
+#include "fmp4.h"
+
+
+using namespace std;
+
+
+typedef struct
+{
+    uint32_t size;
+    uint32_t flags;
+} Sample_t;
+
+
+typedef struct
+{
+    Input_t  *input;
+    Output_t  out;
+    Rewrite_t rw;
+
+    vector< vector<uint8_t> > sps;      // parameter sets for avcC, as rewritten, without start code
+    vector< vector<uint8_t> > pps;
+    bool     sets_done;                 // first slice seen, later parameter sets stay in band
+    SPS_t    init_sps;                  // the SPS active at the first slice, describes the track
+    bool     init_done;
+    uint32_t duration;
+
+    // the fragment being collected: input ranges and pool bytes, as in Output_t
+    vector<Segment_t> pieces;
+    vector<uint8_t>   pool;             // length prefixes and regenerated headers
+    vector<Sample_t>  samples;          // complete samples, the access unit in progress follows
+
+    size_t   au_piece;                  // first piece of the access unit in progress
+    uint32_t au_size;
+    uint32_t au_flags;
+    bool     au_vcl;
+
+    uint32_t sequence;
+    uint64_t decode_time;
+    uint64_t num_fragments;
+    uint64_t num_samples;
+} Fmp4_t;
+
+
+static const uint32_t unity_matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+
+
+/******************************
+ * local function
+ */
+
+static void put8(vector<uint8_t> &v, uint32_t x)
+{
+    v.push_back(x);
+}
+
+
+static void put16(vector<uint8_t> &v, uint32_t x)
+{
+    v.push_back(x >> 8);
+    v.push_back(x);
+}
+
+
+static void put32(vector<uint8_t> &v, uint32_t x)
+{
+    put16(v, x >> 16);
+    put16(v, x);
+}
+
+
+static void put64(vector<uint8_t> &v, uint64_t x)
+{
+    put32(v, x >> 32);
+    put32(v, x);
+}
+
+
+static void put_zeros(vector<uint8_t> &v, size_t n)
+{
+    v.insert(v.end(), n, 0x00);
+}
+
+
+static void set32(vector<uint8_t> &v, size_t pos, uint32_t x)
+{
+    v[pos]      = x >> 24;
+    v[pos + 1]  = x >> 16;
+    v[pos + 2]  = x >> 8;
+    v[pos + 3]  = x;
+}
+
+
+static size_t begin_box(vector<uint8_t> &v, const char *type)
+{
+    size_t pos = v.size();
+
+    put32(v, 0);
+    v.insert(v.end(), type, type + 4);
+
+    return pos;
+}
+
+
+static size_t begin_full_box(vector<uint8_t> &v, const char *type, uint8_t version, uint32_t flags)
+{
+    size_t pos = begin_box(v, type);
+
+    put32(v, (version << 24) | flags);
+
+    return pos;
+}
+
+
+static void end_box(vector<uint8_t> &v, size_t pos)
+{
+    set32(v, pos, v.size() - pos);
+}
+
+
+static void put_matrix(vector<uint8_t> &v)
+{
+    for (int i = 0; i < 9; i++)
+    {
+        put32(v, unity_matrix[i]);
+    }
+}
+
+
+static SPS_t *first_sps(Fmp4_t &w)
+{
+    for (int i = 0; i < 32; i++)
+    {
+        if (w.rw.ps->SPSs[i].isValid)
+        {
+            return &w.rw.ps->SPSs[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * avcC from the parsed SPS and the parameter sets as they were rewritten.
+ * Every field describing the stream comes from sps, the one the track
+ * dimensions are taken from.
+ */
+static void put_avcC(Fmp4_t &w, vector<uint8_t> &v, SPS_t *sps)
+{
+    uint8_t compat = (sps->constrained_set0_flag << 7) | (sps->constrained_set1_flag << 6)
+                   | (sps->constrained_set2_flag << 5) | (sps->constrained_set3_flag << 4)
+                   | (sps->constrained_set4_flag << 3) | (sps->constrained_set5_flag << 2);
+    size_t avcC = begin_box(v, "avcC");
+
+    put8(v, 1);                                     // configurationVersion
+    put8(v, sps->profile_idc);                      // AVCProfileIndication
+    put8(v, compat);                                // profile_compatibility
+    put8(v, sps->level_idc);                        // AVCLevelIndication
+    put8(v, 0xFC | 3);                              // lengthSizeMinusOne
+
+    put8(v, 0xE0 | w.sps.size());
+    for (size_t i = 0; i < w.sps.size(); i++)
+    {
+        put16(v, w.sps[i].size());
+        v.insert(v.end(), w.sps[i].begin(), w.sps[i].end());
+    }
+
+    put8(v, w.pps.size());
+    for (size_t i = 0; i < w.pps.size(); i++)
+    {
+        put16(v, w.pps[i].size());
+        v.insert(v.end(), w.pps[i].begin(), w.pps[i].end());
+    }
+
+    if (sps->profile_idc == 100 || sps->profile_idc == 110 || sps->profile_idc == 122 || sps->profile_idc == 144)
+    {
+        put8(v, 0xFC | sps->chroma_format_idc);
+        put8(v, 0xF8 | sps->bit_depth_luma_minus8);
+        put8(v, 0xF8 | sps->bit_depth_chroma_minus8);
+        put8(v, 0);                                 // numOfSequenceParameterSetExt
+    }
+
+    end_box(v, avcC);
+}
+
+
+/**
+ * ftyp and moov of the CMAF track: one video track without samples, the
+ * samples all live in the fragments.
+ */
+static void write_init(Fmp4_t &w)
+{
+    SPS_t *sps = &w.init_sps;
+    vector<uint8_t> v;
+
+    uint32_t crop_x = (sps->chroma_format_idc == 1 || sps->chroma_format_idc == 2) ? 2 : 1;
+    uint32_t crop_y = ((sps->chroma_format_idc == 1) ? 2 : 1) * (2 - sps->frame_mbs_only_flag);
+    uint32_t width  = (sps->pic_width_in_mbs_minus1 + 1) * 16;
+    uint32_t height = (sps->pic_height_in_map_units_minus1 + 1) * 16 * (2 - sps->frame_mbs_only_flag);
+
+    if (sps->frame_cropping_flag)
+    {
+        width  -= crop_x * (sps->frame_crop_left_offset + sps->frame_crop_right_offset);
+        height -= crop_y * (sps->frame_crop_top_offset + sps->frame_crop_bottom_offset);
+    }
+
+    VUI_t &vui = sps->vui_seq_parameters;
+
+    w.duration = FMP4_DEFAULT_DURATION;
+
+    if (sps->vui_parameters_present_flag && vui.timing_info_present_flag && vui.time_scale)
+    {
+        w.duration = (uint64_t) FMP4_TIMESCALE * 2 * vui.num_units_in_tick / vui.time_scale;
+    }
+
+    size_t ftyp = begin_box(v, "ftyp");
+    v.insert(v.end(), "cmfc", "cmfc" + 4);
+    put32(v, 0);
+    v.insert(v.end(), "cmfciso6avc1", "cmfciso6avc1" + 12);
+    end_box(v, ftyp);
+
+    size_t moov = begin_box(v, "moov");
+    {
+        size_t mvhd = begin_full_box(v, "mvhd", 0, 0);
+        put_zeros(v, 8);                            // creation/modification_time
+        put32(v, FMP4_TIMESCALE);
+        put32(v, 0);                                // duration, given by the fragments
+        put32(v, 0x00010000);                       // rate
+        put16(v, 0x0100);                           // volume
+        put_zeros(v, 10);
+        put_matrix(v);
+        put_zeros(v, 24);
+        put32(v, FMP4_TRACK_ID + 1);                // next_track_ID
+        end_box(v, mvhd);
+
+        size_t trak = begin_box(v, "trak");
+        {
+            size_t tkhd = begin_full_box(v, "tkhd", 0, 0x000003);   // enabled, in movie
+            put_zeros(v, 8);
+            put32(v, FMP4_TRACK_ID);
+            put_zeros(v, 4);
+            put32(v, 0);                            // duration
+            put_zeros(v, 16);                       // reserved, layer, alternate_group, volume, reserved
+            put_matrix(v);
+            put32(v, width << 16);
+            put32(v, height << 16);
+            end_box(v, tkhd);
+
+            size_t mdia = begin_box(v, "mdia");
+            {
+                size_t mdhd = begin_full_box(v, "mdhd", 0, 0);
+                put_zeros(v, 8);
+                put32(v, FMP4_TIMESCALE);
+                put32(v, 0);
+                put16(v, 0x55C4);                   // 'und'
+                put16(v, 0);
+                end_box(v, mdhd);
+
+                size_t hdlr = begin_full_box(v, "hdlr", 0, 0);
+                put32(v, 0);
+                v.insert(v.end(), "vide", "vide" + 4);
+                put_zeros(v, 12);
+                v.insert(v.end(), "iAvc", "iAvc" + 5);
+                end_box(v, hdlr);
+
+                size_t minf = begin_box(v, "minf");
+                {
+                    size_t vmhd = begin_full_box(v, "vmhd", 0, 0x000001);
+                    put_zeros(v, 8);
+                    end_box(v, vmhd);
+
+                    size_t dinf = begin_box(v, "dinf");
+                    size_t dref = begin_full_box(v, "dref", 0, 0);
+                    put32(v, 1);
+                    size_t url = begin_full_box(v, "url ", 0, 0x000001);   // media in the same file
+                    end_box(v, url);
+                    end_box(v, dref);
+                    end_box(v, dinf);
+
+                    size_t stbl = begin_box(v, "stbl");
+                    {
+                        size_t stsd = begin_full_box(v, "stsd", 0, 0);
+                        put32(v, 1);
+
+                        size_t avc1 = begin_box(v, "avc1");
+                        put_zeros(v, 6);
+                        put16(v, 1);                // data_reference_index
+                        put_zeros(v, 16);
+                        put16(v, width);
+                        put16(v, height);
+                        put32(v, 0x00480000);       // 72 dpi
+                        put32(v, 0x00480000);
+                        put32(v, 0);
+                        put16(v, 1);                // frame_count
+                        put_zeros(v, 32);           // compressorname
+                        put16(v, 0x0018);           // depth
+                        put16(v, 0xFFFF);           // pre_defined = -1
+                        put_avcC(w, v, sps);
+                        end_box(v, avc1);
+
+                        end_box(v, stsd);
+
+                        const char *empty[] = { "stts", "stsc", "stco" };
+
+                        for (int i = 0; i < 3; i++)
+                        {
+                            size_t box = begin_full_box(v, empty[i], 0, 0);
+                            put32(v, 0);
+                            end_box(v, box);
+                        }
+
+                        size_t stsz = begin_full_box(v, "stsz", 0, 0);
+                        put32(v, 0);
+                        put32(v, 0);
+                        end_box(v, stsz);
+                    }
+                    end_box(v, stbl);
+                }
+                end_box(v, minf);
+            }
+            end_box(v, mdia);
+        }
+        end_box(v, trak);
+
+        size_t mvex = begin_box(v, "mvex");
+        size_t trex = begin_full_box(v, "trex", 0, 0);
+        put32(v, FMP4_TRACK_ID);
+        put32(v, 1);                                // default_sample_description_index
+        put32(v, w.duration);
+        put32(v, 0);
+        put32(v, 0);
+        end_box(v, trex);
+        end_box(v, mvex);
+    }
+    end_box(v, moov);
+
+    OutputBytes(w.out, v.data(), v.size());
+}
+
+
+static void add_bytes(Fmp4_t &w, const uint8_t *p, uint64_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+
+    if (!w.pieces.empty() && !w.pieces.back().isInput
+     && w.pieces.back().offset + w.pieces.back().length == w.pool.size())
+    {
+        w.pieces.back().length += len;
+    }
+    else
+    {
+        Segment_t s = { w.pool.size(), len, false };
+
+        w.pieces.push_back(s);
+    }
+
+    w.pool.insert(w.pool.end(), p, p + len);
+}
+
+
+static void add_range(Fmp4_t &w, uint64_t offset, uint64_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+
+    Segment_t s = { offset, len, true };
+
+    w.pieces.push_back(s);
+}
+
+
+static void end_au(Fmp4_t &w)
+{
+    if (w.au_size > 0)
+    {
+        Sample_t s = { w.au_size, w.au_flags };
+
+        w.samples.push_back(s);
+    }
+
+    w.au_piece  = w.pieces.size();
+    w.au_size   = 0;
+    w.au_flags  = FMP4_SAMPLE_NON_SYNC;
+    w.au_vcl    = false;
+}
+
+
+/**
+ * Write moof and mdat for the complete samples, whose data are the first
+ * num_pieces pieces; the pieces of the access unit in progress are kept.
+ * Returns the input offset that is no longer needed.
+ */
+static uint64_t flush_fragment(Fmp4_t &w, size_t num_pieces, uint64_t offset)
+{
+    if (w.samples.empty())
+    {
+        return 0;
+    }
+
+    if (!w.init_done)
+    {
+        write_init(w);
+        w.init_done = true;
+    }
+
+    vector<uint8_t> v;
+    uint64_t mdat_size = 8;
+
+    for (size_t i = 0; i < w.samples.size(); i++)
+    {
+        mdat_size += w.samples[i].size;
+    }
+
+    size_t data_offset = 0;
+    size_t moof = begin_box(v, "moof");
+    {
+        size_t mfhd = begin_full_box(v, "mfhd", 0, 0);
+        put32(v, ++w.sequence);
+        end_box(v, mfhd);
+
+        size_t traf = begin_box(v, "traf");
+        {
+            size_t tfhd = begin_full_box(v, "tfhd", 0, 0x020000);  // default-base-is-moof
+            put32(v, FMP4_TRACK_ID);
+            end_box(v, tfhd);
+
+            size_t tfdt = begin_full_box(v, "tfdt", 1, 0);
+            put64(v, w.decode_time);
+            end_box(v, tfdt);
+
+            // data-offset, sample-duration, sample-size and sample-flags present
+            size_t trun = begin_full_box(v, "trun", 0, 0x000701);
+            put32(v, w.samples.size());
+
+            data_offset = v.size();
+            put32(v, 0);
+
+            for (size_t i = 0; i < w.samples.size(); i++)
+            {
+                put32(v, w.duration);
+                put32(v, w.samples[i].size);
+                put32(v, w.samples[i].flags);
+            }
+            end_box(v, trun);
+        }
+        end_box(v, traf);
+    }
+    end_box(v, moof);
+
+    // the samples start right behind the mdat header
+    set32(v, data_offset, v.size() - moof + 8);
+
+    put32(v, mdat_size);
+    v.insert(v.end(), "mdat", "mdat" + 4);
+
+    OutputBytes(w.out, v.data(), v.size());
+
+    // payloads go out as input ranges, never through a buffer of ours
+    for (size_t i = 0; i < num_pieces; i++)
+    {
+        Segment_t &s = w.pieces[i];
+
+        if (s.isInput)
+        {
+            OutputRange(w.out, s.offset, s.length);
+        }
+        else
+        {
+            OutputBytes(w.out, w.pool.data() + s.offset, s.length);
+        }
+    }
+
+    FlushOutput(w.out);
+
+    w.decode_time   += (uint64_t) w.samples.size() * w.duration;
+    w.num_samples   += w.samples.size();
+    w.num_fragments++;
+    w.samples.clear();
+
+    // carry the access unit in progress over to the next fragment
+    vector<Segment_t> rest(w.pieces.begin() + num_pieces, w.pieces.end());
+    vector<uint8_t> pool;
+
+    for (size_t i = 0; i < rest.size(); i++)
+    {
+        if (!rest[i].isInput)
+        {
+            pool.insert(pool.end(), w.pool.begin() + rest[i].offset, w.pool.begin() + rest[i].offset + rest[i].length);
+            rest[i].offset = pool.size() - rest[i].length;
+        }
+        else if (rest[i].offset < offset)
+        {
+            offset = rest[i].offset;
+        }
+    }
+
+    w.pieces.swap(rest);
+    w.pool.swap(pool);
+    w.au_piece -= num_pieces;
+
+    return offset;
+}
+
+
+static bool same_set(vector< vector<uint8_t> > &sets, vector<uint8_t> &nal)
+{
+    for (size_t i = 0; i < sets.size(); i++)
+    {
+        if (sets[i] == nal)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * Write a fixed stream as a fragmented MP4 (CMAF) track in one pass.
+ *
+ * Every NAL goes through the usual rewrite and becomes a 4 byte length
+ * prefix, the regenerated header and the untouched rest of its payload,
+ * which is queued as an input range. Payload bytes are never copied in
+ * user space. Access units become samples: IDR pictures are sync samples,
+ * pictures with nal_ref_idc 0 are marked disposable. A new fragment
+ * starts at every IDR picture.
+ *
+ * SPS and PPS seen before the first slice go into avcC and out of the
+ * samples; later ones that differ from those stay in band. Samples get a
+ * constant duration from the VUI timing info, there is no composition
+ * offset for reordered pictures.
+ */
+int RunFmp4(Input_t &input, int ofd)
+{
+    Fmp4_t w;
+
+    w.input         = &input;
+    w.sets_done     = false;
+    w.init_done     = false;
+    w.duration      = FMP4_DEFAULT_DURATION;
+    w.sequence      = 0;
+    w.decode_time   = 0;
+    w.num_fragments = 0;
+    w.num_samples   = 0;
+    w.au_size       = 0;
+
+    end_au(w);
+
+    if (InitRewrite(w.rw) < 0)
+    {
+        return -1;
+    }
+
+    InitOutput(w.out, ofd, input.fd, input.data);
+
+    const uint8_t *data = input.data;
+    vector<uint8_t> patch;
+    vector<uint8_t> nal;
+    NalIter_t it;
+    NalUnit_t unit;
+    int ret = 0;
+
+    InitNalIter(it, data, input.size, 0);
+
+    while (NextNal(it, unit))
+    {
+        uint64_t start      = unit.offset;
+        uint32_t prefix_len = unit.prefix_len;
+        uint64_t nal_end    = start + unit.size;
+
+        if (unit.size <= prefix_len)
+        {
+            continue;
+        }
+
+        uint8_t nal_unit_type   = unit.nal_unit_type;
+        uint8_t nal_ref_idc     = unit.nal_ref_idc;
+        bool    is_slice        = (nal_unit_type == NALU_TYPE_SLICE || nal_unit_type == NALU_TYPE_IDR);
+        uint64_t nal_len        = nal_end - start;
+        uint64_t replaced       = RewriteNal(w.rw, (uint8_t *) data + start, nal_len, prefix_len, start, patch);
+
+        bool new_au = StartsAccessUnit(nal_unit_type, replaced && w.rw.slice.first_mb_in_slice == 0);
+
+        if (w.au_vcl && new_au)
+        {
+            end_au(w);
+        }
+
+        if (is_slice && !w.au_vcl)
+        {
+            if (nal_unit_type == NALU_TYPE_IDR && !w.samples.empty())
+            {
+                ReleaseInput(input, flush_fragment(w, w.au_piece, start));
+            }
+
+            if (!w.init_done && (w.sps.empty() || w.pps.empty() || first_sps(w) == NULL))
+            {
+                printf("No SPS/PPS before the first slice at 0x%llx\n", (unsigned long long) start);
+                ret = -1;
+                break;
+            }
+
+            if (!w.sets_done)
+            {
+                w.init_sps  = replaced ? w.rw.ps->SPSs[w.rw.ps->PPSs[w.rw.slice.pic_parameter_set_id].seq_parameter_set_id]
+                                       : *first_sps(w);
+                w.sets_done = true;
+            }
+
+            w.au_flags  = (nal_unit_type == NALU_TYPE_IDR) ? FMP4_SAMPLE_SYNC : FMP4_SAMPLE_NON_SYNC;
+            w.au_flags |= (nal_ref_idc == 0) ? FMP4_SAMPLE_DISPOSABLE : 0;
+            w.au_vcl    = true;
+        }
+
+        uint64_t body = replaced ? replaced : prefix_len;
+        uint32_t head = replaced ? patch.size() - prefix_len : 0;
+        uint32_t new_len = head + (nal_end - start - body);
+
+        if (nal_unit_type == NALU_TYPE_SPS || nal_unit_type == NALU_TYPE_PPS)
+        {
+            vector< vector<uint8_t> > &sets = (nal_unit_type == NALU_TYPE_SPS) ? w.sps : w.pps;
+
+            nal.assign(patch.begin() + (replaced ? prefix_len : patch.size()), patch.end());
+            nal.insert(nal.end(), data + start + body, data + nal_end);
+
+            if (same_set(sets, nal))
+            {
+                continue;
+            }
+
+            if (!w.sets_done && sets.size() < ((nal_unit_type == NALU_TYPE_SPS) ? 31u : 255u))
+            {
+                sets.push_back(nal);
+                continue;
+            }
+        }
+
+        uint8_t len[4] = { (uint8_t) (new_len >> 24), (uint8_t) (new_len >> 16), (uint8_t) (new_len >> 8), (uint8_t) new_len };
+
+        add_bytes(w, len, sizeof(len));
+        add_bytes(w, patch.data() + prefix_len, head);
+        add_range(w, start + body, nal_end - start - body);
+
+        w.au_size += sizeof(len) + new_len;
+    }
+
+    if (ret == 0)
+    {
+        end_au(w);
+        flush_fragment(w, w.pieces.size(), input.size);
+    }
+
+    CloseOutput(w.out);
+    FreeRewrite(w.rw);
+
+    printf("fMP4: %llu fragments, %llu samples, %u/%u ticks per sample\n",
+           (unsigned long long) w.num_fragments,
+           (unsigned long long) w.num_samples,
+           w.duration, FMP4_TIMESCALE);
+
+    return ret;
+}
@@ -0,0 +1,18 @@
+
+
+#ifndef ___I_AVC_FMP4_H___
+#define ___I_AVC_FMP4_H___
+
+
+#define FMP4_TIMESCALE          90000
+#define FMP4_DEFAULT_DURATION   3000        // 30 fps when the SPS has no timing info
+#define FMP4_TRACK_ID           1
+
+#define FMP4_SAMPLE_SYNC        0x02000000  // sample_depends_on = 2
+#define FMP4_SAMPLE_NON_SYNC    0x01010000  // sample_depends_on = 1, sample_is_non_sync_sample
+#define FMP4_SAMPLE_DISPOSABLE  0x00800000  // sample_is_depended_on = 2, nal_ref_idc == 0
+
+
+extern int RunFmp4(Input_t &input, int ofd);
+
+#endif
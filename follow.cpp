@@ -0,0 +1,210 @@
+//
+//  follow.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "output.h"
+#include "rewrite.h"
+#include "stream.h"
+#include "follow.h"
+
+
+using namespace std;
+
+
+static volatile sig_atomic_t quit = 0;
+
+
+/******************************
+ * local function
+ */
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+
+/**
+ * Feed everything appended since the last call. Returns the number of
+ * bytes read, or -1.
+ */
+static int64_t drain(Stream_t &st, int ifd)
+{
+    int64_t total = 0;
+
+    for (;;)
+    {
+        uint8_t *p = StreamBuffer(st);
+        ssize_t rd_sz = read(ifd, p, STREAM_CHUNK_SIZE);
+
+        if (rd_sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("read");
+            return -1;
+        }
+
+        if (rd_sz == 0)
+        {
+            return total;
+        }
+
+        StreamData(st, rd_sz);
+        FlushOutput(st.out);
+
+        total += rd_sz;
+    }
+}
+
+
+/**
+ * Fix a recording that is still being written.
+ *
+ * The file is read to its current end, then inotify wakes us up whenever
+ * it grows and only the appended bytes are parsed, with the parameter
+ * sets of the earlier part still known. Headers are rewritten as soon as
+ * they are complete and payload is forwarded as it arrives, so the output
+ * trails the recording by the last few bytes of a NAL at most.
+ *
+ * Following stops when the file is renamed or removed (rotation), when it
+ * is truncated, or on SIGINT/SIGTERM; the rest is then flushed normally.
+ */
+int RunFollow(const char *path, int ofd)
+{
+    Stream_t st;
+    uint64_t consumed = 0;
+    struct stat sb;
+    int ret = 0;
+
+    int ifd = open(path, O_RDONLY | O_CLOEXEC);
+    if (ifd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    int nfd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (nfd < 0 || inotify_add_watch(nfd, path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) < 0)
+    {
+        perror("inotify");
+        close(ifd);
+        return -1;
+    }
+
+    if (InitStream(st, ofd, true) < 0)
+    {
+        close(nfd);
+        close(ifd);
+        return -1;
+    }
+
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fprintf(stderr, "Following %s\n", path);
+
+    bool rotated = false;
+
+    while (!quit && !rotated)
+    {
+        int64_t n = drain(st, ifd);
+
+        if (n < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        consumed += n;
+
+        if (fstat(ifd, &sb) == 0 && (uint64_t) sb.st_size < consumed)
+        {
+            fprintf(stderr, "%s truncated, stop following\n", path);
+            break;
+        }
+
+        // the timeout only bounds how long a lost event can delay us
+        struct pollfd pfd = { nfd, POLLIN, 0 };
+
+        if (poll(&pfd, 1, FOLLOW_POLL_MS) <= 0)
+        {
+            continue;
+        }
+
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+
+        while ((len = read(nfd, events, sizeof(events))) > 0)
+        {
+            for (char *p = events; p < events + len; )
+            {
+                struct inotify_event *ev = (struct inotify_event *) p;
+
+                if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                {
+                    rotated = true;
+                }
+
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+
+    if (rotated)
+    {
+        fprintf(stderr, "%s rotated, stop following\n", path);
+    }
+
+    // whatever was appended before the rotation still belongs to us
+    int64_t n = (ret == 0) ? drain(st, ifd) : 0;
+
+    if (n > 0)
+    {
+        consumed += n;
+    }
+
+    StreamEnd(st);
+    FlushOutput(st.out);
+    FreeStream(st);
+
+    fprintf(stderr, "Followed %s: %llu bytes\n", path, (unsigned long long) consumed);
+
+    close(nfd);
+    close(ifd);
+
+    return (n < 0) ? -1 : ret;
+}
@@ -0,0 +1,13 @@
+
+
+#ifndef ___I_AVC_FOLLOW_H___
+#define ___I_AVC_FOLLOW_H___
+
+
+#define FOLLOW_POLL_MS          1000
+
+
+extern int RunFollow(const char *path, int ofd);
+
+#endif
+
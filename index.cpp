@@ -0,0 +1,473 @@
+//
+//  index.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "input.h"
+#include "nal.h"
+#include "output.h"
+#include "rewrite.h"
+#include "index.h"
+
+
+using namespace std;
+
+
+#define NAL_INDEX_WRITE_BATCH   4096            // records buffered per write
+
+
+static const char NAL_INDEX_MAGIC[8] = { 'I', 'A', 'V', 'C', 'N', 'I', 'D', 'X' };
+
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t input_size;
+    int64_t  mtime_sec;                 // the input as it was indexed
+    int64_t  mtime_nsec;
+    uint64_t num;
+} NalIndexHeader_t;
+
+
+/******************************
+ * local function
+ */
+
+static void index_path(const char *input_path, char *path, size_t size)
+{
+    snprintf(path, size, "%s%s", input_path, NAL_INDEX_SUFFIX);
+}
+
+
+// adjust hook: the slice fields as parsed, before RewriteNal renumbers frame_num
+static void note_slice(Rewrite_t &rw, uint8_t &nal_header, void *arg)
+{
+    NalIndex_t *rec = (NalIndex_t *) arg;
+
+    rec->slice_type         = rw.slice.slice_type;
+    rec->first_mb_in_slice  = rw.slice.first_mb_in_slice;
+    rec->frame_num          = rw.slice.frame_num;
+    rec->flags             |= NAL_INDEX_SLICE;
+}
+
+
+static bool is_slice(const NalIndex_t &n)
+{
+    return (n.nal_unit_type == NALU_TYPE_SLICE || n.nal_unit_type == NALU_TYPE_IDR);
+}
+
+
+/**
+ * Write the latest SPS and PPS in front of record first, in file order,
+ * for a clip whose first access unit does not carry its own.
+ */
+static void output_sets(Output_t &out, NalIndexFile_t &idx, uint64_t first, uint64_t pic)
+{
+    int64_t sps = -1;
+    int64_t pps = -1;
+
+    for (uint64_t i = first; i < pic; i++)
+    {
+        if (idx.nals[i].nal_unit_type == NALU_TYPE_SPS || idx.nals[i].nal_unit_type == NALU_TYPE_PPS)
+        {
+            return;
+        }
+    }
+
+    for (uint64_t i = first; i > 0 && (sps < 0 || pps < 0); i--)
+    {
+        if (idx.nals[i - 1].nal_unit_type == NALU_TYPE_SPS && sps < 0)
+        {
+            sps = i - 1;
+        }
+        else if (idx.nals[i - 1].nal_unit_type == NALU_TYPE_PPS && pps < 0)
+        {
+            pps = i - 1;
+        }
+    }
+
+    if (sps >= 0)
+    {
+        OutputRange(out, idx.nals[sps].offset, idx.nals[sps].size);
+    }
+
+    if (pps >= 0)
+    {
+        OutputRange(out, idx.nals[pps].offset, idx.nals[pps].size);
+    }
+}
+
+
+/**
+ * Map the sidecar index of input_path if it exists and still describes
+ * the input: same format, same size and same mtime. Returns -1 otherwise,
+ * the caller rebuilds it then.
+ */
+int LoadNalIndex(const char *input_path, NalIndexFile_t &idx)
+{
+    char path[PATH_MAX];
+    struct stat in_st;
+    struct stat st;
+    NalIndexHeader_t hdr;
+
+    idx.map         = NULL;
+    idx.map_size    = 0;
+    idx.nals        = NULL;
+    idx.num         = 0;
+
+    if (stat(input_path, &in_st) != 0)
+    {
+        perror(input_path);
+        return -1;
+    }
+
+    index_path(input_path, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < sizeof(hdr)
+     || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr))
+    {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t body = (uint64_t) st.st_size - sizeof(hdr);
+
+    if (memcmp(hdr.magic, NAL_INDEX_MAGIC, sizeof(hdr.magic)) != 0
+     || hdr.version != NAL_INDEX_VERSION
+     || hdr.record_size != sizeof(NalIndex_t)
+     || body % sizeof(NalIndex_t) != 0 || body / sizeof(NalIndex_t) != hdr.num
+     || hdr.input_size != (uint64_t) in_st.st_size
+     || hdr.mtime_sec != (int64_t) in_st.st_mtim.tv_sec
+     || hdr.mtime_nsec != (int64_t) in_st.st_mtim.tv_nsec)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (addr == MAP_FAILED)
+    {
+        perror(path);
+        return -1;
+    }
+
+    idx.map         = (uint8_t *) addr;
+    idx.map_size    = st.st_size;
+    idx.nals        = (const NalIndex_t *) (idx.map + sizeof(hdr));
+    idx.num         = hdr.num;
+
+    return 0;
+}
+
+
+/**
+ * Scan input_path once and write <input_path>.idx, one record per NAL
+ * unit. The slice fields come from the same parser the rewrite uses. The
+ * index is written next to its final name and renamed over it, then
+ * mapped into idx.
+ */
+int BuildNalIndex(const char *input_path, NalIndexFile_t &idx)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 8];
+    struct stat st;
+    Input_t input;
+    Rewrite_t rw;
+    NalIter_t it;
+    NalUnit_t unit;
+    NalIndex_t rec;
+    NalIndexHeader_t hdr;
+    vector<NalIndex_t> batch;
+    vector<uint8_t> patch;
+    int ret = 0;
+
+    if (OpenInput(input_path, input) < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(input.fd, &st) != 0 || InitRewrite(rw) < 0)
+    {
+        perror(input_path);
+        CloseInput(input);
+        return -1;
+    }
+
+    rw.adjust       = note_slice;
+    rw.adjust_arg   = &rec;
+
+    index_path(input_path, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0)
+    {
+        perror(tmp);
+        FreeRewrite(rw);
+        CloseInput(input);
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, NAL_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version     = NAL_INDEX_VERSION;
+    hdr.record_size = sizeof(NalIndex_t);
+    hdr.input_size  = input.size;
+    hdr.mtime_sec   = st.st_mtim.tv_sec;
+    hdr.mtime_nsec  = st.st_mtim.tv_nsec;
+
+    // the header goes in last, with the record count
+    WriteAll(fd, (uint8_t *) &hdr, sizeof(hdr));
+
+    InitNalIter(it, input.data, input.size, 0);
+
+    while (NextNal(it, unit))
+    {
+        if (unit.size <= unit.prefix_len)
+        {
+            continue;
+        }
+
+        if (unit.size > 0xFFFFFFFFull)
+        {
+            printf("NAL at 0x%llx too long for the index\n", (unsigned long long) unit.offset);
+            ret = -1;
+            break;
+        }
+
+        memset(&rec, 0, sizeof(rec));
+        rec.offset          = unit.offset;
+        rec.size            = unit.size;
+        rec.nal_unit_type   = unit.nal_unit_type;
+        rec.nal_ref_idc     = unit.nal_ref_idc;
+        rec.slice_type      = NAL_INDEX_NO_SLICE;
+        rec.flags           = (unit.nal_unit_type == NALU_TYPE_IDR) ? NAL_INDEX_IDR : 0;
+
+        RewriteNal(rw, input.data + unit.offset, input.size - unit.offset, unit.prefix_len, unit.offset, patch);
+
+        batch.push_back(rec);
+        hdr.num++;
+
+        if (batch.size() >= NAL_INDEX_WRITE_BATCH)
+        {
+            WriteAll(fd, (uint8_t *) batch.data(), batch.size() * sizeof(NalIndex_t));
+            batch.clear();
+        }
+
+        if (unit.offset - input.released >= NAL_INDEX_RELEASE_SIZE)
+        {
+            ReleaseInput(input, unit.offset);
+        }
+    }
+
+    WriteAll(fd, (uint8_t *) batch.data(), batch.size() * sizeof(NalIndex_t));
+
+    FreeRewrite(rw);
+    CloseInput(input);
+
+    if (ret == 0 && (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) || fdatasync(fd) != 0 || rename(tmp, path) != 0))
+    {
+        perror(path);
+        ret = -1;
+    }
+
+    close(fd);
+
+    if (ret < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+
+    if (LoadNalIndex(input_path, idx) < 0)
+    {
+        printf("%s changed while it was indexed\n", input_path);
+        return -1;
+    }
+
+    printf("Indexed %llu NAL units into %s\n", (unsigned long long) idx.num, path);
+
+    return 0;
+}
+
+
+void CloseNalIndex(NalIndexFile_t &idx)
+{
+    if (idx.map)
+    {
+        munmap(idx.map, idx.map_size);
+    }
+
+    idx.map     = NULL;
+    idx.nals    = NULL;
+    idx.num     = 0;
+}
+
+
+/**
+ * Report on input_path from its sidecar index, building the index first
+ * if it is missing or stale. With seek >= 0, locate picture number seek
+ * (decode order) and the IDR to decode it from. With an ofd as well,
+ * write that stretch as a clip: the access units from the IDR through
+ * the picture, with the latest SPS/PPS in front if the IDR lacks them.
+ * Only the index and the clip bytes are read.
+ */
+int RunIndex(const char *input_path, int64_t seek, int ofd)
+{
+    NalIndexFile_t idx;
+
+    if (LoadNalIndex(input_path, idx) == 0)
+    {
+        printf("%s%s is up to date\n", input_path, NAL_INDEX_SUFFIX);
+    }
+    else if (BuildNalIndex(input_path, idx) < 0)
+    {
+        return -1;
+    }
+
+    // access units as the fMP4 and RTP writers cut them (7.4.1.2.3)
+    vector<uint64_t> aus;       // first record of each picture's access unit
+    vector<uint64_t> pics;      // first slice of each picture
+    uint64_t au_start = 0;
+    uint64_t num_idr = 0;
+    uint64_t num_sets = 0;
+    bool au_vcl = false;
+
+    for (uint64_t i = 0; i < idx.num; i++)
+    {
+        const NalIndex_t &n = idx.nals[i];
+        uint8_t type = n.nal_unit_type;
+
+        bool new_au = StartsAccessUnit(type, (n.flags & NAL_INDEX_SLICE) && n.first_mb_in_slice == 0);
+
+        if (au_vcl && new_au)
+        {
+            au_vcl      = false;
+            au_start    = i;
+        }
+
+        if (is_slice(n) && !au_vcl)
+        {
+            aus.push_back(au_start);
+            pics.push_back(i);
+            au_vcl = true;
+
+            num_idr += (n.flags & NAL_INDEX_IDR) ? 1 : 0;
+        }
+
+        num_sets += (type == NALU_TYPE_SPS || type == NALU_TYPE_PPS) ? 1 : 0;
+    }
+
+    printf("%llu NAL units, %llu pictures, %llu IDR pictures, %llu parameter sets\n",
+           (unsigned long long) idx.num,
+           (unsigned long long) pics.size(),
+           (unsigned long long) num_idr,
+           (unsigned long long) num_sets);
+
+    if (seek < 0)
+    {
+        CloseNalIndex(idx);
+        return 0;
+    }
+
+    if ((uint64_t) seek >= pics.size())
+    {
+        printf("no picture %lld, the last one is %lld\n", (long long) seek, (long long) pics.size() - 1);
+        CloseNalIndex(idx);
+        return -1;
+    }
+
+    uint64_t idr = seek;
+
+    while (!(idx.nals[pics[idr]].flags & NAL_INDEX_IDR) && idr > 0)
+    {
+        idr--;
+    }
+
+    const NalIndex_t &pic = idx.nals[pics[seek]];
+
+    if (!(idx.nals[pics[idr]].flags & NAL_INDEX_IDR))
+    {
+        printf("picture %lld at 0x%llx has no IDR in front of it\n", (long long) seek, (unsigned long long) pic.offset);
+        CloseNalIndex(idx);
+        return -1;
+    }
+
+    printf("picture %lld: slice type %u, frame_num %u, nal_ref_idc %u at 0x%llx, decodable from IDR picture %llu at 0x%llx\n",
+           (long long) seek,
+           pic.slice_type,
+           pic.frame_num,
+           pic.nal_ref_idc,
+           (unsigned long long) pic.offset,
+           (unsigned long long) idr,
+           (unsigned long long) idx.nals[aus[idr]].offset);
+
+    if (ofd >= 0)
+    {
+        Input_t input;
+        Output_t out;
+
+        if (OpenInput(input_path, input) < 0)
+        {
+            CloseNalIndex(idx);
+            return -1;
+        }
+
+        // the clip is a few ranges somewhere in the file, no read-ahead over the rest
+        madvise(input.data, input.size, MADV_RANDOM);
+
+        uint64_t first  = idx.nals[aus[idr]].offset;
+        uint64_t last   = ((uint64_t) seek + 1 < aus.size()) ? idx.nals[aus[seek + 1]].offset : input.size;
+
+        InitOutput(out, ofd, input.fd, input.data);
+
+        output_sets(out, idx, aus[idr], pics[idr]);
+        OutputRange(out, first, last - first);
+
+        printf("Clip of %llu pictures, %llu bytes\n",
+               (unsigned long long) (seek - idr + 1),
+               (unsigned long long) out.queued);
+
+        FlushOutput(out);
+        CloseOutput(out);
+        CloseInput(input);
+    }
+
+    CloseNalIndex(idx);
+
+    return 0;
+}
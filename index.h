@@ -0,0 +1,53 @@
+
+
+#ifndef ___I_AVC_INDEX_H___
+#define ___I_AVC_INDEX_H___
+
+
+#define NAL_INDEX_SUFFIX        ".idx"
+#define NAL_INDEX_VERSION       1
+#define NAL_INDEX_RELEASE_SIZE  (64 << 20)      // input bytes scanned between page releases
+
+#define NAL_INDEX_NO_SLICE      0xFF            // slice_type of a NAL that is not a parsed slice
+
+#define NAL_INDEX_IDR           0x01
+#define NAL_INDEX_SLICE         0x02            // first_mb_in_slice, slice_type and frame_num are valid
+
+
+/*
+ * One record per NAL unit of the input, in file order.
+ */
+typedef struct
+{
+    uint64_t offset;                // first byte of the start code
+    uint32_t size;                  // start code and NAL, trailing_zero_8bits excluded
+    uint8_t  nal_unit_type;
+    uint8_t  nal_ref_idc;
+    uint8_t  slice_type;
+    uint8_t  flags;
+    uint32_t first_mb_in_slice;
+    uint32_t frame_num;
+} NalIndex_t;
+
+
+/*
+ * A sidecar index mapped read-only, valid for the input it was opened for.
+ */
+typedef struct
+{
+    uint8_t          *map;
+    uint64_t          map_size;
+    const NalIndex_t *nals;
+    uint64_t          num;
+} NalIndexFile_t;
+
+
+extern int LoadNalIndex(const char *input_path, NalIndexFile_t &idx);
+
+extern int BuildNalIndex(const char *input_path, NalIndexFile_t &idx);
+
+extern void CloseNalIndex(NalIndexFile_t &idx);
+
+extern int RunIndex(const char *input_path, int64_t seek, int ofd);
+
+#endif
@@ -0,0 +1,580 @@
+//
+//  inplace.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "input.h"
+#include "nal.h"
+#include "output.h"
+#include "rewrite.h"
+#include "inplace.h"
+
+
+using namespace std;
+
+
+#define PATCH_BATCH_SIZE        256
+
+static const char UNDO_MAGIC[8] = { 'I', 'A', 'V', 'C', 'U', 'N', 'D', 'O' };
+
+
+typedef struct
+{
+    uint64_t offset;
+    vector<uint8_t> bytes;
+} Patch_t;
+
+
+typedef struct
+{
+    char     magic[8];
+    uint64_t file_size;
+} UndoHeader_t;
+
+
+typedef struct
+{
+    uint64_t offset;
+    uint64_t length;
+} UndoRecord_t;
+
+
+/******************************
+ * local function
+ */
+
+static void journal_path(char *path, size_t size, const char *file)
+{
+    snprintf(path, size, "%s.undo", file);
+}
+
+
+static int pwrite_all(int fd, const uint8_t *buf, uint64_t len, uint64_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t wr_sz = pwrite(fd, buf, len, offset);
+
+        if (wr_sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buf     += wr_sz;
+        len     -= wr_sz;
+        offset  += wr_sz;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Make the directory entry of a file just created durable: syncing the
+ * file itself does not cover its name.
+ */
+static int sync_parent(const char *path)
+{
+    string dir(path);
+    size_t slash = dir.rfind('/');
+
+    dir = (slash == string::npos) ? "." : (slash == 0) ? "/" : dir.substr(0, slash);
+
+    int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd < 0 || fsync(dfd) != 0)
+    {
+        perror(dir.c_str());
+        if (dfd >= 0)
+        {
+            close(dfd);
+        }
+        return -1;
+    }
+
+    close(dfd);
+
+    return 0;
+}
+
+
+/**
+ * Journal the original bytes of a batch, make the journal durable, then
+ * apply the batch. A crash at any point leaves a journal that covers
+ * every byte that may have changed.
+ */
+static int apply_batch(int fd, int jfd, const uint8_t *data, vector<Patch_t> &batch, uint64_t &bytes)
+{
+    vector<uint8_t> rec;
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        UndoRecord_t r = { batch[i].offset, batch[i].bytes.size() };
+
+        rec.insert(rec.end(), (uint8_t *) &r, (uint8_t *) &r + sizeof(r));
+        rec.insert(rec.end(), data + r.offset, data + r.offset + r.length);
+    }
+
+    WriteAll(jfd, rec.data(), rec.size());
+
+    if (fdatasync(jfd) != 0)
+    {
+        perror("fdatasync");
+        return -1;
+    }
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        if (pwrite_all(fd, batch[i].bytes.data(), batch[i].bytes.size(), batch[i].offset) < 0)
+        {
+            perror("pwrite");
+            return -1;
+        }
+
+        bytes += batch[i].bytes.size();
+    }
+
+    batch.clear();
+
+    return 0;
+}
+
+
+/**
+ * Keep a copy of the original next to it, sharing blocks with FICLONE
+ * where the file system supports it and copying in the kernel otherwise.
+ */
+int BackupFile(const char *path, int fd, uint64_t size)
+{
+    char backup[PATH_MAX];
+
+    snprintf(backup, sizeof(backup), "%s.orig", path);
+
+    int bfd = open(backup, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (bfd < 0)
+    {
+        perror(backup);
+        return -1;
+    }
+
+    if (ioctl(bfd, FICLONE, fd) == 0)
+    {
+        printf("Backup %s reflinked\n", backup);
+        close(bfd);
+        return 0;
+    }
+
+    printf("Backup %s: reflink not supported (%s), copying\n", backup, strerror(errno));
+
+    loff_t off_in = 0;
+
+    while ((uint64_t) off_in < size)
+    {
+        ssize_t cp_sz = copy_file_range(fd, &off_in, bfd, NULL, size - off_in, 0);
+
+        if (cp_sz <= 0)
+        {
+            if (cp_sz < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            perror(backup);
+            close(bfd);
+            unlink(backup);
+            return -1;
+        }
+    }
+
+    fsync(bfd);
+    close(bfd);
+
+    return 0;
+}
+
+
+/**
+ * Fix a file in place: only the bytes that differ between the original
+ * and the regenerated headers are written back with pwrite().
+ *
+ * A header that comes out shorter is preceded by a filler data NAL unit
+ * covering the freed bytes when that is legal: the filler needs room for
+ * its start code, header and stop byte, and must not sit in front of the
+ * first VCL NAL unit of an access unit, so the previous NAL has to be a
+ * slice or filler. Otherwise the freed bytes become zero padding, the
+ * trailing_zero_8bits of the previous NAL. A header that would grow
+ * cannot be patched in place and is left as it is.
+ *
+ * NAL unit types set in drop_mask, and redundant slices with
+ * drop_redundant, are neutralized: their header byte turns into filler
+ * data and the payload into 0xFF, keeping the length, so the NAL drops
+ * out of the stream without moving a single byte around it.
+ *
+ * Original bytes go to <file>.undo before they are overwritten; the
+ * journal is removed once the file has been synced, so a journal left
+ * behind means the run was interrupted and can be rolled back with
+ * UndoInPlace().
+ */
+int RunInPlace(const char *path, bool backup, uint32_t drop_mask, bool drop_redundant)
+{
+    char jpath[PATH_MAX];
+    Input_t input;
+
+    journal_path(jpath, sizeof(jpath), path);
+
+    if (access(jpath, F_OK) == 0)
+    {
+        fprintf(stderr, "%s exists, a previous run was interrupted; undo it first\n", jpath);
+        return -1;
+    }
+
+    if (OpenInput(path, input) < 0)
+    {
+        return -1;
+    }
+
+    Rewrite_t rw;
+
+    if (InitRewrite(rw) < 0)
+    {
+        CloseInput(input);
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        perror(path);
+        CloseInput(input);
+        FreeRewrite(rw);
+        return -1;
+    }
+
+    if (backup && BackupFile(path, input.fd, input.size) < 0)
+    {
+        close(fd);
+        CloseInput(input);
+        FreeRewrite(rw);
+        return -1;
+    }
+
+    int jfd = open(jpath, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (jfd < 0)
+    {
+        perror(jpath);
+        close(fd);
+        CloseInput(input);
+        FreeRewrite(rw);
+        return -1;
+    }
+
+    UndoHeader_t hdr;
+
+    memcpy(hdr.magic, UNDO_MAGIC, sizeof(hdr.magic));
+    hdr.file_size = input.size;
+
+    WriteAll(jfd, (uint8_t *) &hdr, sizeof(hdr));
+
+    // the journal must survive a crash before the first byte is patched
+    if (fdatasync(jfd) != 0 || sync_parent(jpath) < 0)
+    {
+        perror(jpath);
+        close(jfd);
+        unlink(jpath);
+        close(fd);
+        CloseInput(input);
+        FreeRewrite(rw);
+        return -1;
+    }
+
+    const uint8_t *data = input.data;
+
+    NalIter_t it;
+    NalUnit_t unit;
+    vector<Patch_t> batch;
+    vector<uint8_t> patch;
+    uint64_t patched_bytes = 0;
+    uint64_t num_patches = 0;
+    uint64_t num_skipped = 0;
+    uint64_t num_dropped = 0;
+    bool after_vcl = false;
+    int ret = 0;
+
+    // each following start code is found before this NAL is patched
+    InitNalIter(it, data, input.size, 0);
+
+    while (NextNal(it, unit))
+    {
+        uint64_t start      = unit.offset;
+        uint32_t prefix_len = unit.prefix_len;
+
+        // a header running past its NAL is left unchanged, the patch never crosses the next start code
+        uint64_t replaced = (unit.size > prefix_len)
+                          ? RewriteNal(rw, (uint8_t *) data + start, unit.size, prefix_len, start, patch)
+                          : 0;
+
+        uint64_t nal_end = unit.next;
+        uint8_t nal_unit_type = unit.nal_unit_type;
+        bool is_slice = (nal_unit_type == NALU_TYPE_SLICE || nal_unit_type == NALU_TYPE_IDR);
+
+        bool drop = (drop_mask & (1u << nal_unit_type))
+                 || (drop_redundant && is_slice && replaced && rw.slice.redundant_pic_cnt > 0);
+
+        if (drop && nal_end - start >= prefix_len + FILLER_NAL_MIN_SIZE)
+        {
+            // the whole NAL behind its start code becomes filler data
+            replaced = nal_end - start;
+
+            patch.assign(data + start, data + start + prefix_len);
+            patch.resize(replaced);
+            MakeFiller(patch.data() + prefix_len, replaced - prefix_len);
+
+            num_dropped++;
+        }
+        else if (replaced && patch.size() < replaced)
+        {
+            uint64_t gap = replaced - patch.size();
+
+            if (after_vcl && gap >= FILLER_UNIT_MIN_SIZE)
+            {
+                static const uint8_t short_prefix[3] = { 0x00, 0x00, 0x01 };
+
+                patch.insert(patch.begin(), gap, 0x00);
+                memcpy(patch.data(), short_prefix, sizeof(short_prefix));
+                MakeFiller(patch.data() + 3, gap - 3);
+            }
+            else
+            {
+                patch.insert(patch.begin(), gap, 0x00);
+            }
+        }
+
+        // filler is only legal after the first VCL NAL unit of an access unit
+        if (is_slice)
+        {
+            after_vcl = true;
+        }
+        else if (!drop && nal_unit_type != NALU_TYPE_FILL)
+        {
+            after_vcl = false;
+        }
+
+        if (replaced && patch.size() > replaced)
+        {
+            printf("Header at 0x%llx grows by %llu bytes, cannot patch in place, left unchanged\n",
+                   (unsigned long long) start, (unsigned long long) (patch.size() - replaced));
+            num_skipped++;
+        }
+        else if (replaced)
+        {
+            // only the bytes that actually differ are written
+            uint64_t first = 0;
+            uint64_t last  = replaced;
+
+            while (first < last && patch[first] == data[start + first])
+            {
+                first++;
+            }
+
+            while (last > first && patch[last - 1] == data[start + last - 1])
+            {
+                last--;
+            }
+
+            if (first < last)
+            {
+                Patch_t p;
+
+                p.offset = start + first;
+                p.bytes.assign(patch.begin() + first, patch.begin() + last);
+
+                batch.push_back(p);
+                num_patches++;
+            }
+        }
+
+        if (batch.size() >= PATCH_BATCH_SIZE)
+        {
+            if (apply_batch(fd, jfd, data, batch, patched_bytes) < 0)
+            {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    if (ret == 0 && apply_batch(fd, jfd, data, batch, patched_bytes) < 0)
+    {
+        ret = -1;
+    }
+
+    if (ret == 0 && fdatasync(fd) != 0)
+    {
+        perror(path);
+        ret = -1;
+    }
+
+    close(jfd);
+
+    // keep the journal when anything went wrong, it is the way back
+    if (ret == 0)
+    {
+        unlink(jpath);
+    }
+
+    printf("In-place: %llu ranges, %llu bytes written, %llu headers left unchanged, %llu NAL units dropped\n",
+           (unsigned long long) num_patches,
+           (unsigned long long) patched_bytes,
+           (unsigned long long) num_skipped,
+           (unsigned long long) num_dropped);
+
+    close(fd);
+    CloseInput(input);
+    FreeRewrite(rw);
+
+    return ret;
+}
+
+
+/**
+ * Roll back an interrupted in-place run from <file>.undo.
+ */
+int UndoInPlace(const char *path)
+{
+    char jpath[PATH_MAX];
+    struct stat st;
+
+    journal_path(jpath, sizeof(jpath), path);
+
+    int jfd = open(jpath, O_RDONLY);
+    if (jfd < 0)
+    {
+        perror(jpath);
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(jfd, &st) != 0)
+    {
+        perror(path);
+        close(jfd);
+        return -1;
+    }
+
+    vector<uint8_t> journal(st.st_size);
+
+    if (read(jfd, journal.data(), journal.size()) != (ssize_t) journal.size())
+    {
+        perror(jpath);
+        close(fd);
+        close(jfd);
+        return -1;
+    }
+
+    close(jfd);
+
+    UndoHeader_t hdr;
+
+    if (journal.size() < sizeof(hdr))
+    {
+        fprintf(stderr, "%s: truncated journal\n", jpath);
+        close(fd);
+        return -1;
+    }
+
+    memcpy(&hdr, journal.data(), sizeof(hdr));
+
+    if (memcmp(hdr.magic, UNDO_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+        fprintf(stderr, "%s: not an undo journal\n", jpath);
+        close(fd);
+        return -1;
+    }
+
+    // in-place runs never change the size, a different one is a different file
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size != hdr.file_size)
+    {
+        fprintf(stderr, "%s: %s is not the %llu byte file it was written for, left unchanged\n",
+                jpath, path, (unsigned long long) hdr.file_size);
+        close(fd);
+        return -1;
+    }
+
+    // a record torn by the crash was never applied, stop in front of it
+    vector<uint64_t> records;
+    uint64_t pos = sizeof(hdr);
+
+    while (pos + sizeof(UndoRecord_t) <= journal.size())
+    {
+        UndoRecord_t r;
+
+        memcpy(&r, journal.data() + pos, sizeof(r));
+
+        if (pos + sizeof(r) + r.length > journal.size() || r.offset + r.length > hdr.file_size)
+        {
+            break;
+        }
+
+        records.push_back(pos);
+        pos += sizeof(r) + r.length;
+    }
+
+    // newest first, so the oldest original wins where records overlap
+    for (size_t i = records.size(); i-- > 0; )
+    {
+        UndoRecord_t r;
+
+        memcpy(&r, journal.data() + records[i], sizeof(r));
+
+        if (pwrite_all(fd, journal.data() + records[i] + sizeof(r), r.length, r.offset) < 0)
+        {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (fdatasync(fd) != 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    unlink(jpath);
+
+    printf("Undo: restored %llu ranges\n", (unsigned long long) records.size());
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+
+
+#ifndef ___I_AVC_INPLACE_H___
+#define ___I_AVC_INPLACE_H___
+
+
+extern int BackupFile(const char *path, int fd, uint64_t size);
+
+extern int RunInPlace(const char *path, bool backup, uint32_t drop_mask, bool drop_redundant);
+
+extern int UndoInPlace(const char *path);
+
+#endif
+
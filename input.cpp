@@ -0,0 +1,133 @@
+//
+//  input.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "input.h"
+
+
+/**
+ * Map the whole input file.
+ *
+ * Nothing is read up front, parsing starts as soon as the first page
+ * faults in and the kernel reads ahead behind the scan cursor.
+ */
+int OpenInput(const char *path, Input_t &input)
+{
+    struct stat st;
+
+    input.fd        = -1;
+    input.data      = NULL;
+    input.size      = 0;
+    input.released  = 0;
+    input.drop_cache = false;
+
+    input.fd = open(path, O_RDONLY);
+    if (input.fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    if (fstat(input.fd, &st) != 0)
+    {
+        perror(path);
+        close(input.fd);
+        return -1;
+    }
+
+    input.size = (uint64_t) st.st_size;
+
+    if (input.size == 0)
+    {
+        return 0;
+    }
+
+    void *addr = mmap(NULL, input.size, PROT_READ, MAP_SHARED, input.fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        perror(path);
+        close(input.fd);
+        return -1;
+    }
+
+    input.data = (uint8_t *) addr;
+
+    // hints only, failures are harmless
+    posix_fadvise(input.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    madvise(input.data, input.size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(input.data, input.size, MADV_HUGEPAGE);
+#endif
+
+    return 0;
+}
+
+
+/**
+ * Drop every whole page below offset from the mapping.
+ *
+ * Called once the bytes before offset have been written out, so resident
+ * memory stays bounded by the flush interval instead of the file size.
+ * Dropped pages read back as the original file content if touched again.
+ *
+ * With drop_cache the pages also leave the page cache, so a batch run
+ * over a big archive does not evict everybody else's data.
+ */
+void ReleaseInput(Input_t &input, uint64_t offset)
+{
+    uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t end = offset & ~(page_size - 1);
+
+    if (input.data == NULL || end <= input.released)
+    {
+        return;
+    }
+
+    madvise(input.data + input.released, end - input.released, MADV_DONTNEED);
+
+    if (input.drop_cache)
+    {
+        posix_fadvise(input.fd, input.released, end - input.released, POSIX_FADV_DONTNEED);
+    }
+
+    input.released = end;
+}
+
+
+void CloseInput(Input_t &input)
+{
+    if (input.data)
+    {
+        munmap(input.data, input.size);
+        input.data = NULL;
+    }
+
+    if (input.fd >= 0)
+    {
+        if (input.drop_cache)
+        {
+            posix_fadvise(input.fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+
+        close(input.fd);
+        input.fd = -1;
+    }
+}
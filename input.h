@@ -0,0 +1,24 @@
+
+
+#ifndef ___I_AVC_INPUT_H___
+#define ___I_AVC_INPUT_H___
+
+
+typedef struct
+{
+    int      fd;
+    uint8_t *data;          // read-only mapping of the whole file
+    uint64_t size;
+    uint64_t released;      // bytes at the head of the mapping already dropped
+    bool     drop_cache;    // drop released pages from the page cache as well
+} Input_t;
+
+
+extern int OpenInput(const char *path, Input_t &input);
+
+extern void ReleaseInput(Input_t &input, uint64_t offset);
+
+extern void CloseInput(Input_t &input);
+
+#endif
+
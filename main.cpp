@@ -10,11 +10,14 @@
  * include
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <getopt.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -27,498 +30,944 @@
       
 #include "common.h"
 #include "bits.h"
-#include "parser.h"
-#include "writer.h"
+#include "checkpoint.h"
+#include "concat.h"
+#include "convert.h"
+#include "daemon.h"
+#include "epoll.h"
+#include "follow.h"
+#include "index.h"
+#include "inplace.h"
+#include "input.h"
+#include "bench.h"
+#include "fmp4.h"
+#include "mp4.h"
+#include "nal.h"
+#include "output.h"
+#include "pcap.h"
+#include "rewrite.h"
+#include "rtp.h"
+#include "segment.h"
+#include "shm.h"
+#include "stream.h"
+#include "ts.h"
+#include "uring.h"
 
 
 using namespace std;
 
 
-#define ZEROBYTES_SHORTSTARTCODE    2
 #define SIZE_OF_NAL_UNIT_HDR        1
-#define NAL_HDR_MAX_SIZE            100
-#define ES_BUFFER_SIZE              NAL_HDR_MAX_SIZE
+#define OUTPUT_FLUSH_SIZE           (8 << 20)
 
 
-static uint8_t u8endCode[] = { 0xFC, 0xFD, 0xFE, 0xFF };
+/******************************
+ * local function
+ */
+ 
+/**
+ * Rewrite a mapped file. Unchanged bytes are queued as input ranges and
+ * regenerated headers as new bytes, the gather list is flushed every
+ * OUTPUT_FLUSH_SIZE bytes.
+ */
+static void fix_file(Input_t &input, int ofd, const char *ckpt_path, bool resume)
+{
+    uint8_t *data       = input.data;
+    uint64_t file_size  = input.size;
+    uint64_t emitted    = 0;        // input bytes accounted for in the output
+    uint64_t written    = 0;        // output bytes flushed
 
-static uint8_t u8EsBuffer[ES_BUFFER_SIZE + sizeof(u8endCode)];
+    Output_t out;
+    Rewrite_t rw;
+    Checkpoint_t ck;
+    vector<uint8_t> patch;
 
-static AvcInfo_t tAvcInfo;
+    if (InitRewrite(rw) < 0)
+    {
+        exit(-1);
+    }
 
-static SPS_t SPSs[32];
+    InitOutput(out, ofd, input.fd, data);
 
-static PPS_t PPSs[128];
+    // O_DIRECT output means batch mode, keep the input out of the page cache too
+    input.drop_cache = (out.direct != NULL);
+
+    uint8_t *ptr = data;
 
-static Slice_t slice;
+    if (ckpt_path && NoteCheckpointInput(ck, input.fd) < 0)
+    {
+        exit(-1);
+    }
 
-string message;
+    if (resume)
+    {
+        Checkpoint_t cur = ck;
 
+        if (LoadCheckpoint(ckpt_path, ck) < 0)
+        {
+            exit(-1);
+        }
 
-/******************************
- * local function
- */
- 
-static bool has_start_code
-(
-    uint8_t *addr,
-    uint8_t  zeros
-)
-{
-    int i;
-    
-    for (i = 0; i < zeros; i++)
+        if (!SameCheckpointInput(ck, cur) || ck.input_offset > file_size)
+        {
+            printf("%s does not belong to this input\n", ckpt_path);
+            exit(-1);
+        }
+
+        // anything written after the checkpoint may be torn, redo it
+        if (ftruncate(ofd, ck.output_offset) != 0 || lseek(ofd, ck.output_offset, SEEK_SET) < 0)
+        {
+            perror("resume");
+            exit(-1);
+        }
+
+        for (size_t i = 0; i < ck.sets.size(); i++)
+        {
+            vector<uint8_t> &set = ck.sets[i];
+
+            RewriteNal(rw, set.data(), set.size(), (set[2] == 0x01) ? 3 : 4, 0, patch);
+        }
+
+        printf("Resuming at input 0x%llx, output 0x%llx\n",
+               (unsigned long long) ck.input_offset,
+               (unsigned long long) ck.output_offset);
+
+        ptr     = data + ck.input_offset;
+        emitted = ck.input_offset;
+        written = ck.output_offset;
+    }
+
+    uint64_t next_ckpt = emitted + CHECKPOINT_INTERVAL;
+
+    NalIter_t it;
+    NalUnit_t nal;
+
+    InitNalIter(it, data, file_size, ptr - data);
+
+    while (NextNal(it, nal))
+    {
+        uint64_t offset = nal.offset;
+        uint64_t left   = file_size - offset;
+
+        // a start code with no NAL header behind it ends the stream
+        if (left <= nal.prefix_len)
+        {
+            break;
+        }
+
+        // everything before the current NAL is final, hand it out and drop the pages
+        if (offset > emitted && offset - emitted + out.queued >= OUTPUT_FLUSH_SIZE)
+        {
+            OutputRange(out, emitted, offset - emitted);
+            emitted = offset;
+            written += out.queued;
+
+            FlushOutput(out);
+            ReleaseInput(input, emitted);
+
+            // a checkpoint must not claim output that could still be lost
+            if (ckpt_path && emitted >= next_ckpt && out.direct == NULL && fdatasync(ofd) == 0)
+            {
+                ck.input_offset     = emitted;
+                ck.output_offset    = written;
+
+                SaveCheckpoint(ckpt_path, ck);
+                next_ckpt = emitted + CHECKPOINT_INTERVAL;
+            }
+        }
+
+        uint64_t replaced = RewriteNal(rw, data + offset, left, nal.prefix_len, offset, patch);
+
+        if (ckpt_path && (nal.nal_unit_type == NALU_TYPE_SPS || nal.nal_unit_type == NALU_TYPE_PPS))
+        {
+            NoteParamSet(ck, data + offset, nal.size);
+        }
+
+        if (replaced && offset >= emitted)
+        {
+            OutputRange(out, emitted, offset - emitted);
+            OutputBytes(out, patch.data(), patch.size());
+            emitted = offset + (replaced < left ? replaced : left);
+        }
+    }
+
+    // Flush output
+    OutputRange(out, emitted, file_size - emitted);
+    FlushOutput(out);
+    CloseOutput(out);
+
+    FreeRewrite(rw);
+
+    // done, nothing left to resume
+    if (ckpt_path)
     {
-        if (addr[i]) return false;
+        unlink(ckpt_path);
     }
-    
-    return addr[i] == 0x01 ? true : false;
 }
 
 
-static bool has_end_code(uint8_t *p)
+/**
+ * Name the output after the input. With escape the name becomes a printf
+ * pattern (ext carries the conversion), so a % in the input name is
+ * doubled.
+ */
+static void default_output(const char *input_file, const char *ext, bool escape, char *output, size_t size)
 {
-    if (memcmp(p, u8endCode, sizeof(u8endCode)) == 0)
+    string stem;
+
+    if (strncmp(input_file, "fd:", 3) == 0)
     {
-        return true;
+        snprintf(output, size, "fd%s_fix_frame_num%s", input_file + 3, ext ? ext : ".264");
+        return;
     }
-    else
+
+    const char *cp = strrchr(input_file, '.');
+    int stem_len = cp ? (int) (cp - input_file) : (int) strlen(input_file);
+
+    for (int i = 0; i < stem_len; i++)
     {
-        return false;
+        if (escape && input_file[i] == '%')
+        {
+            stem += '%';
+        }
+        stem += input_file[i];
     }
+
+    snprintf(output, size, "%s_fix_frame_num%s", stem.c_str(), ext ? ext : (cp ? cp : ""));
 }
 
 
-static bool scan_nal
-(
-    uint8_t     *start_addr,
-    uint8_t     *nal_unit_header,
-    uint32_t    *nal_len,
-    uint32_t    *prefix_len
-)
+static void usage(const char *prog)
 {
-    uint8_t offset = 0;
-    uint8_t *p;
+    printf("useage: %s [-s] [-c] [-u] [-D] [-f] [-m] [-i [-b] [-d types] [-r]] [--undo] [--to-avcc|--to-annexb] [--resume] [--rtp pcap|raw [--mtu n]] [--segment secs [--workers n]] [--ssrc n] [--port n] [-v] [-o output_file] [input_file]\n", prog);
+    printf("        %s --shm-in <ring> --shm-out <ring>\n", prog);
+    printf("        %s --daemon <socket> [--workers n]\n", prog);
+    printf("        %s -e input_file...\n", prog);
+    printf("        %s --concat [-o output_file] input_file...\n", prog);
+    printf("        %s --bench input_file\n", prog);
+    printf("        %s --index [--seek n [-o clip_file]] input_file\n", prog);
+    printf("  -s, --stream          read the input in chunks instead of mapping it\n");
+    printf("  -c, --cut-through     stream mode, forward payload bytes as soon as the header is rewritten\n");
+    printf("  -u, --uring           overlap reads, rewriting and writes with io_uring\n");
+    printf("  -D, --direct          batch mode, write with O_DIRECT and keep the input out of the page cache\n");
+    printf("  -f, --follow          keep fixing a recording as it grows, until it is rotated\n");
+    printf("  -m, --fmp4            write a fragmented MP4 (CMAF) track instead of Annex-B, a fragment per IDR\n");
+    printf("  -e, --epoll           fix many live streams (FIFOs, fd:N sockets) in one process\n");
+    printf("  -i, --in-place        patch the changed header bytes in the input file itself\n");
+    printf("  -b, --backup          with -i, keep <input_file>.orig (reflink when possible)\n");
+    printf("  -d, --drop <types>    with -i, turn NAL units of these comma separated types into filler, e.g. 6 for SEI\n");
+    printf("  -r, --drop-redundant  with -i, turn redundant slices into filler\n");
+    printf("      --undo            roll back an interrupted -i run from <input_file>.undo\n");
+    printf("      --to-avcc         convert an Annex-B file to 4 byte length prefixed NAL units in place, -b keeps a copy\n");
+    printf("      --to-annexb       convert 4 byte length prefixed NAL units back to Annex-B in place\n");
+    printf("      --resume          continue an interrupted run from <output_file>.ckpt\n");
+    printf("      --rtp <pcap|raw>  send the output as RTP, in a pcap file or as 2 byte length prefixed packets\n");
+    printf("      --mtu <n>         with --rtp, IP packet size to fit, STAP-A/FU-A around it (default %d)\n", RTP_DEFAULT_MTU);
+    printf("      --ssrc <n>        RTP stream to take from a pcap input_file, default the first one seen; SSRC of --rtp output\n");
+    printf("      --port <n>        only take RTP from this UDP destination port of a pcap input_file; UDP port of --rtp pcap output\n");
+    printf("      --concat          join Annex-B inputs into one stream, renumbering headers at the seams\n");
+    printf("      --bench           time each start code scanner this CPU supports over input_file, in GB/s\n");
+    printf("      --index           keep a NAL index in <input_file>.idx, rebuilt when the file changes, and summarize from it\n");
+    printf("      --seek <n>        with the index, find picture n (decode order) and its IDR; -o writes them as a clip\n");
+    printf("  -o, --output <file>   output file, '-' for stdout\n");
+    printf("  -v, --verbose         print a line for every NAL unit rewritten\n");
+    printf("      --shm-in <ring>   read from a shared memory ring, a shm_open() name or fd:N\n");
+    printf("      --shm-out <ring>  publish output descriptors to a shared memory ring, created if missing\n");
+    printf("      --daemon <socket> serve FIX/ANALYZE requests on a Unix domain socket\n");
+    printf("      --segment <secs>  cut into IDR aligned files of about secs each, -o is a pattern like out_%%05u.264\n");
+    printf("      --workers <n>     daemon worker processes, --segment writer threads (default %d)\n", DAEMON_WORKERS);
+    printf("  an MP4 input_file is fixed in place with -i, using avcC and the sample tables\n");
+    printf("  a pcap input_file of RTP H.264 (RFC 6184) is depacketized into Annex-B\n");
+    printf("  an MPEG-TS input_file is detected and patched packet by packet, other PIDs untouched\n");
+    printf("  input_file '-' reads stdin in stream mode, output defaults to stdout\n");
+}
 
-    bool ret = true;
-    
-    p = start_addr;
 
-    if (has_start_code(p, 2))      // short prefix
+int main(int argc, char *argv[])
+{
+    const char *input_file  = NULL;
+    const char *output_file = NULL;
+    const char *shm_in = NULL;
+    const char *shm_out = NULL;
+    const char *sock_path = NULL;
+    int workers = DAEMON_WORKERS;
+    bool stream_mode = false;
+    bool cut_through = false;
+    bool uring_mode = false;
+    bool direct = false;
+    bool epoll_mode = false;
+    bool follow = false;
+    bool fmp4 = false;
+    bool concat = false;
+    bool bench = false;
+    bool index = false;
+    int64_t seek = -1;
+    bool resume = false;
+    bool pcap = false;
+    int64_t ssrc = -1;
+    int port = 0;
+    bool rtp = false;
+    RtpFormat_t rtp_format = RTP_OUT_PCAP;
+    uint32_t mtu = RTP_DEFAULT_MTU;
+    double segment = 0;
+    bool in_place = false;
+    bool backup = false;
+    bool undo = false;
+    bool to_avcc = false;
+    bool to_annexb = false;
+    bool drop_redundant = false;
+    uint32_t drop_mask = 0;
+    char output[PATH_MAX];
+    char ckpt[PATH_MAX + 8];
+    int ifd;
+    int ofd;
+    int opt;
+
+    static struct option long_options[] =
     {
-        offset = 3;
-    }
-    else if (has_start_code(p, 3)) // long prefix
+        { "stream",         no_argument,        NULL, 's' },
+        { "cut-through",    no_argument,        NULL, 'c' },
+        { "uring",          no_argument,        NULL, 'u' },
+        { "direct",         no_argument,        NULL, 'D' },
+        { "epoll",          no_argument,        NULL, 'e' },
+        { "follow",         no_argument,        NULL, 'f' },
+        { "fmp4",           no_argument,        NULL, 'm' },
+        { "in-place",       no_argument,        NULL, 'i' },
+        { "backup",         no_argument,        NULL, 'b' },
+        { "drop",           required_argument,  NULL, 'd' },
+        { "drop-redundant", no_argument,        NULL, 'r' },
+        { "undo",           no_argument,        NULL, 'U' },
+        { "to-avcc",        no_argument,        NULL, 'A' },
+        { "to-annexb",      no_argument,        NULL, 'B' },
+        { "resume",         no_argument,        NULL, 'R' },
+        { "output",         required_argument,  NULL, 'o' },
+        { "verbose",        no_argument,        NULL, 'v' },
+        { "shm-in",         required_argument,  NULL, 'I' },
+        { "shm-out",        required_argument,  NULL, 'O' },
+        { "daemon",         required_argument,  NULL, 'S' },
+        { "workers",        required_argument,  NULL, 'W' },
+        { "ssrc",           required_argument,  NULL, 'X' },
+        { "port",           required_argument,  NULL, 'T' },
+        { "rtp",            required_argument,  NULL, 'P' },
+        { "mtu",            required_argument,  NULL, 'M' },
+        { "segment",        required_argument,  NULL, 'G' },
+        { "concat",         no_argument,        NULL, 'C' },
+        { "bench",          no_argument,        NULL, 'K' },
+        { "index",          no_argument,        NULL, 'N' },
+        { "seek",           required_argument,  NULL, 'Q' },
+        { NULL,             0,                  NULL,  0  }
+    };
+
+    while ((opt = getopt_long(argc, argv, "scuDefmibd:ro:v", long_options, NULL)) != -1)
     {
-        offset = 4;
+        switch (opt)
+        {
+            case 's':
+            {
+                stream_mode = true;
+                break;
+            }
+            case 'c':
+            {
+                stream_mode = true;
+                cut_through = true;
+                break;
+            }
+            case 'u':
+            {
+                uring_mode = true;
+                break;
+            }
+            case 'D':
+            {
+                direct = true;
+                break;
+            }
+            case 'e':
+            {
+                epoll_mode = true;
+                break;
+            }
+            case 'f':
+            {
+                follow = true;
+                break;
+            }
+            case 'm':
+            {
+                fmp4 = true;
+                break;
+            }
+            case 'i':
+            {
+                in_place = true;
+                break;
+            }
+            case 'b':
+            {
+                backup = true;
+                break;
+            }
+            case 'd':
+            {
+                char *cp = optarg;
+
+                while (*cp)
+                {
+                    char *ep;
+                    unsigned long type = strtoul(cp, &ep, 0);
+
+                    if (ep == cp || type > 31 || (*ep != ',' && *ep != '\0'))
+                    {
+                        fprintf(stderr, "bad NAL unit type list: %s\n", optarg);
+                        return -1;
+                    }
+
+                    drop_mask |= 1u << type;
+                    cp = (*ep == ',') ? ep + 1 : ep;
+                }
+                break;
+            }
+            case 'r':
+            {
+                drop_redundant = true;
+                break;
+            }
+            case 'R':
+            {
+                resume = true;
+                break;
+            }
+            case 'U':
+            {
+                undo = true;
+                break;
+            }
+            case 'A':
+            {
+                to_avcc = true;
+                break;
+            }
+            case 'B':
+            {
+                to_annexb = true;
+                break;
+            }
+            case 'X':
+            {
+                char *ep;
+
+                ssrc = strtoul(optarg, &ep, 0);
+
+                if (ep == optarg || *ep != '\0' || ssrc > 0xFFFFFFFFll)
+                {
+                    fprintf(stderr, "bad SSRC: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            }
+            case 'T':
+            {
+                char *ep;
+                long value = strtol(optarg, &ep, 10);
+
+                port = (int) value;
+
+                if (ep == optarg || *ep != '\0' || value < 1 || value > 0xFFFF)
+                {
+                    fprintf(stderr, "bad port: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            }
+            case 'P':
+            {
+                rtp = true;
+
+                if (strcmp(optarg, "pcap") == 0)
+                {
+                    rtp_format = RTP_OUT_PCAP;
+                }
+                else if (strcmp(optarg, "raw") == 0)
+                {
+                    rtp_format = RTP_OUT_RAW;
+                }
+                else
+                {
+                    fprintf(stderr, "bad RTP output format: %s, pcap or raw\n", optarg);
+                    return -1;
+                }
+                break;
+            }
+            case 'M':
+            {
+                char *ep;
+                unsigned long value = strtoul(optarg, &ep, 10);
+
+                mtu = (uint32_t) value;
+
+                if (ep == optarg || *ep != '\0' || value < RTP_MIN_MTU || value > RTP_MAX_MTU)
+                {
+                    fprintf(stderr, "bad MTU: %s, %d to %d\n", optarg, RTP_MIN_MTU, RTP_MAX_MTU);
+                    return -1;
+                }
+                break;
+            }
+            case 'C':
+            {
+                concat = true;
+                break;
+            }
+            case 'K':
+            {
+                bench = true;
+                break;
+            }
+            case 'N':
+            {
+                index = true;
+                break;
+            }
+            case 'Q':
+            {
+                char *ep;
+
+                seek = strtoll(optarg, &ep, 0);
+
+                if (ep == optarg || *ep != '\0' || seek < 0)
+                {
+                    fprintf(stderr, "bad picture number: %s\n", optarg);
+                    return -1;
+                }
+
+                index = true;
+                break;
+            }
+            case 'G':
+            {
+                segment = atof(optarg);
+
+                if (segment <= 0)
+                {
+                    fprintf(stderr, "bad segment duration: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            }
+            case 'o':
+            {
+                output_file = optarg;
+                break;
+            }
+            case 'v':
+            {
+                rewrite_verbose = true;
+                break;
+            }
+            case 'I':
+            {
+                shm_in = optarg;
+                break;
+            }
+            case 'O':
+            {
+                shm_out = optarg;
+                break;
+            }
+            case 'S':
+            {
+                sock_path = optarg;
+                break;
+            }
+            case 'W':
+            {
+                workers = atoi(optarg);
+                if (workers <= 0)
+                {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            }
+            default:
+            {
+                usage(argv[0]);
+                return -1;
+            }
+        }
     }
 
-    *prefix_len = offset;
-    p += offset;
+    if (sock_path)
+    {
+        return RunDaemon(sock_path, workers) < 0 ? -1 : 0;
+    }
 
-    while (!has_end_code(p) && !has_start_code(p, 2) && !has_start_code(p, 3))
+    if (shm_in || shm_out)
     {
-        p++;
+        if (shm_in == NULL || shm_out == NULL)
+        {
+            usage(argv[0]);
+            return -1;
+        }
+
+        return RunShm(shm_in, shm_out) < 0 ? -1 : 0;
     }
 
-    nal_unit_header[0] = start_addr[offset];
-    *nal_len  = (uint32_t) (p - start_addr);
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return -1;
+    }
 
-    if (has_end_code(p))
+    if (epoll_mode)
     {
-        ret = false;
+        int num = argc - optind;
+        vector<const char *> outputs(num);
+        vector<string> names(num);
+
+        for (int i = 0; i < num; i++)
+        {
+            default_output(argv[optind + i], NULL, false, output, sizeof(output));
+            names[i] = output;
+            outputs[i] = names[i].c_str();
+        }
+
+        return RunEpoll((const char **) argv + optind, outputs.data(), num) < 0 ? -1 : 0;
     }
 
-    return ret;
-}
+    if (concat)
+    {
+        if (output_file == NULL)
+        {
+            default_output(argv[optind], NULL, false, output, sizeof(output));
+            output_file = output;
+        }
 
+        if (strcmp(output_file, "-") == 0)
+        {
+            ofd = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
+        else
+        {
+            ofd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        }
 
-static uint32_t EBSPtoRBSP
-(
-    uint8_t *streamBuffer,
-    uint32_t end_bytepos,
-    uint32_t begin_bytepos
-)
-{
-    uint32_t i;
-    uint32_t j;
-    uint32_t count;
-    
-    count = 0;
-    j = begin_bytepos;
-    
-    for (i = begin_bytepos; i < end_bytepos; i++)
-    {
-        // in NAL unit, 0x000000, 0x000001, 0x000002 shall not occur at any byte-aligned position
-        if (count == 2 && streamBuffer[i] < 0x03)
+        if (ofd < 0)
         {
+            perror(output_file);
             return -1;
         }
-        
-        if (count == 2 && streamBuffer[i] == 0x03)
+
+        int ret = RunConcat((const char **) argv + optind, argc - optind, ofd);
+
+        close(ofd);
+
+        return ret < 0 ? -1 : 0;
+    }
+
+    input_file = argv[optind];
+
+    if (bench)
+    {
+        Input_t input;
+
+        if (OpenInput(input_file, input) < 0)
+        {
+            exit(-1);
+        }
+
+        int ret = RunBench(input);
+
+        CloseInput(input);
+
+        return ret < 0 ? -1 : 0;
+    }
+
+    if (index)
+    {
+        ofd = -1;
+
+        // only a seek writes anything, and only when asked to
+        if (seek >= 0 && output_file)
         {
-            // check the 4th byte after 0x000003, except when cabac.....
-            if ((i < end_bytepos - 1) && (streamBuffer[i + 1] > 0x03))
+            ofd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+            if (ofd < 0)
             {
+                perror(output_file);
                 return -1;
             }
-            
-            if (i == end_bytepos - 1)
-            {
-                return j;
-            }
-            
-            // escape 0x03 byte!
-            i++;
-            count = 0;
         }
-        
-        streamBuffer[j] = streamBuffer[i];
-        //printf("[%02u] 0x%02x\n", j, streamBuffer[j]);
-        
-        if (streamBuffer[i] == 0x00)
+
+        int ret = RunIndex(input_file, seek, ofd);
+
+        if (ofd >= 0)
         {
-            count++;
+            close(ofd);
         }
-        else
+
+        return ret < 0 ? -1 : 0;
+    }
+
+    if (to_avcc || to_annexb)
+    {
+        int ret = to_avcc ? ConvertToAvcc(input_file, backup) : ConvertToAnnexB(input_file, backup);
+
+        return ret < 0 ? -1 : 0;
+    }
+
+    if (undo)
+    {
+        return UndoInPlace(input_file) < 0 ? -1 : 0;
+    }
+
+    if (in_place && IsMp4File(input_file))
+    {
+        if (drop_mask || drop_redundant)
         {
-            count = 0;
+            printf("-d and -r are ignored for MP4 input\n");
         }
-        
-        j++;
+
+        return RunMp4(input_file, backup) < 0 ? -1 : 0;
     }
-    
-    return j;
-}
 
+    if (in_place)
+    {
+        return RunInPlace(input_file, backup, drop_mask, drop_redundant) < 0 ? -1 : 0;
+    }
 
-static bool isOk(InputBitstream_t &ibs, OutputBitstream_t &obs)
-{   
-    for (int i = 0; i < obs.m_fifo.size(); i++)
+    if (IsMp4File(input_file))
     {
-        if (ibs.m_fifo[i] != obs.m_fifo[i]) { return false; }
+        printf("%s: MP4 input is fixed in place, use -i (with -b to keep the original)\n", input_file);
+        exit(-1);
     }
 
-    return true;
-}
+    if (strcmp(input_file, "-") == 0)
+    {
+        stream_mode = true;
 
-/*!
-************************************************************************
-*  \brief
-*     This function add emulation_prevention_three_byte for all occurrences
-*     of the following byte sequences in the stream
-*       0x000000  -> 0x00000300
-*       0x000001  -> 0x00000301
-*       0x000002  -> 0x00000302
-*       0x000003  -> 0x00000303
-*
-*  \param NaluBuffer
-*            pointer to target buffer
-*  \param rbsp
-*            pointer to source buffer
-*  \param rbsp_size
-*           Size of source
-*  \return
-*           Size target buffer after emulation prevention.
-*
-************************************************************************
-*/
-int RBSPtoEBSP(vector<uint8_t> &ebsp, vector<uint8_t> &rbsp)
-{
-    int zero_cnt    = 0;
+        if (output_file == NULL)
+        {
+            output_file = "-";
+        }
+    }
 
-    for (int i = 0; i < rbsp.size(); i++)
+    pcap = (strcmp(input_file, "-") != 0 && IsPcapFile(input_file));
+
+    if (output_file == NULL)
     {
-        if (zero_cnt == ZEROBYTES_SHORTSTARTCODE && !(rbsp[i] & 0xFC))
+        const char *ext = NULL;
+
+        if (fmp4)
+        {
+            ext = ".mp4";
+        }
+        else if (segment > 0)
+        {
+            ext = SEGMENT_PATTERN_SUFFIX;
+        }
+        else if (rtp)
+        {
+            ext = (rtp_format == RTP_OUT_PCAP) ? ".pcap" : ".rtp";
+        }
+        else if (pcap)
         {
-            ebsp.push_back(0x03);
-            zero_cnt = 0;
+            ext = ".264";
         }
-        ebsp.push_back(rbsp[i]);
 
-        if (rbsp[i] == 0x00) { zero_cnt++; }
-        else { zero_cnt = 0; }
+        default_output(input_file, ext, segment > 0, output, sizeof(output));
+        output_file = output;
     }
 
-    return ebsp.size();
-}
-
-
-int main(int argc, char *argv[])
-{
-    int fd;
-    ssize_t rd_sz;
-        
-    if (argc < 2)
+    if (resume && (stream_mode || uring_mode || follow))
     {
-        printf("useage: %s [input_file]\n", argv[0]);
+        printf("--resume only works on a file in the default mode\n");
         return -1;
     }
 
-    fd = open(argv[1], O_RDONLY);
-    if (fd < 0)
+    if (fmp4 && (stream_mode || uring_mode || follow || resume))
     {
-        perror(argv[1]);
-        exit(-1);
+        printf("-m needs a mapped input file and cannot be combined with -s, -c, -u, -f or --resume\n");
+        return -1;
     }
 
-    struct stat st;
-    uint32_t file_size = 0;
-
-    if (stat(argv[1], &st) == 0)
+    if (rtp && (fmp4 || stream_mode || uring_mode || follow || resume))
     {
-        file_size = st.st_size;
+        printf("--rtp needs a mapped input file and cannot be combined with -m, -s, -c, -u, -f or --resume\n");
+        return -1;
     }
-    else
+
+    if (pcap && (fmp4 || rtp || stream_mode || uring_mode || follow || resume))
     {
-        perror(argv[1]);
-        exit(-1);
+        printf("a pcap input_file cannot be combined with -m, --rtp, -s, -c, -u, -f or --resume\n");
+        return -1;
     }
 
-    uint8_t *data = (uint8_t *) calloc(1, file_size + sizeof(u8EsBuffer));
+    if (segment > 0)
+    {
+        Input_t input;
 
-    rd_sz = read(fd, data, file_size);
+        if (pcap || fmp4 || rtp || stream_mode || uring_mode || follow || resume || strcmp(output_file, "-") == 0)
+        {
+            printf("--segment needs an Annex-B input file and an output pattern, no -m, --rtp, -s, -c, -u, -f or --resume\n");
+            return -1;
+        }
 
-    uint8_t     nal_unit_header[SIZE_OF_NAL_UNIT_HDR];
-    bool        forbidden_zero_bit;
-    uint8_t     nal_ref_idc;
-    NaluType    nal_unit_type;
+        if (!IsSegmentPattern(output_file))
+        {
+            printf("%s: --segment needs an output pattern with exactly one %%u for the segment number, other %% written as %%%%\n", output_file);
+            return -1;
+        }
 
-    uint8_t *ptr = data;
+        if (OpenInput(input_file, input) < 0)
+        {
+            exit(-1);
+        }
+
+        int ret = RunSegment(input, output_file, segment, workers);
+
+        CloseInput(input);
+
+        return ret < 0 ? -1 : 0;
+    }
 
-    while (ptr - data < file_size)
+    if (strcmp(output_file, "-") == 0)
     {
-        bool     nalFound = false;
-        uint32_t prefix_len = 0;
+        // stdout carries the stream, move the parser log to stderr
+        ofd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    else
+    {
+        // a resumed run keeps what the checkpoint vouches for
+        int flags = resume ? (O_WRONLY | O_CREAT) : (O_WRONLY | O_CREAT | O_TRUNC);
 
-        if (has_start_code(ptr, 2))
+        if (direct && uring_mode)
+        {
+            printf("--direct is not supported with --uring, ignored\n");
+        }
+        else if (direct && resume)
         {
-            prefix_len = 3;
-            nal_unit_header[0] = ptr[prefix_len];
-            nalFound = true;
+            printf("--direct is not supported with --resume, ignored\n");
         }
-        else if (has_start_code(ptr, 3))
+        else if (direct)
         {
-            prefix_len = 4;
-            nal_unit_header[0] = ptr[prefix_len];
-            nalFound = true;
+            flags |= O_DIRECT;
         }
 
-        if (nalFound)
+        ofd = open(output_file, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+        if (ofd < 0 && errno == EINVAL && (flags & O_DIRECT))
         {
-            nal_unit_type           = (NaluType) ((nal_unit_header[0] & (BIT4 | BIT3 | BIT2 | BIT1 | BIT0)));
-            nal_ref_idc             = ((nal_unit_header[0] & (BIT5 | BIT6)) >> 5);
-            forbidden_zero_bit      = (nal_unit_header[0] & BIT7) >> 7;
+            printf("%s: O_DIRECT not supported, writing through the page cache\n", output_file);
+            ofd = open(output_file, flags & ~O_DIRECT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        }
+    }
 
-            if (!forbidden_zero_bit)
+    if (ofd < 0)
+    {
+        perror(output_file);
+        exit(-1);
+    }
+
+    if (follow)
+    {
+        if (RunFollow(input_file, ofd) < 0)
+        {
+            exit(-1);
+        }
+    }
+    else if (stream_mode || uring_mode)
+    {
+        if (strcmp(input_file, "-") == 0)
+        {
+            ifd = STDIN_FILENO;
+        }
+        else
+        {
+            ifd = open(input_file, O_RDONLY);
+            if (ifd < 0)
             {
-                printf("nal=0x%02x forbidden_zero_bit=%d, nal_unit_type=%02u, nal_ref_idc=%u, offset=0x%x\n",
-                       nal_unit_header[0],
-                       forbidden_zero_bit,
-                       nal_unit_type,
-                       nal_ref_idc,
-                       (uint32_t) (ptr - data));
+                perror(input_file);
+                exit(-1);
+            }
+        }
 
-                memcpy(u8EsBuffer, ptr, sizeof(u8EsBuffer));
+        int ret = uring_mode ? RunUring(ifd, ofd, cut_through) : RunStream(ifd, ofd, cut_through);
 
-                InputBitstream_t ibs;
+        if (ret < 0)
+        {
+            exit(-1);
+        }
 
-                ibs.m_fifo          = &u8EsBuffer[prefix_len + SIZE_OF_NAL_UNIT_HDR];
-                ibs.m_fifo_size     = sizeof(u8EsBuffer) - (prefix_len + SIZE_OF_NAL_UNIT_HDR);
-                ibs.m_fifo_idx      = 0;
-                ibs.m_num_held_bits = 0;
-                ibs.m_held_bits     = 0;
-                ibs.m_numBitsRead   = 0;
+        close(ifd);
+    }
+    else
+    {
+        Input_t input;
 
-                EBSPtoRBSP(ibs.m_fifo, ibs.m_fifo_size, 0);
+        if (OpenInput(input_file, input) < 0)
+        {
+            exit(-1);
+        }
 
-                switch (nal_unit_type)
-                {
-                    case NALU_TYPE_SPS:
-                    {
-                        printf("Find SPS, parse!\n");
-
-                        ParseSPS(ibs, SPSs, tAvcInfo);
-                        {
-                            OutputBitstream_t obs;
-
-                            obs.m_num_held_bits = 0;
-                            obs.m_held_bits     = 0;
-
-                            if (SPSs[0].isValid) // assume sps id is 0
-                            {
-                                SPSs[0].log2_max_frame_num_minus4 = 11; // do customer request, generate SPS log2_max_frame_num = 15
-
-                                printf("Generating SPS!\n");
-                                GenerateSPS(obs, SPSs[0]);
-
-                                if (obs.m_fifo.size() != ibs.m_fifo_idx)
-                                {
-                                    printf("Generated SPS len is different! %ld:%d\n", obs.m_fifo.size(), ibs.m_fifo_idx);
-                                    exit(-1);
-                                }
-                                
-                                SPSs[0].log2_max_frame_num_minus4 = 12; // adjust back because we use 12 to parse slice
-
-
-                                //printf("\n\n--");
-                                //for (int i = 0; i < obs.m_fifo.size(); i++)
-                                //{
-                                //    printf("0x%02x ", obs.m_fifo[i]);
-                                //}
-                                //printf("--\n\n");
-
-                                //InputBitstream_t ibs0;
-
-                                //ibs0.m_fifo_size    = sizeof(u8EsBuffer) - (prefix_len + SIZE_OF_NAL_UNIT_HDR);
-                                //ibs0.m_fifo         = (uint8_t *) calloc(1, ibs0.m_fifo_size);
-                                //ibs0.m_fifo_idx      = 0;
-                                //ibs0.m_num_held_bits = 0;
-                                //ibs0.m_held_bits     = 0;
-                                //ibs0.m_numBitsRead   = 0;
-
-                                //for (int i = 0; i < obs.m_fifo.size(); i++)
-                                //{
-                                //    ibs0.m_fifo[i] = obs.m_fifo[i];
-                                //}
-
-                                //SPS_t sps0;
-                                //AvcInfo_t aaa;
-                                //ParseSPS(ibs0, SPSs, aaa);
-
-                                vector<uint8_t> ebsp;
-                                
-                                RBSPtoEBSP(ebsp, obs.m_fifo);
-
-                                ebsp.insert(ebsp.begin(), ptr, ptr+prefix_len+1);
-                                for (int i = 0; i < ebsp.size(); i++)
-                                {
-                                    ptr[i] = ebsp[i];
-                                }
-
-                                //printf("\n\n--EBSP: ");
-                                //for (int i = 0; i < ebsp.size(); i++)
-                                //{
-                                //    printf("0x%02x ", ebsp[i]);
-                                //}
-                                //printf("--\n\n");
-
-                                //exit(0);
-                            }
-                        }
-                        break;
-                    }
-                    case NALU_TYPE_PPS:
-                    {
-                        ParsePPS(ibs, PPSs, SPSs);
+        // a pipe or terminal cannot be resumed, no checkpoints for those
+        struct stat sb;
+        bool seekable = (fstat(ofd, &sb) == 0 && S_ISREG(sb.st_mode));
 
-                        break;
-                    }
-                    case NALU_TYPE_AUD:
-                    {
-                        //ParseAUD(ibs);
+        snprintf(ckpt, sizeof(ckpt), "%s.ckpt", output_file);
 
-                        break;
-                    }
-                    case NALU_TYPE_IDR:
-                    case NALU_TYPE_SLICE:
-                    {
-                        static int cnt = 0;
-                        static int error_cnt = 0;
-                        
-                        bool IdrPicFlag = ( ( nal_unit_type == 5 ) ? 1 : 0 );
-                        int ret = ParseSlice(ibs, slice, SPSs, PPSs, IdrPicFlag, nal_ref_idc, message);
-
-                        if (ret < 0)
-                        {
-                        }
-                        else
-                        {
-                            SPS_t x_sps = SPSs[ PPSs[slice.pic_parameter_set_id].seq_parameter_set_id ];
-                            x_sps.log2_max_frame_num_minus4 = 11;
-
-                            slice.frame_num %= (1 << 15);
-                        
-                            OutputBitstream_t obs;
-
-                            obs.m_num_held_bits = 0;
-                            obs.m_held_bits     = 0;
-
-                            GenerateSlice(obs, slice, x_sps, PPSs[slice.pic_parameter_set_id], IdrPicFlag, nal_ref_idc);
-
-                            if (obs.m_fifo.size() == ibs.m_fifo_idx)
-                            {
-                                obs.m_fifo.insert(obs.m_fifo.begin(), ptr, ptr+prefix_len+1);
-                                for (int i = 0; i < obs.m_fifo.size(); i++)
-                                {
-                                    ptr[i] = obs.m_fifo[i];
-                                }
-                            }
-                            else
-                            {
-                                printf("Generated slice len is different! %ld:%d\n", obs.m_fifo.size(), ibs.m_fifo_idx);
-
-                                //for (int i = 0; i < prefix_len+1+ibs.m_fifo_idx; i++)
-                                //{
-                                //    printf("0x%02x ", ptr[i]);
-                                //}
-                                //printf("\n");
-
-                                // Padding 0x00 to make slice len the same, so it becomes [0x00 + prefix + NAL header + slice header]
-                                obs.m_fifo.insert(obs.m_fifo.begin(), ptr, ptr+prefix_len+1);
-                                obs.m_fifo.insert(obs.m_fifo.begin(), {0x00});
-                                for (int i = 0; i < obs.m_fifo.size(); i++)
-                                {
-                                    ptr[i] = obs.m_fifo[i];
-                                }
-                                //for (int i = 0; i < obs.m_fifo.size(); i++)
-                                //{
-                                //    printf("0x%02x ", obs.m_fifo[i]);
-                                //}
-                                //printf("\n");
-                                
-                                //exit(-1);
-                            }
-                        }
-                        
-                        break;
-                    }
-                    case NALU_TYPE_SEI:
-                    {
-                        break;
-                    }
-                    default:
-                    {
-                        break;
-                    }
-                }
-            }
+        if (resume && !seekable)
+        {
+            printf("--resume needs a regular output file\n");
+            exit(-1);
         }
 
-        if (prefix_len)
+        if (pcap)
         {
-            ptr += prefix_len;
+            if (RunPcap(input, ofd, ssrc, port) < 0)
+            {
+                exit(-1);
+            }
         }
-        else
+        else if (rtp)
         {
-            ptr++;
+            if (RunRtp(input, ofd, rtp_format, mtu, ssrc, port) < 0)
+            {
+                exit(-1);
+            }
         }
-    }
-
-    // Flush output
-    {
-        char output[256];
-        char *cp = strrchr(argv[1], '.');
+        else if (fmp4)
+        {
+            if (RunFmp4(input, ofd) < 0)
+            {
+                exit(-1);
+            }
+        }
+        else if (IsTransportStream(input))
+        {
+            if (resume)
+            {
+                printf("--resume is not supported for MPEG-TS input\n");
+                exit(-1);
+            }
 
-        strncpy(output, argv[1], cp - argv[1]);
-        strcat(output, "_fix_frame_num");
-        strcat(output, cp);
+            if (RunTs(input, ofd) < 0)
+            {
+                exit(-1);
+            }
+        }
+        else
+        {
+            fix_file(input, ofd, seekable ? ckpt : NULL, resume);
+        }
 
-        int ofd = open(output, O_RDWR | O_CREAT, S_IRUSR);
-        write(ofd, data, file_size);
-        close(ofd);
+        CloseInput(input);
     }
 
+    close(ofd);
+
     return 0;
 }
 
@@ -0,0 +1,556 @@
+//
+//  mp4.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "inplace.h"
+#include "rewrite.h"
+#include "mp4.h"
+
+
+using namespace std;
+
+
+/*
+ * The sample tables of the video track, pointing into the mapping.
+ */
+typedef struct
+{
+    uint8_t *data;
+    uint64_t size;
+    Rewrite_t rw;
+
+    uint8_t *avcC;
+    uint64_t avcC_size;
+    uint8_t *stsz;
+    uint64_t stsz_size;
+    uint8_t *stsc;
+    uint64_t stsc_size;
+    uint8_t *stco;
+    uint64_t stco_size;
+    bool     co64;
+
+    uint32_t nal_length_size;
+    uint32_t sample_count;
+
+    vector<uint8_t> patch;
+
+    uint64_t num_patches;
+    uint64_t num_skipped;
+    uint64_t num_resized;
+    uint64_t moved_bytes;
+} Mp4_t;
+
+
+/******************************
+ * local function
+ */
+
+static uint32_t rd32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+
+static uint64_t rd64(const uint8_t *p)
+{
+    return ((uint64_t) rd32(p) << 32) | rd32(p + 4);
+}
+
+
+static void wr32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+
+/**
+ * Return the body of the first box of the given type in [p, p + size),
+ * or NULL.
+ */
+static uint8_t *find_box(uint8_t *p, uint64_t size, uint32_t type, uint64_t &body_size)
+{
+    uint8_t *end = p + size;
+
+    while (end - p >= 8)
+    {
+        uint64_t box_size = rd32(p);
+        uint32_t hdr_size = 8;
+
+        if (box_size == 1)
+        {
+            if (end - p < 16)
+            {
+                return NULL;
+            }
+
+            box_size = rd64(p + 8);
+            hdr_size = 16;
+        }
+        else if (box_size == 0)
+        {
+            box_size = end - p;
+        }
+
+        if (box_size < hdr_size || box_size > (uint64_t) (end - p))
+        {
+            return NULL;
+        }
+
+        if (rd32(p + 4) == type)
+        {
+            body_size = box_size - hdr_size;
+            return p + hdr_size;
+        }
+
+        p += box_size;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Look for an avc1/avc3 video track in one trak box and pick up its
+ * avcC and sample tables.
+ */
+static bool find_track(Mp4_t &m, uint8_t *trak, uint64_t trak_size)
+{
+    uint64_t mdia_size, hdlr_size, minf_size, stbl_size, stsd_size;
+
+    uint8_t *mdia = find_box(trak, trak_size, MP4_FOURCC('m', 'd', 'i', 'a'), mdia_size);
+    uint8_t *hdlr = mdia ? find_box(mdia, mdia_size, MP4_FOURCC('h', 'd', 'l', 'r'), hdlr_size) : NULL;
+
+    if (hdlr == NULL || hdlr_size < 12 || rd32(hdlr + 8) != MP4_FOURCC('v', 'i', 'd', 'e'))
+    {
+        return false;
+    }
+
+    uint8_t *minf = find_box(mdia, mdia_size, MP4_FOURCC('m', 'i', 'n', 'f'), minf_size);
+    uint8_t *stbl = minf ? find_box(minf, minf_size, MP4_FOURCC('s', 't', 'b', 'l'), stbl_size) : NULL;
+    uint8_t *stsd = stbl ? find_box(stbl, stbl_size, MP4_FOURCC('s', 't', 's', 'd'), stsd_size) : NULL;
+
+    if (stsd == NULL || stsd_size < 16)
+    {
+        return false;
+    }
+
+    // only the first sample description is looked at
+    uint8_t *entry = stsd + 8;
+    uint64_t entry_size = rd32(entry);
+    uint32_t format = rd32(entry + 4);
+
+    if ((format != MP4_FOURCC('a', 'v', 'c', '1') && format != MP4_FOURCC('a', 'v', 'c', '3'))
+     || entry_size < 8 + MP4_VISUAL_ENTRY_SIZE || entry_size > stsd_size - 8)
+    {
+        return false;
+    }
+
+    m.avcC = find_box(entry + 8 + MP4_VISUAL_ENTRY_SIZE, entry_size - 8 - MP4_VISUAL_ENTRY_SIZE, MP4_FOURCC('a', 'v', 'c', 'C'), m.avcC_size);
+    m.stsz = find_box(stbl, stbl_size, MP4_FOURCC('s', 't', 's', 'z'), m.stsz_size);
+    m.stsc = find_box(stbl, stbl_size, MP4_FOURCC('s', 't', 's', 'c'), m.stsc_size);
+    m.stco = find_box(stbl, stbl_size, MP4_FOURCC('s', 't', 'c', 'o'), m.stco_size);
+    m.co64 = false;
+
+    if (m.stco == NULL)
+    {
+        m.stco = find_box(stbl, stbl_size, MP4_FOURCC('c', 'o', '6', '4'), m.stco_size);
+        m.co64 = true;
+    }
+
+    if (m.avcC == NULL || m.avcC_size < 7 || m.stsz == NULL || m.stsz_size < 12
+     || m.stsc == NULL || m.stsc_size < 8 || m.stco == NULL || m.stco_size < 8)
+    {
+        printf("MP4: video track without avcC or sample tables (stz2 and fragmented files are not supported)\n");
+        return false;
+    }
+
+    m.nal_length_size   = (m.avcC[4] & 0x03) + 1;
+    m.sample_count      = rd32(m.stsz + 8);
+
+    if (rd32(m.stsz + 4) == 0 && m.stsz_size < 12 + 4 * (uint64_t) m.sample_count)
+    {
+        printf("MP4: stsz too short\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Run the parameter sets of avcC through the rewrite. The 16 bit length
+ * in front of each one takes the place of the start code.
+ */
+static void fix_avcC(Mp4_t &m)
+{
+    uint8_t *p   = m.avcC + 5;
+    uint8_t *end = m.avcC + m.avcC_size;
+
+    for (int list = 0; list < 2 && p < end; list++)
+    {
+        uint32_t num = (list == 0) ? (*p++ & 0x1F) : *p++;
+
+        for (uint32_t i = 0; i < num && end - p >= 3; i++)
+        {
+            uint64_t len = (p[0] << 8) | p[1];
+
+            if (len > (uint64_t) (end - p - 2))
+            {
+                return;
+            }
+
+            uint64_t replaced = RewriteNal(m.rw, p, 2 + len, 2, p - m.data, m.patch);
+
+            if (replaced && m.patch.size() == replaced)
+            {
+                memcpy(p, m.patch.data(), replaced);
+                m.num_patches++;
+            }
+            else if (replaced)
+            {
+                printf("MP4: avcC parameter set changes length, left unchanged\n");
+                m.num_skipped++;
+            }
+
+            p += 2 + len;
+        }
+    }
+}
+
+
+static uint64_t sample_size(Mp4_t &m, uint32_t sample)
+{
+    uint32_t size = rd32(m.stsz + 4);
+
+    return size ? size : rd32(m.stsz + 12 + 4 * (uint64_t) sample);
+}
+
+
+/**
+ * Rewrite the NALs of the sample at src and store the result at dst,
+ * dst <= src. Returns the new sample size.
+ */
+static uint64_t fix_sample(Mp4_t &m, uint64_t src, uint64_t size, uint64_t dst)
+{
+    uint8_t *data   = m.data;
+    uint32_t nls    = m.nal_length_size;
+    bool     fixed  = rd32(m.stsz + 4) != 0;        // one size for all samples, nothing may move
+    uint64_t p      = src;
+    uint64_t q      = dst;
+    uint64_t end    = src + size;
+
+    while (end - p > nls)
+    {
+        uint64_t nal_size = 0;
+
+        for (uint32_t i = 0; i < nls; i++)
+        {
+            nal_size = (nal_size << 8) | data[p + i];
+        }
+
+        if (nal_size == 0 || nal_size > end - p - nls)
+        {
+            break;
+        }
+
+        uint64_t unit = nls + nal_size;
+        uint64_t replaced = RewriteNal(m.rw, data + p, unit, nls, p, m.patch);
+        vector<uint8_t> &patch = m.patch;
+
+        if (replaced > unit)
+        {
+            replaced = unit;
+        }
+
+        uint64_t new_size = nal_size - replaced + patch.size();
+
+        // a longer header may only use bytes freed earlier in the chunk
+        bool fits = (q + patch.size() <= p + replaced)
+                 && (!fixed || patch.size() == replaced)
+                 && (nls == 4 || new_size < (1ull << (8 * nls)));
+
+        if (replaced && fits)
+        {
+            for (uint32_t i = 0; i < nls; i++)
+            {
+                patch[i] = new_size >> (8 * (nls - 1 - i));
+            }
+
+            memcpy(data + q, patch.data(), patch.size());
+            memmove(data + q + patch.size(), data + p + replaced, unit - replaced);
+
+            m.num_patches++;
+        }
+        else
+        {
+            if (replaced)
+            {
+                printf("MP4: header at 0x%llx does not fit, left unchanged\n", (unsigned long long) p);
+                m.num_skipped++;
+                new_size = nal_size;
+            }
+
+            if (q != p)
+            {
+                memmove(data + q, data + p, unit);
+            }
+        }
+
+        if (q != p)
+        {
+            m.moved_bytes += unit;
+        }
+
+        p += unit;
+        q += nls + new_size;
+    }
+
+    // whatever does not parse as NALs stays as it is
+    if (p < end)
+    {
+        memmove(data + q, data + p, end - p);
+        q += end - p;
+    }
+
+    return q - dst;
+}
+
+
+/**
+ * Fix the samples of one chunk. Samples that shrink pull the rest of the
+ * chunk forward; the bytes freed at its end are zeroed and no longer
+ * referenced by any sample, so the chunk offsets stay valid.
+ */
+static int fix_chunk(Mp4_t &m, uint64_t offset, uint32_t first, uint32_t count)
+{
+    uint64_t src = offset;
+    uint64_t dst = offset;
+
+    for (uint32_t s = first; s < first + count; s++)
+    {
+        uint64_t size = sample_size(m, s);
+
+        if (src > m.size || size > m.size - src)
+        {
+            printf("MP4: sample %u runs past the end of the file\n", s);
+            return -1;
+        }
+
+        uint64_t new_size = fix_sample(m, src, size, dst);
+
+        if (new_size != size)
+        {
+            wr32(m.stsz + 12 + 4 * (uint64_t) s, new_size);
+            m.num_resized++;
+        }
+
+        src += size;
+        dst += new_size;
+    }
+
+    memset(m.data + dst, 0, src - dst);
+
+    return 0;
+}
+
+
+/**
+ * Walk the chunks of the video track in stco/co64 order, with the samples
+ * per chunk from stsc.
+ */
+static int fix_samples(Mp4_t &m)
+{
+    uint32_t num_entries = rd32(m.stsc + 4);
+    uint32_t num_chunks  = rd32(m.stco + 4);
+    uint32_t entry = 0;
+    uint32_t sample = 0;
+
+    if (m.stsc_size < 8 + 12 * (uint64_t) num_entries
+     || m.stco_size < 8 + (m.co64 ? 8 : 4) * (uint64_t) num_chunks)
+    {
+        printf("MP4: stsc/stco too short\n");
+        return -1;
+    }
+
+    for (uint32_t c = 0; c < num_chunks && num_entries > 0; c++)
+    {
+        const uint8_t *e = m.stsc + 8;
+
+        while (entry + 1 < num_entries && rd32(e + 12 * (entry + 1)) <= c + 1)
+        {
+            entry++;
+        }
+
+        uint32_t count = rd32(e + 12 * entry + 4);
+        uint64_t offset = m.co64 ? rd64(m.stco + 8 + 8 * (uint64_t) c) : rd32(m.stco + 8 + 4 * (uint64_t) c);
+
+        if (count > m.sample_count - sample)
+        {
+            printf("MP4: stsc describes more samples than stsz\n");
+            return -1;
+        }
+
+        if (fix_chunk(m, offset, sample, count) < 0)
+        {
+            return -1;
+        }
+
+        sample += count;
+    }
+
+    return 0;
+}
+
+
+/**
+ * True when the file starts with an ISO BMFF ftyp box.
+ */
+bool IsMp4File(const char *path)
+{
+    uint8_t hdr[8];
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool ret = (pread(fd, hdr, sizeof(hdr), 0) == sizeof(hdr) && rd32(hdr + 4) == MP4_FOURCC('f', 't', 'y', 'p'));
+
+    close(fd);
+
+    return ret;
+}
+
+
+/**
+ * Fix the H.264 track of an MP4 file in place.
+ *
+ * No start code is ever searched for: the sample tables give every
+ * sample, the length prefixes every NAL in it, and the parameter sets
+ * come from avcC. Rewritten headers go straight back into the mapping.
+ * A sample whose headers come out shorter is shrunk and stsz updated;
+ * the samples behind it in the same chunk move up, so chunk offsets do
+ * not change. A header that grows only fits into bytes freed earlier in
+ * its chunk, otherwise it is left unchanged.
+ *
+ * Samples are moved inside the file, there is no undo journal: use
+ * backup to keep a copy of the original.
+ */
+int RunMp4(const char *path, bool backup)
+{
+    Mp4_t m;
+    struct stat sb;
+    int ret = -1;
+
+    m.num_patches   = 0;
+    m.num_skipped   = 0;
+    m.num_resized   = 0;
+    m.moved_bytes   = 0;
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &sb) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    m.size = sb.st_size;
+
+    if (backup && BackupFile(path, fd, m.size) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *addr = mmap(NULL, m.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    m.data = (uint8_t *) addr;
+    madvise(m.data, m.size, MADV_SEQUENTIAL);
+
+    if (InitRewrite(m.rw) < 0)
+    {
+        munmap(addr, m.size);
+        close(fd);
+        return -1;
+    }
+
+    uint64_t moov_size, trak_size;
+    uint8_t *moov = find_box(m.data, m.size, MP4_FOURCC('m', 'o', 'o', 'v'), moov_size);
+    uint8_t *p = moov;
+    bool found = false;
+
+    // trak boxes are siblings, look at each of them in turn
+    while (p && !found)
+    {
+        uint8_t *trak = find_box(p, moov + moov_size - p, MP4_FOURCC('t', 'r', 'a', 'k'), trak_size);
+
+        if (trak == NULL)
+        {
+            break;
+        }
+
+        found   = find_track(m, trak, trak_size);
+        p       = trak + trak_size;
+    }
+
+    if (!found)
+    {
+        printf("%s: no H.264 track found\n", path);
+    }
+    else
+    {
+        fix_avcC(m);
+        ret = fix_samples(m);
+    }
+
+    if (msync(m.data, m.size, MS_SYNC) != 0 || fdatasync(fd) != 0)
+    {
+        perror(path);
+        ret = -1;
+    }
+
+    printf("MP4: %llu headers rewritten, %llu left unchanged, %llu samples resized, %llu bytes moved\n",
+           (unsigned long long) m.num_patches,
+           (unsigned long long) m.num_skipped,
+           (unsigned long long) m.num_resized,
+           (unsigned long long) m.moved_bytes);
+
+    FreeRewrite(m.rw);
+    munmap(addr, m.size);
+    close(fd);
+
+    return ret;
+}
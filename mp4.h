@@ -0,0 +1,16 @@
+
+
+#ifndef ___I_AVC_MP4_H___
+#define ___I_AVC_MP4_H___
+
+
+#define MP4_FOURCC(a, b, c, d)  (((uint32_t) (a) << 24) | ((uint32_t) (b) << 16) | ((uint32_t) (c) << 8) | (uint32_t) (d))
+
+#define MP4_VISUAL_ENTRY_SIZE   78      // VisualSampleEntry fields in front of the child boxes
+
+
+extern bool IsMp4File(const char *path);
+
+extern int RunMp4(const char *path, bool backup);
+
+#endif
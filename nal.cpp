@@ -0,0 +1,345 @@
+//
+//  nal.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "common.h"
+#include "nal.h"
+
+
+/******************************
+ * local function
+ */
+
+/**
+ * Portable search, skips ahead by three when the third byte cannot belong
+ * to a start code.
+ */
+static const uint8_t *find_c(const uint8_t *p, const uint8_t *end)
+{
+    while (p + 3 <= end)
+    {
+        // a non-zero third byte rules out a start code at p, p+1 and p+2
+        if (p[2] == 0)
+        {
+            p++;
+        }
+        else if (p[2] == 1 && p[1] == 0 && p[0] == 0)
+        {
+            return p;
+        }
+        else
+        {
+            p += 3;
+        }
+    }
+
+    return end;
+}
+
+
+/**
+ * Eight bytes at a time in a general register. A start code needs a zero
+ * byte where it begins, words without one are skipped whole.
+ */
+static const uint8_t *find_swar(const uint8_t *p, const uint8_t *end)
+{
+    const uint64_t lo = 0x0101010101010101ull;
+    const uint64_t hi = 0x8080808080808080ull;
+
+    while (p + 10 <= end)
+    {
+        uint64_t w;
+
+        memcpy(&w, p, sizeof(w));
+
+        if ((w - lo) & ~w & hi)
+        {
+            // positions p .. p+7, the last one reads up to p+9
+            const uint8_t *sc = find_c(p, p + 10);
+
+            if (sc != p + 10)
+            {
+                return sc;
+            }
+        }
+
+        p += 8;
+    }
+
+    return find_c(p, end);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * The vector versions compare a block against itself shifted by one and
+ * two bytes, so every lane answers "does a start code begin here".
+ */
+__attribute__((target("sse2")))
+static const uint8_t *find_sse2(const uint8_t *p, const uint8_t *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one  = _mm_set1_epi8(1);
+
+    while (p + 16 + 2 <= end)
+    {
+        __m128i b0 = _mm_loadu_si128((const __m128i *) p);
+        __m128i b1 = _mm_loadu_si128((const __m128i *) (p + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i *) (p + 2));
+
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                                  _mm_cmpeq_epi8(b2, one));
+        uint32_t mask = _mm_movemask_epi8(m);
+
+        if (mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return find_c(p, end);
+}
+
+
+__attribute__((target("avx2")))
+static const uint8_t *find_avx2(const uint8_t *p, const uint8_t *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one  = _mm256_set1_epi8(1);
+
+    while (p + 32 + 2 <= end)
+    {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *) p);
+        __m256i b1 = _mm256_loadu_si256((const __m256i *) (p + 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i *) (p + 2));
+
+        __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)),
+                                     _mm256_cmpeq_epi8(b2, one));
+        uint32_t mask = _mm256_movemask_epi8(m);
+
+        if (mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return find_sse2(p, end);
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static const uint8_t *find_avx512(const uint8_t *p, const uint8_t *end)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one  = _mm512_set1_epi8(1);
+
+    while (p + 64 + 2 <= end)
+    {
+        __m512i b0 = _mm512_loadu_si512((const void *) p);
+        __m512i b1 = _mm512_loadu_si512((const void *) (p + 1));
+        __m512i b2 = _mm512_loadu_si512((const void *) (p + 2));
+
+        uint64_t mask = _mm512_cmpeq_epi8_mask(b0, zero)
+                      & _mm512_cmpeq_epi8_mask(b1, zero)
+                      & _mm512_cmpeq_epi8_mask(b2, one);
+
+        if (mask)
+        {
+            return p + __builtin_ctzll(mask);
+        }
+
+        p += 64;
+    }
+
+    return find_avx2(p, end);
+}
+
+#endif
+
+
+// slowest first, each entry needs what the ones before it need
+static const StartCodeScanner_t scanners[] =
+{
+    { "c",          find_c      },
+    { "swar",       find_swar   },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse2",       find_sse2   },
+    { "avx2",       find_avx2   },
+    { "avx512bw",   find_avx512 },
+#endif
+};
+
+
+static int usable_scanners(void)
+{
+    int num = 2;
+
+#if defined(__x86_64__) || defined(__i386__)
+    // cpuid, and for the wider ones whether the OS saves their registers
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2"))
+    {
+        num++;
+
+        if (__builtin_cpu_supports("avx2"))
+        {
+            num++;
+
+            if (__builtin_cpu_supports("avx512bw"))
+            {
+                num++;
+            }
+        }
+    }
+#endif
+
+    return num;
+}
+
+
+static const StartCodeScanner_t *scanner = &scanners[usable_scanners() - 1];
+
+
+/**
+ * Return the address of the first 0x000001 in [p, end), or end.
+ *
+ * A four byte start code is the same search hit with one more zero in
+ * front of it, callers look back one byte to tell the two apart. The
+ * widest scanner this CPU supports is picked once at start up.
+ */
+const uint8_t *FindStartCode(const uint8_t *p, const uint8_t *end)
+{
+    return scanner->find(p, end);
+}
+
+
+/**
+ * Walk the NAL units of data[0, size), starting the search at offset.
+ */
+void InitNalIter(NalIter_t &it, const uint8_t *data, uint64_t size, uint64_t offset)
+{
+    it.data = data;
+    it.from = data + offset;
+    it.end  = data + size;
+    it.sc   = FindStartCode(it.from, it.end);
+}
+
+
+/**
+ * Fill in the next NAL unit and return true, or return false at the end
+ * of the data. Every start code is searched for exactly once: the one
+ * that ends this NAL unit is where the next call starts.
+ */
+bool NextNal(NalIter_t &it, NalUnit_t &nal)
+{
+    const uint8_t *sc = it.sc;
+
+    if (sc == it.end)
+    {
+        return false;
+    }
+
+    const uint8_t *next  = FindStartCode(sc + 3, it.end);
+    const uint8_t *start = (sc > it.from && sc[-1] == 0x00) ? sc - 1 : sc;
+    const uint8_t *stop  = (next != it.end && next[-1] == 0x00) ? next - 1 : next;
+    const uint8_t *last  = stop;
+
+    // a NAL unit never ends in a zero byte, those are trailing_zero_8bits
+    while (last > sc + 3 && last[-1] == 0x00)
+    {
+        last--;
+    }
+
+    nal.offset          = start - it.data;
+    nal.prefix_len      = sc + 3 - start;
+    nal.size            = last - start;
+    nal.next            = stop - it.data;
+    nal.header          = (last > sc + 3) ? sc[3] : 0;
+    nal.nal_unit_type   = nal.header & 0x1F;
+    nal.nal_ref_idc     = (nal.header >> 5) & 0x03;
+    nal.payload         = sc + 4;
+    nal.payload_len     = (last > sc + 3) ? last - (sc + 4) : 0;
+
+    it.sc = next;
+
+    return true;
+}
+
+
+/**
+ * Name of the scanner behind FindStartCode.
+ */
+const char *StartCodeScannerName(void)
+{
+    return scanner->name;
+}
+
+
+/**
+ * Point *list at the scanners this CPU can run, slowest first, and return
+ * how many there are.
+ */
+int GetStartCodeScanners(const StartCodeScanner_t **list)
+{
+    *list = scanners;
+
+    return scanner - scanners + 1;
+}
+
+
+/**
+ * Write a filler data NAL unit (nal_unit_type 12, nal_ref_idc 0) of exactly
+ * len bytes, start code not included: the header, ff_bytes and the rbsp
+ * stop byte. len must be at least FILLER_NAL_MIN_SIZE.
+ */
+void MakeFiller(uint8_t *dst, uint64_t len)
+{
+    dst[0] = 0x0C;
+
+    for (uint64_t i = 1; i + 1 < len; i++)
+    {
+        dst[i] = 0xFF;
+    }
+
+    dst[len - 1] = 0x80;
+}
+
+
+/**
+ * True when a NAL unit of this type, following a VCL NAL unit, is the
+ * first of a new access unit (7.4.1.2.3). first_slice tells whether a
+ * slice has first_mb_in_slice 0, it is ignored for other types.
+ */
+bool StartsAccessUnit(uint8_t nal_unit_type, bool first_slice)
+{
+    bool is_slice = (nal_unit_type == NALU_TYPE_SLICE || nal_unit_type == NALU_TYPE_IDR);
+
+    return nal_unit_type == NALU_TYPE_SEI || nal_unit_type == NALU_TYPE_SPS
+        || nal_unit_type == NALU_TYPE_PPS || nal_unit_type == NALU_TYPE_AUD
+        || (nal_unit_type >= 14 && nal_unit_type <= 18)
+        || (is_slice && first_slice);
+}
@@ -0,0 +1,61 @@
+
+
+#ifndef ___I_AVC_NAL_H___
+#define ___I_AVC_NAL_H___
+
+
+#define FILLER_NAL_MIN_SIZE         2       // NAL header and the rbsp stop byte
+#define FILLER_UNIT_MIN_SIZE        (3 + FILLER_NAL_MIN_SIZE)   // with a short start code
+
+
+typedef const uint8_t *(*FindStartCode_t)(const uint8_t *p, const uint8_t *end);
+
+typedef struct
+{
+    const char      *name;
+    FindStartCode_t  find;
+} StartCodeScanner_t;
+
+
+/*
+ * One NAL unit of an Annex-B byte stream. A start code with nothing but
+ * zeros behind it is still reported, with size == prefix_len and header 0.
+ */
+typedef struct
+{
+    uint64_t        offset;         // first byte of the start code
+    uint32_t        prefix_len;     // 3 or 4
+    uint64_t        size;           // start code and NAL, trailing_zero_8bits excluded
+    uint64_t        next;           // offset of the following NAL unit, or the end of the data
+    uint8_t         header;         // nal_unit_header byte
+    uint8_t         nal_unit_type;
+    uint8_t         nal_ref_idc;
+    const uint8_t  *payload;        // NAL bytes after the header
+    uint64_t        payload_len;
+} NalUnit_t;
+
+typedef struct
+{
+    const uint8_t  *data;
+    const uint8_t  *from;           // a start code never reaches back before this
+    const uint8_t  *end;
+    const uint8_t  *sc;             // 0x000001 of the NAL unit NextNal returns, end when done
+} NalIter_t;
+
+
+extern const uint8_t *FindStartCode(const uint8_t *p, const uint8_t *end);
+
+extern void InitNalIter(NalIter_t &it, const uint8_t *data, uint64_t size, uint64_t offset);
+
+extern bool NextNal(NalIter_t &it, NalUnit_t &nal);
+
+extern const char *StartCodeScannerName(void);
+
+extern int GetStartCodeScanners(const StartCodeScanner_t **list);
+
+extern void MakeFiller(uint8_t *dst, uint64_t len);
+
+extern bool StartsAccessUnit(uint8_t nal_unit_type, bool first_slice);
+
+#endif
+
@@ -0,0 +1,288 @@
+//
+//  output.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "direct.h"
+#include "output.h"
+
+
+using namespace std;
+
+
+#define COPY_RANGE_MIN_SIZE     (64 << 10)
+
+
+void WriteAll(int fd, const uint8_t *buf, uint64_t len)
+{
+    while (len > 0)
+    {
+        ssize_t wr_sz = write(fd, buf, len);
+
+        if (wr_sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("write");
+            exit(-1);
+        }
+
+        buf += wr_sz;
+        len -= wr_sz;
+    }
+}
+
+
+void InitOutput(Output_t &out, int ofd, int ifd, const uint8_t *base)
+{
+    out.ofd         = ofd;
+    out.ifd         = ifd;
+    out.base        = base;
+    out.copy_range  = (ifd >= 0);
+    out.direct      = NULL;
+    out.queued      = 0;
+
+    int flags = fcntl(ofd, F_GETFL);
+
+    if (flags >= 0 && (flags & O_DIRECT))
+    {
+        // O_DIRECT must not be mixed with copies through the page cache
+        out.direct      = OpenDirect(ofd);
+        out.copy_range  = false;
+
+        if (out.direct == NULL)
+        {
+            exit(-1);
+        }
+    }
+
+    out.segments.clear();
+    out.pool.clear();
+}
+
+
+void OutputRange(Output_t &out, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    out.queued += length;
+
+    // extend the previous range when contiguous
+    if (!out.segments.empty())
+    {
+        Segment_t &last = out.segments.back();
+
+        if (last.isInput && last.offset + last.length == offset)
+        {
+            last.length += length;
+            return;
+        }
+    }
+
+    Segment_t seg = { offset, length, true };
+
+    out.segments.push_back(seg);
+}
+
+
+void OutputBytes(Output_t &out, const uint8_t *bytes, uint64_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    Segment_t seg = { out.pool.size(), length, false };
+
+    out.pool.insert(out.pool.end(), bytes, bytes + length);
+    out.segments.push_back(seg);
+    out.queued += length;
+}
+
+
+static void write_iov(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t wr_sz = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+
+        if (wr_sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("writev");
+            exit(-1);
+        }
+
+        // skip what went out, a short write may stop inside an entry
+        while (iovcnt > 0 && (size_t) wr_sz >= iov->iov_len)
+        {
+            wr_sz -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *) iov->iov_base + wr_sz;
+            iov->iov_len -= wr_sz;
+        }
+    }
+}
+
+
+/**
+ * Move an input range to the output inside the kernel.
+ *
+ * Returns false, leaving the range for writev, when the pair of fds does
+ * not support it (pipes, different file systems, old kernels).
+ */
+static bool copy_range(Output_t &out, uint64_t offset, uint64_t length)
+{
+    loff_t off_in = offset;
+
+    while (length > 0)
+    {
+        ssize_t cp_sz = copy_file_range(out.ifd, &off_in, out.ofd, NULL, length, 0);
+
+        if (cp_sz < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (cp_sz <= 0)
+        {
+            if (off_in != (loff_t) offset)
+            {
+                perror("copy_file_range");
+                exit(-1);
+            }
+
+            out.copy_range = false;
+            return false;
+        }
+
+        length -= cp_sz;
+    }
+
+    return true;
+}
+
+
+void FlushOutput(Output_t &out)
+{
+    vector<struct iovec> iov;
+
+    if (out.direct)
+    {
+        for (size_t i = 0; i < out.segments.size(); i++)
+        {
+            Segment_t &seg = out.segments[i];
+
+            DirectWrite(out.direct, seg.isInput ? out.base + seg.offset : &out.pool[seg.offset], seg.length);
+        }
+
+        out.segments.clear();
+        out.pool.clear();
+        out.queued = 0;
+
+        return;
+    }
+
+    for (size_t i = 0; i < out.segments.size(); i++)
+    {
+        Segment_t &seg = out.segments[i];
+
+        if (seg.isInput && out.copy_range && seg.length >= COPY_RANGE_MIN_SIZE)
+        {
+            write_iov(out.ofd, iov.data(), iov.size());
+            iov.clear();
+
+            if (copy_range(out, seg.offset, seg.length))
+            {
+                continue;
+            }
+        }
+
+        struct iovec v;
+
+        v.iov_base  = (void *) (seg.isInput ? out.base + seg.offset : &out.pool[seg.offset]);
+        v.iov_len   = seg.length;
+
+        iov.push_back(v);
+    }
+
+    write_iov(out.ofd, iov.data(), iov.size());
+
+    out.segments.clear();
+    out.pool.clear();
+    out.queued = 0;
+}
+
+
+/**
+ * Copy the queued output into dst instead of writing it, for callers that
+ * hand the bytes to their own I/O (the io_uring engine).
+ */
+void GatherOutput(Output_t &out, vector<uint8_t> &dst)
+{
+    dst.resize(out.queued);
+
+    uint8_t *p = dst.data();
+
+    for (size_t i = 0; i < out.segments.size(); i++)
+    {
+        Segment_t &seg = out.segments[i];
+
+        memcpy(p, seg.isInput ? out.base + seg.offset : &out.pool[seg.offset], seg.length);
+        p += seg.length;
+    }
+
+    out.segments.clear();
+    out.pool.clear();
+    out.queued = 0;
+}
+
+
+/**
+ * Finish the output once everything has been flushed.
+ */
+void CloseOutput(Output_t &out)
+{
+    if (out.direct)
+    {
+        CloseDirect(out.direct);
+        out.direct = NULL;
+    }
+}
@@ -0,0 +1,52 @@
+
+
+#ifndef ___I_AVC_OUTPUT_H___
+#define ___I_AVC_OUTPUT_H___
+
+
+typedef struct
+{
+    uint64_t offset;        // input offset, or offset into the byte pool
+    uint64_t length;
+    bool     isInput;       // true: range of the input, false: new bytes
+} Segment_t;
+
+
+/*
+ * Output gather list: the output is described as a sequence of input
+ * ranges and newly generated bytes, so unchanged data is never copied in
+ * user space. Input ranges go out with copy_file_range() when the input
+ * fd allows it, everything else with writev() straight from the input
+ * mapping and the byte pool. An ofd opened with O_DIRECT goes through
+ * the aligned buffers of a Direct_t instead.
+ */
+typedef struct
+{
+    int      ofd;
+    int      ifd;                       // input fd for copy_file_range, -1 if none
+    const uint8_t *base;                // input bytes for writev
+    bool     copy_range;                // copy_file_range still usable
+    struct Direct_t *direct;            // O_DIRECT writer, NULL for plain writes
+
+    std::vector<Segment_t> segments;
+    std::vector<uint8_t>   pool;        // regenerated header bytes
+    uint64_t queued;                    // bytes described by segments
+} Output_t;
+
+
+extern void WriteAll(int fd, const uint8_t *buf, uint64_t len);
+
+extern void InitOutput(Output_t &out, int ofd, int ifd, const uint8_t *base);
+
+extern void OutputRange(Output_t &out, uint64_t offset, uint64_t length);
+
+extern void OutputBytes(Output_t &out, const uint8_t *bytes, uint64_t length);
+
+extern void FlushOutput(Output_t &out);
+
+extern void GatherOutput(Output_t &out, std::vector<uint8_t> &dst);
+
+extern void CloseOutput(Output_t &out);
+
+#endif
+
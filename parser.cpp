@@ -314,7 +314,7 @@ static void ref_pic_list_modification(InputBitstream_t &ibs, Slice_t &slice)
                 {
                     slice.ref_pic_list_modification_q0.push_back( { modification_of_pic_nums_idc, 0 } );
                 }
-            } while (modification_of_pic_nums_idc != 3);
+            } while (modification_of_pic_nums_idc != 3 && !RBSP_OVERRUN(ibs));
         }
     }
 
@@ -337,7 +337,7 @@ static void ref_pic_list_modification(InputBitstream_t &ibs, Slice_t &slice)
                     long_term_pic_num = READ_UVLC(ibs, "long_term_pic_num");
                     slice.ref_pic_list_modification_q1.push_back( { modification_of_pic_nums_idc, long_term_pic_num } );
                 }
-            } while (modification_of_pic_nums_idc != 3);
+            } while (modification_of_pic_nums_idc != 3 && !RBSP_OVERRUN(ibs));
         }
     }
 
@@ -356,7 +356,7 @@ static void pred_weight_table(InputBitstream_t &bitstream, Slice_t &slice, SPS_t
         slice.chroma_log2_weight_denom = READ_UVLC(bitstream, "chroma_log2_weight_denom");
     }
 
-    for (uint32_t i = 0; i <= slice.num_ref_idx_l0_active_minus1; i++)
+    for (uint32_t i = 0; i <= slice.num_ref_idx_l0_active_minus1 && !RBSP_OVERRUN(bitstream); i++)
     {
         slice.luma_weight_l0_flag = READ_FLAG(bitstream, "luma_weight_l0_flag");
         if (slice.luma_weight_l0_flag)
@@ -381,7 +381,7 @@ static void pred_weight_table(InputBitstream_t &bitstream, Slice_t &slice, SPS_t
 
     if (slice.slice_type == B_SLICE)
     {
-        for (uint32_t i = 0; i <= slice.num_ref_idx_l1_active_minus1; i++)
+        for (uint32_t i = 0; i <= slice.num_ref_idx_l1_active_minus1 && !RBSP_OVERRUN(bitstream); i++)
         {
             slice.luma_weight_l1_flag = READ_FLAG(bitstream, "luma_weight_l1_flag");
             if (slice.luma_weight_l1_flag)
@@ -456,7 +456,7 @@ static void dec_ref_pic_marking(InputBitstream_t &bitstream, Slice_t &slice, boo
                 {
                     slice.memory_management_control_ops.push_back( { memory_management_control_operation, 0 } );
                 }
-            } while (memory_management_control_operation != 0);
+            } while (memory_management_control_operation != 0 && !RBSP_OVERRUN(bitstream));
         }
     }
 }
@@ -0,0 +1,529 @@
+//
+//  pcap.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "input.h"
+#include "output.h"
+#include "rewrite.h"
+#include "rtp.h"
+#include "pcap.h"
+
+
+using namespace std;
+
+
+typedef struct
+{
+    Input_t  *input;
+    Output_t  out;
+    Rewrite_t rw;
+
+    bool     swapped;               // capture written on a host of the other byte order
+    uint32_t linktype;
+
+    int64_t  ssrc;                  // stream to follow, -1 until the first RTP packet picks one
+    int      port;                  // UDP destination port, 0 for any
+
+    bool     have_seq;
+    uint16_t seq;
+
+    // NAL being reassembled from FU-A fragments, payload kept as pcap ranges
+    bool     in_fu;
+    uint8_t  fu_hdr;
+    uint64_t fu_offset;
+    vector<Segment_t> fu;
+
+    vector<uint8_t> patch;
+
+    uint64_t num_packets;
+    uint64_t num_nals;
+    uint64_t num_lost;
+    uint64_t num_dropped;           // NAL units lost with a fragment
+    uint64_t num_unsupported;
+} Pcap_t;
+
+
+static const uint8_t start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+
+/******************************
+ * local function
+ */
+
+static uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+static uint32_t rd32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+
+static uint32_t rd32_pcap(Pcap_t &p, const uint8_t *q)
+{
+    uint32_t v;
+
+    memcpy(&v, q, sizeof(v));
+
+    return p.swapped ? __builtin_bswap32(v) : v;
+}
+
+
+/**
+ * Rewrite one NAL unit and queue it with a start code. The payload behind
+ * the NAL header byte is given as pcap ranges; only the header window is
+ * gathered into a buffer for the parser, everything else goes out as
+ * ranges of the capture.
+ */
+static void emit_nal(Pcap_t &p, uint8_t nal_hdr, const Segment_t *pieces, size_t num, uint64_t offset)
+{
+    uint8_t  win[NAL_HDR_WINDOW_SIZE];
+    uint64_t len = sizeof(start_code);
+
+    memcpy(win, start_code, sizeof(start_code));
+    win[len++] = nal_hdr;
+
+    for (size_t i = 0; i < num && len < sizeof(win); i++)
+    {
+        uint64_t n = sizeof(win) - len;
+
+        if (n > pieces[i].length)
+        {
+            n = pieces[i].length;
+        }
+
+        memcpy(win + len, p.input->data + pieces[i].offset, n);
+        len += n;
+    }
+
+    uint64_t replaced = RewriteNal(p.rw, win, len, sizeof(start_code), offset, p.patch);
+    uint64_t skip = 0;
+
+    if (replaced > len)
+    {
+        replaced = len;
+    }
+
+    if (replaced)
+    {
+        OutputBytes(p.out, p.patch.data(), p.patch.size());
+        skip = replaced - sizeof(start_code) - 1;
+    }
+    else
+    {
+        OutputBytes(p.out, win, sizeof(start_code) + 1);
+    }
+
+    for (size_t i = 0; i < num; i++)
+    {
+        uint64_t n = (skip < pieces[i].length) ? skip : pieces[i].length;
+
+        OutputRange(p.out, pieces[i].offset + n, pieces[i].length - n);
+        skip -= n;
+    }
+
+    p.num_nals++;
+}
+
+
+static bool is_pcap_magic(uint32_t magic)
+{
+    return magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC
+        || magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC);
+}
+
+
+static void drop_fu(Pcap_t &p)
+{
+    if (p.in_fu)
+    {
+        printf("FU-A at 0x%llx incomplete, NAL dropped\n", (unsigned long long) p.fu_offset);
+        p.num_dropped++;
+        p.in_fu = false;
+    }
+}
+
+
+/**
+ * Unpack one RTP packet (RFC 6184): a single NAL unit, a STAP-A
+ * aggregate or a FU-A fragment. offset is the position of the packet in
+ * the capture.
+ */
+static void handle_rtp(Pcap_t &p, const uint8_t *rtp, uint32_t len, uint64_t offset)
+{
+    if (len < RTP_HDR_SIZE || (rtp[0] >> 6) != RTP_VERSION)
+    {
+        return;
+    }
+
+    uint32_t hdr_len = RTP_HDR_SIZE + 4 * (rtp[0] & 0x0F);
+    uint32_t pad_len = 0;
+
+    if ((rtp[0] & 0x10) && hdr_len + 4 <= len)
+    {
+        hdr_len += 4 + 4 * rd16(rtp + hdr_len + 2);
+    }
+
+    if (rtp[0] & 0x20)
+    {
+        pad_len = rtp[len - 1];
+    }
+
+    if (hdr_len + pad_len >= len)
+    {
+        return;
+    }
+
+    uint32_t ssrc = rd32(rtp + 8);
+
+    if (p.ssrc < 0)
+    {
+        p.ssrc = ssrc;
+        printf("Following SSRC 0x%08x\n", ssrc);
+    }
+    else if (ssrc != p.ssrc)
+    {
+        return;
+    }
+
+    uint16_t seq = rd16(rtp + 2);
+
+    if (p.have_seq && seq != (uint16_t) (p.seq + 1))
+    {
+        p.num_lost += (uint16_t) (seq - p.seq - 1);
+        drop_fu(p);
+    }
+
+    p.seq       = seq;
+    p.have_seq  = true;
+    p.num_packets++;
+
+    const uint8_t *pl = rtp + hdr_len;
+    uint32_t pl_len = len - hdr_len - pad_len;
+    uint64_t pl_off = offset + hdr_len;
+    uint8_t  type = pl[0] & 0x1F;
+
+    if (type >= 1 && type <= 23)
+    {
+        Segment_t s = { pl_off + 1, pl_len - 1, true };
+
+        drop_fu(p);
+        emit_nal(p, pl[0], &s, 1, pl_off);
+    }
+    else if (type == RTP_NAL_STAP_A)
+    {
+        drop_fu(p);
+
+        for (uint32_t q = 1; q + 2 < pl_len; )
+        {
+            uint32_t size = rd16(pl + q);
+
+            q += 2;
+
+            if (size == 0 || size > pl_len - q)
+            {
+                break;
+            }
+
+            Segment_t s = { pl_off + q + 1, size - 1, true };
+
+            emit_nal(p, pl[q], &s, 1, pl_off + q);
+            q += size;
+        }
+    }
+    else if (type == RTP_NAL_FU_A && pl_len > 2)
+    {
+        uint8_t fu = pl[1];
+
+        if (fu & 0x80)
+        {
+            drop_fu(p);
+
+            p.in_fu     = true;
+            p.fu_hdr    = (pl[0] & 0xE0) | (fu & 0x1F);
+            p.fu_offset = pl_off;
+            p.fu.clear();
+        }
+
+        // a fragment without its start is useless
+        if (!p.in_fu)
+        {
+            return;
+        }
+
+        Segment_t s = { pl_off + 2, pl_len - 2, true };
+
+        p.fu.push_back(s);
+
+        if (fu & 0x40)
+        {
+            emit_nal(p, p.fu_hdr, p.fu.data(), p.fu.size(), p.fu_offset);
+            p.in_fu = false;
+        }
+    }
+    else
+    {
+        p.num_unsupported++;
+    }
+}
+
+
+/**
+ * Strip the link, IP and UDP headers. Returns the UDP payload or NULL.
+ */
+static const uint8_t *udp_payload(Pcap_t &p, const uint8_t *pkt, uint32_t len, uint32_t &pl_len)
+{
+    uint32_t l2;
+    uint16_t proto;
+
+    switch (p.linktype)
+    {
+        case LINKTYPE_ETHERNET:
+        {
+            if (len < 14)
+            {
+                return NULL;
+            }
+
+            l2 = 14;
+            proto = rd16(pkt + 12);
+
+            // 802.1Q tags
+            while ((proto == 0x8100 || proto == 0x88A8) && len >= l2 + 4)
+            {
+                proto = rd16(pkt + l2 + 2);
+                l2 += 4;
+            }
+            break;
+        }
+        case LINKTYPE_LINUX_SLL:
+        {
+            l2 = 16;
+            proto = (len >= l2) ? rd16(pkt + 14) : 0;
+            break;
+        }
+        case LINKTYPE_LINUX_SLL2:
+        {
+            l2 = 20;
+            proto = (len >= l2) ? rd16(pkt) : 0;
+            break;
+        }
+        case LINKTYPE_NULL:
+        {
+            uint32_t family = (len >= 4) ? rd32_pcap(p, pkt) : 0;
+
+            l2 = 4;
+            proto = (family == 2) ? 0x0800 : 0x86DD;
+            break;
+        }
+        case LINKTYPE_RAW:
+        default:
+        {
+            l2 = 0;
+            proto = (len > 0 && (pkt[0] >> 4) == 6) ? 0x86DD : 0x0800;
+            break;
+        }
+    }
+
+    if (len <= l2)
+    {
+        return NULL;
+    }
+
+    const uint8_t *ip = pkt + l2;
+    uint32_t ip_len = len - l2;
+    uint32_t hdr_len;
+
+    if (proto == 0x0800)
+    {
+        if (ip_len < 20 || (ip[0] >> 4) != 4 || ip[9] != 17)
+        {
+            return NULL;
+        }
+
+        // fragmented datagrams are not reassembled
+        if (rd16(ip + 6) & 0x3FFF)
+        {
+            return NULL;
+        }
+
+        hdr_len = 4 * (ip[0] & 0x0F);
+    }
+    else if (proto == 0x86DD)
+    {
+        // no extension headers
+        if (ip_len < 40 || (ip[0] >> 4) != 6 || ip[6] != 17)
+        {
+            return NULL;
+        }
+
+        hdr_len = 40;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    if (ip_len < hdr_len + 8)
+    {
+        return NULL;
+    }
+
+    const uint8_t *udp = ip + hdr_len;
+    uint32_t udp_len = rd16(udp + 4);
+
+    if (p.port && rd16(udp + 2) != p.port)
+    {
+        return NULL;
+    }
+
+    if (udp_len < 8 || udp_len > ip_len - hdr_len)
+    {
+        return NULL;
+    }
+
+    pl_len = udp_len - 8;
+
+    return udp + 8;
+}
+
+
+bool IsPcapFile(const char *path)
+{
+    uint32_t magic;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool ret = (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && is_pcap_magic(magic));
+
+    close(fd);
+
+    return ret;
+}
+
+
+/**
+ * Depacketize an RTP H.264 stream from a pcap capture into a fixed
+ * Annex-B stream.
+ *
+ * The capture is mapped and walked packet by packet; RTP packets of the
+ * given SSRC and/or UDP destination port (the first RTP stream when
+ * neither is given) are unpacked per RFC 6184. Every NAL unit, whether
+ * it came alone, in a STAP-A or in FU-A fragments, goes through the
+ * usual rewrite. Payloads are written as ranges of the capture, so FU-A
+ * fragments are joined on the way out without being copied. A sequence
+ * number gap drops the NAL unit whose fragments it cut.
+ */
+int RunPcap(Input_t &input, int ofd, int64_t ssrc, int port)
+{
+    Pcap_t p;
+
+    if (input.size < PCAP_HDR_SIZE)
+    {
+        printf("Not a pcap file\n");
+        return -1;
+    }
+
+    uint32_t magic;
+
+    memcpy(&magic, input.data, sizeof(magic));
+
+    if (!is_pcap_magic(magic))
+    {
+        printf("Not a pcap file (pcapng is not supported)\n");
+        return -1;
+    }
+
+    p.input         = &input;
+    p.swapped       = (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC);
+    p.linktype      = rd32_pcap(p, input.data + 20) & 0x0FFFFFFF;
+    p.ssrc          = ssrc;
+    p.port          = port;
+    p.have_seq      = false;
+    p.in_fu         = false;
+    p.num_packets   = 0;
+    p.num_nals      = 0;
+    p.num_lost      = 0;
+    p.num_dropped   = 0;
+    p.num_unsupported = 0;
+
+    if (InitRewrite(p.rw) < 0)
+    {
+        return -1;
+    }
+
+    InitOutput(p.out, ofd, input.fd, input.data);
+
+    uint64_t pos = PCAP_HDR_SIZE;
+
+    while (input.size - pos >= PCAP_REC_HDR_SIZE)
+    {
+        uint32_t incl_len = rd32_pcap(p, input.data + pos + 8);
+        uint64_t pkt = pos + PCAP_REC_HDR_SIZE;
+
+        if (incl_len > input.size - pkt)
+        {
+            printf("Capture truncated at 0x%llx\n", (unsigned long long) pos);
+            break;
+        }
+
+        uint32_t len;
+        const uint8_t *udp = udp_payload(p, input.data + pkt, incl_len, len);
+
+        if (udp)
+        {
+            handle_rtp(p, udp, len, udp - input.data);
+        }
+
+        pos = pkt + incl_len;
+
+        // fragments still waiting for their end must stay mapped
+        if (p.out.queued >= PCAP_FLUSH_SIZE)
+        {
+            FlushOutput(p.out);
+            ReleaseInput(input, p.in_fu ? p.fu[0].offset : pos);
+        }
+    }
+
+    drop_fu(p);
+
+    FlushOutput(p.out);
+    CloseOutput(p.out);
+    FreeRewrite(p.rw);
+
+    printf("RTP: %llu packets, %llu NAL units, %llu packets lost, %llu NAL units dropped, %llu packets of unsupported types\n",
+           (unsigned long long) p.num_packets,
+           (unsigned long long) p.num_nals,
+           (unsigned long long) p.num_lost,
+           (unsigned long long) p.num_dropped,
+           (unsigned long long) p.num_unsupported);
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+
+
+#ifndef ___I_AVC_PCAP_H___
+#define ___I_AVC_PCAP_H___
+
+
+#define PCAP_MAGIC              0xA1B2C3D4      // microsecond timestamps
+#define PCAP_MAGIC_NSEC         0xA1B23C4D      // nanosecond timestamps
+#define PCAP_HDR_SIZE           24
+#define PCAP_REC_HDR_SIZE       16
+#define PCAP_VERSION_MAJOR      2
+#define PCAP_VERSION_MINOR      4
+#define PCAP_SNAPLEN            65535
+
+#define LINKTYPE_NULL           0
+#define LINKTYPE_ETHERNET       1
+#define LINKTYPE_RAW            101
+#define LINKTYPE_LINUX_SLL      113
+#define LINKTYPE_LINUX_SLL2     276
+
+#define PCAP_FLUSH_SIZE         (8 << 20)
+
+
+extern bool IsPcapFile(const char *path);
+
+extern int RunPcap(Input_t &input, int ofd, int64_t ssrc, int port);
+
+#endif
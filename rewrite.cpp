@@ -0,0 +1,409 @@
+//
+//  rewrite.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "bits.h"
+#include "nal.h"
+#include "parser.h"
+#include "writer.h"
+#include "rewrite.h"
+
+
+using namespace std;
+
+
+bool rewrite_verbose = false;
+
+
+#define ZEROBYTES_SHORTSTARTCODE    2
+#define SIZE_OF_NAL_UNIT_HDR        1
+
+
+/******************************
+ * local function
+ */
+
+static void put_escaped(vector<uint8_t> &ebsp, uint8_t byte, int &zeros)
+{
+    if (zeros >= ZEROBYTES_SHORTSTARTCODE && byte <= 0x03)
+    {
+        ebsp.push_back(0x03);
+        zeros = 0;
+    }
+
+    ebsp.push_back(byte);
+    zeros = (byte == 0x00) ? zeros + 1 : 0;
+}
+
+
+/**
+ * Escape a regenerated header, then carry on over the untouched bytes at
+ * next until the escaping state matches the original one again, so no
+ * 00 00 0x (x <= 3) is left across the seam and no original escape is
+ * dropped or kept wrongly. zero_run is the number of zero bytes the
+ * original header ended with. Returns how many bytes at next went into
+ * ebsp.
+ */
+static uint64_t escape_header(vector<uint8_t> &ebsp, vector<uint8_t> &rbsp, const uint8_t *next, const uint8_t *end, uint32_t zero_run)
+{
+    const uint8_t *p = next;
+    int zeros = 0;
+    int orig  = (zero_run < ZEROBYTES_SHORTSTARTCODE) ? zero_run : ZEROBYTES_SHORTSTARTCODE;
+
+    for (size_t i = 0; i < rbsp.size(); i++)
+    {
+        put_escaped(ebsp, rbsp[i], zeros);
+    }
+
+    // any non zero byte brings both back to the same state
+    while (p < end && ((zeros < ZEROBYTES_SHORTSTARTCODE) ? zeros : ZEROBYTES_SHORTSTARTCODE) != orig)
+    {
+        uint8_t byte = *p++;
+
+        if (orig >= ZEROBYTES_SHORTSTARTCODE && byte == 0x03)
+        {
+            orig = 0;
+            continue;
+        }
+
+        put_escaped(ebsp, byte, zeros);
+        orig = (byte == 0x00) ? ((orig < ZEROBYTES_SHORTSTARTCODE) ? orig + 1 : orig) : 0;
+    }
+
+    return p - next;
+}
+
+
+/*!
+************************************************************************
+*  \brief
+*     This function add emulation_prevention_three_byte for all occurrences
+*     of the following byte sequences in the stream
+*       0x000000  -> 0x00000300
+*       0x000001  -> 0x00000301
+*       0x000002  -> 0x00000302
+*       0x000003  -> 0x00000303
+*
+*  \param NaluBuffer
+*            pointer to target buffer
+*  \param rbsp
+*            pointer to source buffer
+*  \param rbsp_size
+*           Size of source
+*  \return
+*           Size target buffer after emulation prevention.
+*
+************************************************************************
+*/
+int RBSPtoEBSP(vector<uint8_t> &ebsp, vector<uint8_t> &rbsp)
+{
+    int zero_cnt    = 0;
+
+    for (size_t i = 0; i < rbsp.size(); i++)
+    {
+        if (zero_cnt == ZEROBYTES_SHORTSTARTCODE && !(rbsp[i] & 0xFC))
+        {
+            ebsp.push_back(0x03);
+            zero_cnt = 0;
+        }
+        ebsp.push_back(rbsp[i]);
+
+        if (rbsp[i] == 0x00) { zero_cnt++; }
+        else { zero_cnt = 0; }
+    }
+
+    return ebsp.size();
+}
+
+
+/**
+ * Parse one NAL unit and regenerate its header for fix_frame_num.
+ *
+ * nal points at the start code, avail is the number of bytes readable from
+ * there. The header is parsed straight from those bytes, unescaping only
+ * what is read; a header that runs past avail is left untouched. On return
+ * patch holds the bytes that take the place of the first N bytes of the
+ * NAL, N being the return value; both are zero/empty when the NAL is left
+ * untouched. The two lengths differ when the regenerated slice header
+ * does not fill the same number of bytes.
+ */
+uint64_t RewriteNal
+(
+    Rewrite_t &rw,
+    uint8_t *ptr,
+    uint64_t avail,
+    uint32_t prefix_len,
+    uint64_t offset,
+    vector<uint8_t> &patch
+)
+{
+    uint8_t     nal_unit_header[SIZE_OF_NAL_UNIT_HDR];
+    bool        forbidden_zero_bit;
+    uint8_t     nal_ref_idc;
+    NaluType    nal_unit_type;
+    uint64_t    replaced = 0;
+
+    patch.clear();
+
+    nal_unit_header[0]      = ptr[prefix_len];
+    nal_unit_type           = (NaluType) ((nal_unit_header[0] & (BIT4 | BIT3 | BIT2 | BIT1 | BIT0)));
+    nal_ref_idc             = ((nal_unit_header[0] & (BIT5 | BIT6)) >> 5);
+    forbidden_zero_bit      = (nal_unit_header[0] & BIT7) >> 7;
+
+    if (forbidden_zero_bit)
+    {
+        return 0;
+    }
+
+    if (rewrite_verbose)
+    {
+        printf("nal=0x%02x forbidden_zero_bit=%d, nal_unit_type=%02u, nal_ref_idc=%u, offset=0x%llx\n",
+               nal_unit_header[0],
+               forbidden_zero_bit,
+               nal_unit_type,
+               nal_ref_idc,
+               (unsigned long long) offset);
+    }
+
+    if (avail <= prefix_len + SIZE_OF_NAL_UNIT_HDR)
+    {
+        return 0;
+    }
+
+    const uint8_t *body = ptr + prefix_len + SIZE_OF_NAL_UNIT_HDR;
+    const uint8_t *end  = ptr + avail;
+
+    // parameter sets are short, bound them so more_rbsp_data() sees where they end
+    if (nal_unit_type == NALU_TYPE_SPS || nal_unit_type == NALU_TYPE_PPS)
+    {
+        end = FindStartCode(body, end);
+
+        while (end > body && end[-1] == 0x00)
+        {
+            end--;
+        }
+    }
+
+    InputBitstream_t ibs;
+
+    InitInputBitstream(ibs, body, (end - body < 0xFFFFFFFF) ? end - body : 0xFFFFFFFF);
+
+    switch (nal_unit_type)
+    {
+        case NALU_TYPE_SPS:
+        {
+            if (rewrite_verbose)
+            {
+                printf("Find SPS, parse!\n");
+            }
+
+            ParseSPS(ibs, rw.ps->SPSs, rw.tAvcInfo);
+            {
+                OutputBitstream_t obs;
+
+                obs.m_num_held_bits = 0;
+                obs.m_held_bits     = 0;
+
+                if (ibs.m_fifo_idx > ibs.m_fifo_size)
+                {
+                    printf("SPS at 0x%llx runs past the %llu bytes available, left unchanged\n",
+                           (unsigned long long) offset, (unsigned long long) avail);
+                }
+                else if (rw.ps->SPSs[0].isValid) // assume sps id is 0
+                {
+                    rw.ps->SPSs[0].log2_max_frame_num_minus4 = 11; // do customer request, generate SPS log2_max_frame_num = 15
+
+                    if (rewrite_verbose)
+                    {
+                        printf("Generating SPS!\n");
+                    }
+                    GenerateSPS(obs, rw.ps->SPSs[0]);
+
+                    rw.ps->SPSs[0].log2_max_frame_num_minus4 = 12; // adjust back because we use 12 to parse slice
+
+                    // slices of an SPS left as it is must not be rewritten either
+                    if (obs.m_fifo.size() != ibs.m_fifo_idx - ibs.m_num_escapes)
+                    {
+                        printf("Generated SPS len is different! %ld:%d, SPS at 0x%llx and its slices left unchanged\n",
+                               obs.m_fifo.size(), ibs.m_fifo_idx - ibs.m_num_escapes, (unsigned long long) offset);
+                        rw.ps->SPSs[0].isValid = false;
+                        break;
+                    }
+
+                    vector<uint8_t> ebsp;
+                    
+                    RBSPtoEBSP(ebsp, obs.m_fifo);
+
+                    ebsp.insert(ebsp.begin(), ptr, ptr+prefix_len+1);
+                    patch = ebsp;
+                    replaced = prefix_len + SIZE_OF_NAL_UNIT_HDR + ibs.m_fifo_idx;
+                }
+            }
+            break;
+        }
+        case NALU_TYPE_PPS:
+        {
+            ParsePPS(ibs, rw.ps->PPSs, rw.ps->SPSs);
+
+            break;
+        }
+        case NALU_TYPE_AUD:
+        {
+            //ParseAUD(ibs);
+
+            break;
+        }
+        case NALU_TYPE_IDR:
+        case NALU_TYPE_SLICE:
+        {
+            bool IdrPicFlag = ( ( nal_unit_type == 5 ) ? 1 : 0 );
+            int ret = ParseSlice(ibs, rw.slice, rw.ps->SPSs, rw.ps->PPSs, IdrPicFlag, nal_ref_idc, rw.message);
+
+            if (ret < 0)
+            {
+            }
+            else if (!rw.ps->SPSs[rw.ps->PPSs[rw.slice.pic_parameter_set_id].seq_parameter_set_id].isValid)
+            {
+            }
+            else if (ibs.m_fifo_idx > ibs.m_fifo_size)
+            {
+                printf("Slice header at 0x%llx runs past the %llu bytes available, left unchanged\n",
+                       (unsigned long long) offset, (unsigned long long) avail);
+            }
+            else
+            {
+                PPS_t &x_pps = rw.ps->PPSs[rw.slice.pic_parameter_set_id];
+                SPS_t x_sps = rw.ps->SPSs[x_pps.seq_parameter_set_id];
+                x_sps.log2_max_frame_num_minus4 = 11;
+
+                if (rw.adjust)
+                {
+                    rw.adjust(rw, nal_unit_header[0], rw.adjust_arg);
+
+                    IdrPicFlag  = ((nal_unit_header[0] & 0x1F) == NALU_TYPE_IDR);
+                    nal_ref_idc = (nal_unit_header[0] >> 5) & 0x03;
+                }
+
+                rw.slice.frame_num %= (1 << 15);
+            
+                OutputBitstream_t obs;
+
+                obs.m_num_held_bits = 0;
+                obs.m_held_bits     = 0;
+
+                GenerateSlice(obs, rw.slice, x_sps, x_pps, IdrPicFlag, nal_ref_idc);
+
+                if (obs.m_fifo.size() != ibs.m_fifo_idx - ibs.m_num_escapes)
+                {
+                    printf("Generated slice len is different! %ld:%d\n", obs.m_fifo.size(), ibs.m_fifo_idx - ibs.m_num_escapes);
+                }
+
+                vector<uint8_t> ebsp;
+
+                uint64_t seam = escape_header(ebsp, obs.m_fifo, body + ibs.m_fifo_idx, end, ibs.m_zero_run);
+
+                // [prefix + NAL header + slice header] replaces the original one, whatever its length
+                ebsp.insert(ebsp.begin(), ptr, ptr+prefix_len);
+                ebsp.insert(ebsp.begin() + prefix_len, nal_unit_header[0]);
+                patch = ebsp;
+                replaced = prefix_len + SIZE_OF_NAL_UNIT_HDR + ibs.m_fifo_idx + seam;
+            }
+            
+            break;
+        }
+        case NALU_TYPE_SEI:
+        {
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    return replaced;
+}
+
+
+/**
+ * Frame duration in clock_rate ticks from the VUI timing of the SPS the
+ * last slice refers to. duration is kept when that SPS has no timing.
+ */
+void UpdateFrameDuration(Rewrite_t &rw, uint32_t clock_rate, uint32_t &duration)
+{
+    PPS_t &pps = rw.ps->PPSs[rw.slice.pic_parameter_set_id & 0x7F];
+    SPS_t &sps = rw.ps->SPSs[pps.seq_parameter_set_id & 0x1F];
+    VUI_t &vui = sps.vui_seq_parameters;
+
+    if (pps.isValid && sps.isValid && sps.vui_parameters_present_flag && vui.timing_info_present_flag
+     && vui.time_scale && vui.num_units_in_tick)
+    {
+        duration = (uint64_t) clock_rate * 2 * vui.num_units_in_tick / vui.time_scale;
+    }
+}
+
+
+/**
+ * Set up the parser state of one stream. The parameter set tables are
+ * an anonymous mapping: only the pages of the ids a stream actually uses
+ * are ever touched, so idle tables cost address space, not memory.
+ */
+int InitRewrite(Rewrite_t &rw)
+{
+    void *addr = mmap(NULL, sizeof(ParamSets_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap");
+        rw.ps = NULL;
+        return -1;
+    }
+
+    rw.ps = (ParamSets_t *) addr;
+    rw.message.clear();
+
+    rw.adjust       = NULL;
+    rw.adjust_arg   = NULL;
+
+    return 0;
+}
+
+
+/**
+ * Forget the parameter sets seen so far, before starting on an unrelated
+ * stream with the same state. Dropped pages read back as zero.
+ */
+void ResetRewrite(Rewrite_t &rw)
+{
+    madvise(rw.ps, sizeof(ParamSets_t), MADV_DONTNEED);
+}
+
+
+void FreeRewrite(Rewrite_t &rw)
+{
+    if (rw.ps)
+    {
+        munmap(rw.ps, sizeof(ParamSets_t));
+        rw.ps = NULL;
+    }
+}
@@ -0,0 +1,60 @@
+
+
+#ifndef ___I_AVC_REWRITE_H___
+#define ___I_AVC_REWRITE_H___
+
+
+// streaming paths hand RewriteNal this much of a NAL before it is complete,
+// a header longer than what it is given is left untouched
+#define NAL_HDR_MAX_SIZE            100
+#define NAL_HDR_WINDOW_SIZE         (NAL_HDR_MAX_SIZE + 4)     // bytes from the start code
+
+
+typedef struct
+{
+    SPS_t SPSs[32];
+    PPS_t PPSs[128];
+} ParamSets_t;
+
+
+/*
+ * Parser state of one stream, so a process can follow many streams.
+ */
+typedef struct Rewrite_t
+{
+    ParamSets_t *ps;
+    AvcInfo_t    tAvcInfo;
+    Slice_t      slice;             // last slice header, valid while RewriteNal returns non-zero
+    std::string  message;
+
+    // called between ParseSlice and GenerateSlice, may renumber slice and change the NAL header byte
+    void (*adjust)(struct Rewrite_t &rw, uint8_t &nal_header, void *arg);
+    void        *adjust_arg;
+} Rewrite_t;
+
+
+extern bool rewrite_verbose;         // RewriteNal prints a line per NAL
+
+
+extern int RBSPtoEBSP(std::vector<uint8_t> &ebsp, std::vector<uint8_t> &rbsp);
+
+extern int InitRewrite(Rewrite_t &rw);
+
+extern void ResetRewrite(Rewrite_t &rw);
+
+extern void FreeRewrite(Rewrite_t &rw);
+
+extern void UpdateFrameDuration(Rewrite_t &rw, uint32_t clock_rate, uint32_t &duration);
+
+extern uint64_t RewriteNal
+(
+    Rewrite_t &rw,
+    uint8_t *ptr,
+    uint64_t avail,
+    uint32_t prefix_len,
+    uint64_t offset,
+    std::vector<uint8_t> &patch
+);
+
+#endif
+
@@ -0,0 +1,475 @@
+//
+//  rtp.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "input.h"
+#include "nal.h"
+#include "output.h"
+#include "pcap.h"
+#include "rewrite.h"
+#include "rtp.h"
+
+
+using namespace std;
+
+
+/*
+ * A NAL unit of the access unit being collected: the regenerated header
+ * bytes, NAL header byte first, followed by the unchanged rest in the
+ * input.
+ */
+typedef struct
+{
+    uint32_t head;              // offset into heads
+    uint32_t head_len;
+    uint64_t offset;
+    uint64_t length;
+} Nal_t;
+
+
+typedef struct
+{
+    Input_t  *input;
+    Output_t  out;
+    Rewrite_t rw;
+
+    RtpFormat_t format;
+    uint32_t payload_size;      // largest RTP payload that fits the MTU
+    uint32_t ssrc;
+    uint16_t port;
+    uint16_t seq;
+    uint32_t timestamp;
+    uint32_t duration;
+    uint64_t time;              // 90 kHz ticks since the first access unit, for pcap record times
+
+    vector<Nal_t>   nals;
+    vector<uint8_t> heads;
+    bool     au_vcl;
+
+    uint64_t num_aus;
+    uint64_t num_packets;
+    uint64_t num_single;
+    uint64_t num_stap;
+    uint64_t num_fu;
+} Rtp_t;
+
+
+static const uint8_t src_mac[6]  = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static const uint8_t dst_mac[6]  = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+static const uint8_t src_addr[4] = { 10, 0, 0, 1 };
+static const uint8_t dst_addr[4] = { 10, 0, 0, 2 };
+
+
+/******************************
+ * local function
+ */
+
+static uint8_t *wr16(uint8_t *p, uint32_t x)
+{
+    p[0] = x >> 8;
+    p[1] = x;
+
+    return p + 2;
+}
+
+
+static uint8_t *wr32(uint8_t *p, uint32_t x)
+{
+    return wr16(wr16(p, x >> 16), x);
+}
+
+
+static uint8_t *wr32le(uint8_t *p, uint32_t x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+
+    return p + 4;
+}
+
+
+static uint16_t ip_checksum(const uint8_t *p, size_t len)
+{
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < len; i += 2)
+    {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return ~sum;
+}
+
+
+static uint64_t nal_size(const Nal_t &n)
+{
+    return n.head_len + n.length;
+}
+
+
+static uint8_t nal_byte(Rtp_t &r, const Nal_t &n, uint64_t i)
+{
+    return (i < n.head_len) ? r.heads[n.head + i] : r.input->data[n.offset + i - n.head_len];
+}
+
+
+/**
+ * Queue bytes [from, from + len) of a NAL unit: regenerated bytes go
+ * through the pool, the rest stays a range of the input.
+ */
+static void put_nal(Rtp_t &r, const Nal_t &n, uint64_t from, uint64_t len)
+{
+    if (from < n.head_len)
+    {
+        uint64_t k = (len < n.head_len - from) ? len : n.head_len - from;
+
+        OutputBytes(r.out, &r.heads[n.head + from], k);
+        from += k;
+        len  -= k;
+    }
+
+    if (len > 0)
+    {
+        OutputRange(r.out, n.offset + from - n.head_len, len);
+    }
+}
+
+
+/**
+ * Queue everything in front of an RTP payload of payload_len bytes: the
+ * pcap record, Ethernet, IPv4 and UDP headers or the length prefix, then
+ * the RTP header.
+ */
+static void begin_packet(Rtp_t &r, uint32_t payload_len, bool marker)
+{
+    uint8_t  hdr[PCAP_REC_HDR_SIZE + RTP_ETH_HDR_SIZE + RTP_IPV4_HDR_SIZE + RTP_UDP_HDR_SIZE + RTP_HDR_SIZE];
+    uint8_t *p = hdr;
+    uint32_t rtp_len = RTP_HDR_SIZE + payload_len;
+
+    if (r.format == RTP_OUT_PCAP)
+    {
+        uint32_t udp_len = RTP_UDP_HDR_SIZE + rtp_len;
+        uint32_t ip_len  = RTP_IPV4_HDR_SIZE + udp_len;
+        uint32_t frame_len = RTP_ETH_HDR_SIZE + ip_len;
+
+        p = wr32le(p, r.time / RTP_CLOCK_RATE);
+        p = wr32le(p, (r.time % RTP_CLOCK_RATE) * 100 / 9);         // microseconds
+        p = wr32le(p, frame_len);
+        p = wr32le(p, frame_len);
+
+        memcpy(p, dst_mac, 6);
+        memcpy(p + 6, src_mac, 6);
+        p = wr16(p + 12, 0x0800);
+
+        uint8_t *ip = p;
+
+        *p++ = 0x45;
+        *p++ = 0x00;
+        p = wr16(p, ip_len);
+        p = wr16(p, r.seq);                     // identification
+        p = wr16(p, 0x4000);                    // don't fragment
+        *p++ = 64;                              // TTL
+        *p++ = 17;                              // UDP
+        p = wr16(p, 0);
+        memcpy(p, src_addr, 4);
+        memcpy(p + 4, dst_addr, 4);
+        p += 8;
+        wr16(ip + 10, ip_checksum(ip, RTP_IPV4_HDR_SIZE));
+
+        p = wr16(p, r.port);
+        p = wr16(p, r.port);
+        p = wr16(p, udp_len);
+        p = wr16(p, 0);                         // no checksum
+    }
+    else
+    {
+        p = wr16(p, rtp_len);
+    }
+
+    *p++ = RTP_VERSION << 6;
+    *p++ = (marker ? 0x80 : 0x00) | RTP_PAYLOAD_TYPE;
+    p = wr16(p, r.seq);
+    p = wr32(p, r.timestamp);
+    p = wr32(p, r.ssrc);
+
+    OutputBytes(r.out, hdr, p - hdr);
+
+    r.seq++;
+    r.num_packets++;
+}
+
+
+/**
+ * Packetize the collected access unit (RFC 6184 non-interleaved mode).
+ * Runs of NAL units that fit one packet together go into a STAP-A, a NAL
+ * unit that fits alone into a single NAL unit packet, anything larger is
+ * cut into FU-A fragments. The marker bit is set on the last packet.
+ */
+static void flush_au(Rtp_t &r)
+{
+    size_t num = r.nals.size();
+    size_t i = 0;
+
+    while (i < num)
+    {
+        uint64_t stap_len = 1;
+        size_t j = i;
+
+        while (j < num && stap_len + 2 + nal_size(r.nals[j]) <= r.payload_size)
+        {
+            stap_len += 2 + nal_size(r.nals[j]);
+            j++;
+        }
+
+        if (j - i >= 2)
+        {
+            uint8_t f = 0;
+            uint8_t nri = 0;
+
+            for (size_t k = i; k < j; k++)
+            {
+                uint8_t hdr = nal_byte(r, r.nals[k], 0);
+
+                f   |= hdr & 0x80;
+                nri  = ((hdr & 0x60) > nri) ? (hdr & 0x60) : nri;
+            }
+
+            uint8_t stap = f | nri | RTP_NAL_STAP_A;
+
+            begin_packet(r, stap_len, j == num);
+            OutputBytes(r.out, &stap, 1);
+
+            for (size_t k = i; k < j; k++)
+            {
+                uint8_t size[2];
+
+                wr16(size, nal_size(r.nals[k]));
+                OutputBytes(r.out, size, sizeof(size));
+                put_nal(r, r.nals[k], 0, nal_size(r.nals[k]));
+            }
+
+            r.num_stap++;
+            i = j;
+            continue;
+        }
+
+        Nal_t &n = r.nals[i];
+        uint64_t size = nal_size(n);
+        bool last = (i + 1 == num);
+
+        if (size <= r.payload_size)
+        {
+            begin_packet(r, size, last);
+            put_nal(r, n, 0, size);
+
+            r.num_single++;
+        }
+        else
+        {
+            // the NAL header byte is not sent, its fields go into the FU indicator and header
+            uint8_t hdr = nal_byte(r, n, 0);
+
+            for (uint64_t pos = 1; pos < size; )
+            {
+                uint64_t len = size - pos;
+
+                if (len > r.payload_size - 2)
+                {
+                    len = r.payload_size - 2;
+                }
+
+                bool end = (pos + len == size);
+                uint8_t fu[2] =
+                {
+                    (uint8_t) ((hdr & 0xE0) | RTP_NAL_FU_A),
+                    (uint8_t) ((pos == 1 ? 0x80 : 0x00) | (end ? 0x40 : 0x00) | (hdr & 0x1F))
+                };
+
+                begin_packet(r, sizeof(fu) + len, last && end);
+                OutputBytes(r.out, fu, sizeof(fu));
+                put_nal(r, n, pos, len);
+
+                pos += len;
+                r.num_fu++;
+            }
+        }
+
+        i++;
+    }
+
+    if (num > 0)
+    {
+        r.timestamp += r.duration;
+        r.time      += r.duration;
+        r.num_aus++;
+    }
+
+    r.nals.clear();
+    r.heads.clear();
+    r.au_vcl = false;
+}
+
+
+static void write_pcap_header(Rtp_t &r)
+{
+    uint8_t  hdr[PCAP_HDR_SIZE];
+    uint8_t *p = hdr;
+
+    p = wr32le(p, PCAP_MAGIC);
+    p = wr32le(p, PCAP_VERSION_MAJOR | (PCAP_VERSION_MINOR << 16));
+    p = wr32le(p, 0);                           // thiszone
+    p = wr32le(p, 0);                           // sigfigs
+    p = wr32le(p, PCAP_SNAPLEN);
+    p = wr32le(p, LINKTYPE_ETHERNET);
+
+    OutputBytes(r.out, hdr, sizeof(hdr));
+}
+
+
+/**
+ * Fix an Annex-B stream and send it out as RTP (RFC 6184), written to a
+ * pcap file for replay tools or as a raw packet file where each RTP
+ * packet has a 2 byte length in front (RFC 4571).
+ *
+ * NAL units are collected an access unit at a time and packetized for
+ * the MTU: small ones share a STAP-A, large ones are cut into FU-A
+ * fragments. Payload bytes are never copied; packets are gather lists of
+ * their headers and ranges of the input. The timestamp advances by one
+ * frame per access unit, from the VUI timing of the active SPS
+ * (time_scale / num_units_in_tick, 30 fps without it); pcap record times
+ * follow it, so the capture can be replayed at the right rate.
+ */
+int RunRtp(Input_t &input, int ofd, RtpFormat_t format, uint32_t mtu, int64_t ssrc, int port)
+{
+    Rtp_t r;
+
+    srand(time(NULL) ^ getpid());
+
+    r.input         = &input;
+    r.format        = format;
+    r.payload_size  = mtu - RTP_IPV4_HDR_SIZE - RTP_UDP_HDR_SIZE - RTP_HDR_SIZE;
+    r.ssrc          = (ssrc >= 0) ? ssrc : ((uint32_t) rand() << 16) ^ rand();
+    r.port          = port ? port : RTP_DEFAULT_PORT;
+    r.seq           = rand();
+    r.timestamp     = ((uint32_t) rand() << 16) ^ rand();
+    r.duration      = RTP_DEFAULT_DURATION;
+    r.time          = 0;
+    r.au_vcl        = false;
+    r.num_aus       = 0;
+    r.num_packets   = 0;
+    r.num_single    = 0;
+    r.num_stap      = 0;
+    r.num_fu        = 0;
+
+    if (InitRewrite(r.rw) < 0)
+    {
+        return -1;
+    }
+
+    InitOutput(r.out, ofd, input.fd, input.data);
+
+    if (format == RTP_OUT_PCAP)
+    {
+        write_pcap_header(r);
+    }
+
+    const uint8_t *data = input.data;
+    vector<uint8_t> patch;
+    NalIter_t it;
+    NalUnit_t unit;
+
+    InitNalIter(it, data, input.size, 0);
+
+    while (NextNal(it, unit))
+    {
+        uint64_t start      = unit.offset;
+        uint32_t prefix_len = unit.prefix_len;
+        uint64_t nal_end    = start + unit.size;
+
+        if (unit.size <= prefix_len)
+        {
+            continue;
+        }
+
+        uint8_t  nal_unit_type  = unit.nal_unit_type;
+        bool     is_slice       = (nal_unit_type == NALU_TYPE_SLICE || nal_unit_type == NALU_TYPE_IDR);
+        uint64_t nal_len        = nal_end - start;
+        uint64_t replaced       = RewriteNal(r.rw, (uint8_t *) data + start, nal_len, prefix_len, start, patch);
+
+        bool new_au = StartsAccessUnit(nal_unit_type, replaced && r.rw.slice.first_mb_in_slice == 0);
+
+        if (r.au_vcl && new_au)
+        {
+            flush_au(r);
+
+            if (r.out.queued >= RTP_FLUSH_SIZE)
+            {
+                FlushOutput(r.out);
+                ReleaseInput(input, start);
+            }
+        }
+
+        if (is_slice && !r.au_vcl)
+        {
+            if (replaced)
+            {
+                UpdateFrameDuration(r.rw, RTP_CLOCK_RATE, r.duration);
+            }
+
+            r.au_vcl = true;
+        }
+
+        uint64_t body = replaced ? replaced : prefix_len;
+        Nal_t n;
+
+        n.head      = r.heads.size();
+        n.head_len  = replaced ? patch.size() - prefix_len : 0;
+        n.offset    = start + body;
+        n.length    = nal_end - start - body;
+
+        r.heads.insert(r.heads.end(), patch.begin() + (replaced ? prefix_len : patch.size()), patch.end());
+        r.nals.push_back(n);
+    }
+
+    flush_au(r);
+
+    FlushOutput(r.out);
+    CloseOutput(r.out);
+    FreeRewrite(r.rw);
+
+    printf("RTP: %llu access units, %llu packets (%llu single, %llu STAP-A, %llu FU-A), SSRC 0x%08x, %u/%u ticks per frame\n",
+           (unsigned long long) r.num_aus,
+           (unsigned long long) r.num_packets,
+           (unsigned long long) r.num_single,
+           (unsigned long long) r.num_stap,
+           (unsigned long long) r.num_fu,
+           r.ssrc, r.duration, RTP_CLOCK_RATE);
+
+    return 0;
+}
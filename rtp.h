@@ -0,0 +1,35 @@
+
+
+#ifndef ___I_AVC_RTP_H___
+#define ___I_AVC_RTP_H___
+
+
+#define RTP_HDR_SIZE            12
+#define RTP_VERSION             2
+#define RTP_PAYLOAD_TYPE        96          // dynamic
+#define RTP_CLOCK_RATE          90000
+#define RTP_DEFAULT_DURATION    3000        // 30 fps when the SPS has no timing info
+#define RTP_DEFAULT_MTU         1500
+#define RTP_MIN_MTU             128
+#define RTP_DEFAULT_PORT        5004
+
+#define RTP_NAL_STAP_A          24
+#define RTP_NAL_FU_A            28
+
+#define RTP_IPV4_HDR_SIZE       20
+#define RTP_UDP_HDR_SIZE        8
+#define RTP_ETH_HDR_SIZE        14
+#define RTP_MAX_MTU             (PCAP_SNAPLEN - RTP_ETH_HDR_SIZE)     // a frame still fits one pcap record
+#define RTP_FLUSH_SIZE          (8 << 20)
+
+
+typedef enum
+{
+    RTP_OUT_PCAP,               // Ethernet/IPv4/UDP packets in a pcap file
+    RTP_OUT_RAW                 // RTP packets with a 2 byte length each (RFC 4571 framing)
+} RtpFormat_t;
+
+
+extern int RunRtp(Input_t &input, int ofd, RtpFormat_t format, uint32_t mtu, int64_t ssrc, int port);
+
+#endif
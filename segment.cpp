@@ -0,0 +1,516 @@
+//
+//  segment.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "input.h"
+#include "nal.h"
+#include "output.h"
+#include "rewrite.h"
+#include "segment.h"
+
+
+using namespace std;
+
+
+/*
+ * One output file: its gather list is complete before a worker picks it
+ * up, the worker only supplies the fd.
+ */
+typedef struct
+{
+    uint32_t index;
+    uint64_t ticks;
+    uint32_t frames;
+    Output_t out;
+} Chunk_t;
+
+
+typedef struct
+{
+    Input_t    *input;
+    const char *pattern;
+    Rewrite_t   rw;
+
+    vector< vector<uint8_t> > sps;      // last set of each id as rewritten, with a 4 byte start code
+    vector< vector<uint8_t> > pps;
+
+    // the access unit being collected, cut points fall between access units
+    Output_t au;
+    bool     au_vcl;
+    bool     au_idr;
+    bool     au_sps;
+    bool     au_pps;
+
+    uint64_t target;                    // segment duration in 90 kHz ticks
+    uint32_t duration;                  // ticks per frame
+    Chunk_t *chunk;
+    uint32_t num_chunks;
+    uint64_t max_ticks;
+    uint64_t min_ticks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    deque<Chunk_t *> queue;
+    size_t   queue_depth;
+    bool     done;
+} Segmenter_t;
+
+
+static const uint8_t start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+
+/******************************
+ * local function
+ */
+
+static void *worker(void *arg)
+{
+    Segmenter_t *s = (Segmenter_t *) arg;
+    char path[PATH_MAX];
+
+    for (;;)
+    {
+        pthread_mutex_lock(&s->lock);
+
+        while (s->queue.empty() && !s->done)
+        {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+
+        if (s->queue.empty())
+        {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+
+        Chunk_t *c = s->queue.front();
+
+        s->queue.pop_front();
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+
+        snprintf(path, sizeof(path), s->pattern, c->index);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd < 0)
+        {
+            perror(path);
+            exit(-1);
+        }
+
+        // input ranges go out with copy_file_range, at offsets of their own
+        c->out.ofd = fd;
+        FlushOutput(c->out);
+        CloseOutput(c->out);
+        close(fd);
+
+        delete c;
+    }
+
+    return NULL;
+}
+
+
+static Chunk_t *new_chunk(Segmenter_t &s)
+{
+    Chunk_t *c = new Chunk_t;
+
+    c->index    = s.num_chunks++;
+    c->ticks    = 0;
+    c->frames   = 0;
+
+    InitOutput(c->out, -1, s.input->fd, s.input->data);
+
+    return c;
+}
+
+
+/**
+ * Queue a complete chunk for the workers, waiting while they are behind.
+ */
+static void submit(Segmenter_t &s, Chunk_t *c)
+{
+    if (c->ticks > s.max_ticks)
+    {
+        s.max_ticks = c->ticks;
+    }
+
+    if (c->ticks < s.min_ticks)
+    {
+        s.min_ticks = c->ticks;
+    }
+
+    pthread_mutex_lock(&s.lock);
+
+    while (s.queue.size() >= s.queue_depth)
+    {
+        pthread_cond_wait(&s.cond, &s.lock);
+    }
+
+    s.queue.push_back(c);
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+}
+
+
+static void append(Output_t &dst, const Output_t &src)
+{
+    for (size_t i = 0; i < src.segments.size(); i++)
+    {
+        const Segment_t &seg = src.segments[i];
+
+        if (seg.isInput)
+        {
+            OutputRange(dst, seg.offset, seg.length);
+        }
+        else
+        {
+            OutputBytes(dst, &src.pool[seg.offset], seg.length);
+        }
+    }
+}
+
+
+static void put_sets(Output_t &out, vector< vector<uint8_t> > &sets)
+{
+    for (size_t i = 0; i < sets.size(); i++)
+    {
+        OutputBytes(out, sets[i].data(), sets[i].size());
+    }
+}
+
+
+/**
+ * Move the collected access unit into the current chunk. An IDR access
+ * unit starts a new chunk once the current one is long enough; the
+ * parameter sets go in front of it unless it carries its own.
+ */
+static void end_au(Segmenter_t &s)
+{
+    if (s.au.queued == 0)
+    {
+        return;
+    }
+
+    if (s.au_idr && s.chunk->ticks >= s.target)
+    {
+        submit(s, s.chunk);
+        s.chunk = new_chunk(s);
+
+        if (!(s.au_sps && s.au_pps))
+        {
+            put_sets(s.chunk->out, s.sps);
+            put_sets(s.chunk->out, s.pps);
+        }
+    }
+
+    append(s.chunk->out, s.au);
+
+    if (s.au_vcl)
+    {
+        s.chunk->ticks += s.duration;
+        s.chunk->frames++;
+    }
+
+    s.au.segments.clear();
+    s.au.pool.clear();
+    s.au.queued = 0;
+
+    s.au_vcl = false;
+    s.au_idr = false;
+    s.au_sps = false;
+    s.au_pps = false;
+}
+
+
+/**
+ * ue(v) at bit pos of an RBSP, good enough for the ids at the start of a
+ * parameter set.
+ */
+static uint32_t read_ue(const uint8_t *p, size_t len, size_t &pos)
+{
+    int zeros = 0;
+
+    while (pos < len * 8 && !((p[pos >> 3] >> (7 - (pos & 7))) & 1) && zeros < 31)
+    {
+        zeros++;
+        pos++;
+    }
+
+    pos++;
+
+    uint32_t v = 0;
+
+    for (int i = 0; i < zeros && pos < len * 8; i++, pos++)
+    {
+        v = (v << 1) | ((p[pos >> 3] >> (7 - (pos & 7))) & 1);
+    }
+
+    return (1u << zeros) - 1 + v;
+}
+
+
+/**
+ * Remember a parameter set for the chunks to come, replacing the one
+ * with the same id.
+ */
+static void note_set(Segmenter_t &s, uint8_t nal_unit_type, vector<uint8_t> &nal)
+{
+    const uint8_t *rbsp = nal.data() + sizeof(start_code) + 1;
+    size_t len = nal.size() - sizeof(start_code) - 1;
+    size_t pos = 0;
+    uint32_t id;
+
+    if (nal_unit_type == NALU_TYPE_SPS)
+    {
+        // profile_idc, constraint flags and level_idc come first
+        pos = 24;
+        id  = read_ue(rbsp, len, pos);
+        s.au_sps = true;
+    }
+    else
+    {
+        id  = read_ue(rbsp, len, pos);
+        s.au_pps = true;
+    }
+
+    vector< vector<uint8_t> > &sets = (nal_unit_type == NALU_TYPE_SPS) ? s.sps : s.pps;
+
+    for (size_t i = 0; i < sets.size(); i++)
+    {
+        size_t pos_i = (nal_unit_type == NALU_TYPE_SPS) ? 24 : 0;
+
+        if (read_ue(sets[i].data() + sizeof(start_code) + 1, sets[i].size() - sizeof(start_code) - 1, pos_i) == id)
+        {
+            sets[i] = nal;
+            return;
+        }
+    }
+
+    sets.push_back(nal);
+}
+
+
+/**
+ * Check pattern is safe to hand to snprintf() with a chunk number: exactly
+ * one %u, %d or %0Nu style conversion, nothing else but %% escapes.
+ */
+bool IsSegmentPattern(const char *pattern)
+{
+    int num_conv = 0;
+
+    for (const char *p = pattern; *p; p++)
+    {
+        if (*p != '%')
+        {
+            continue;
+        }
+
+        p++;
+
+        if (*p == '%')
+        {
+            continue;
+        }
+
+        while (*p >= '0' && *p <= '9')
+        {
+            p++;
+        }
+
+        if (*p != 'u' && *p != 'd')
+        {
+            return false;
+        }
+
+        num_conv++;
+    }
+
+    return num_conv == 1;
+}
+
+
+/**
+ * Fix an Annex-B stream and cut it into IDR aligned chunk files of about
+ * seconds each, named by pattern (a printf format taking the chunk
+ * number, see IsSegmentPattern()).
+ *
+ * The scan rewrites the headers and picks the cut points: a chunk ends in
+ * front of the first IDR access unit that would make it longer than the
+ * target, judged by frame count and the VUI timing of the active SPS.
+ * Every chunk starts with the SPS/PPS in effect, prepended when the IDR
+ * access unit does not carry them, so each file decodes on its own.
+ *
+ * A chunk is only a gather list of rewritten headers and input ranges;
+ * a pool of worker threads writes the files side by side with
+ * copy_file_range(), so the bulk of the bytes never passes through user
+ * space and writing scales with the disks rather than with the scan.
+ */
+int RunSegment(Input_t &input, const char *pattern, double seconds, int workers)
+{
+    Segmenter_t s;
+    vector<pthread_t> threads(workers);
+
+    s.input         = &input;
+    s.pattern       = pattern;
+    s.au_vcl        = false;
+    s.au_idr        = false;
+    s.au_sps        = false;
+    s.au_pps        = false;
+    s.target        = seconds * SEGMENT_CLOCK_RATE;
+    s.duration      = SEGMENT_DEFAULT_DURATION;
+    s.num_chunks    = 0;
+    s.max_ticks     = 0;
+    s.min_ticks     = UINT64_MAX;
+    s.queue_depth   = SEGMENT_QUEUE_DEPTH * workers;
+    s.done          = false;
+
+    if (InitRewrite(s.rw) < 0)
+    {
+        return -1;
+    }
+
+    InitOutput(s.au, -1, input.fd, input.data);
+    s.chunk = new_chunk(s);
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (pthread_create(&threads[i], NULL, worker, &s) != 0)
+        {
+            perror("pthread_create");
+            exit(-1);
+        }
+    }
+
+    const uint8_t *data = input.data;
+    vector<uint8_t> patch;
+    vector<uint8_t> nal;
+    NalIter_t it;
+    NalUnit_t unit;
+
+    InitNalIter(it, data, input.size, 0);
+
+    while (NextNal(it, unit))
+    {
+        uint64_t start      = unit.offset;
+        uint32_t prefix_len = unit.prefix_len;
+        uint64_t stop       = unit.next;   // trailing_zero_8bits stay with the NAL
+
+        if (stop <= start + prefix_len)
+        {
+            continue;
+        }
+
+        uint8_t  nal_unit_type  = unit.nal_unit_type;
+        bool     is_slice       = (nal_unit_type == NALU_TYPE_SLICE || nal_unit_type == NALU_TYPE_IDR);
+        uint64_t replaced       = RewriteNal(s.rw, (uint8_t *) data + start, unit.size, prefix_len, start, patch);
+
+        bool new_au = StartsAccessUnit(nal_unit_type, replaced && s.rw.slice.first_mb_in_slice == 0);
+
+        if (s.au_vcl && new_au)
+        {
+            end_au(s);
+        }
+
+        if (is_slice && !s.au_vcl)
+        {
+            if (replaced)
+            {
+                UpdateFrameDuration(s.rw, SEGMENT_CLOCK_RATE, s.duration);
+            }
+
+            s.au_vcl = true;
+            s.au_idr = (nal_unit_type == NALU_TYPE_IDR);
+        }
+
+        if (nal_unit_type == NALU_TYPE_SPS || nal_unit_type == NALU_TYPE_PPS)
+        {
+            uint64_t body = replaced ? replaced : prefix_len;
+
+            nal.assign(start_code, start_code + sizeof(start_code));
+            nal.insert(nal.end(), patch.begin() + (replaced ? prefix_len : patch.size()), patch.end());
+            nal.insert(nal.end(), data + start + body, data + stop);
+
+            // trailing_zero_8bits
+            while (nal.size() > sizeof(start_code) + 1 && nal.back() == 0x00)
+            {
+                nal.pop_back();
+            }
+
+            note_set(s, nal_unit_type, nal);
+        }
+
+        if (replaced)
+        {
+            OutputBytes(s.au, patch.data(), patch.size());
+            OutputRange(s.au, start + replaced, stop - start - replaced);
+        }
+        else
+        {
+            OutputRange(s.au, start, stop - start);
+        }
+    }
+
+    end_au(s);
+
+    if (s.chunk->out.queued > 0)
+    {
+        submit(s, s.chunk);
+    }
+    else
+    {
+        delete s.chunk;
+        s.num_chunks--;
+    }
+
+    pthread_mutex_lock(&s.lock);
+    s.done = true;
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+
+    FreeRewrite(s.rw);
+
+    printf("%u segments of %.3f to %.3f s, %d writers\n",
+           s.num_chunks,
+           s.num_chunks ? (double) s.min_ticks / SEGMENT_CLOCK_RATE : 0.0,
+           (double) s.max_ticks / SEGMENT_CLOCK_RATE,
+           workers);
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+
+
+#ifndef ___I_AVC_SEGMENT_H___
+#define ___I_AVC_SEGMENT_H___
+
+
+#define SEGMENT_CLOCK_RATE          90000
+#define SEGMENT_DEFAULT_DURATION    3000        // 30 fps when the SPS has no timing info
+#define SEGMENT_QUEUE_DEPTH         4           // chunks waiting per worker before the scan waits
+#define SEGMENT_PATTERN_SUFFIX      "_%05u.264"
+
+
+extern bool IsSegmentPattern(const char *pattern);
+extern int RunSegment(Input_t &input, const char *pattern, double seconds, int workers);
+
+#endif
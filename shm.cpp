@@ -0,0 +1,387 @@
+//
+//  shm.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "nal.h"
+#include "rewrite.h"
+#include "shm.h"
+
+
+using namespace std;
+
+
+#define SHM_SPIN_COUNT          100
+
+
+typedef struct
+{
+    ShmRingHeader_t *hdr;
+    uint8_t *slots;
+    size_t   size;
+} ShmRing_t;
+
+
+typedef struct
+{
+    uint64_t out_seq;       // output head after the last descriptor of the slot
+    uint64_t in_seq;        // input tail once that descriptor is released
+} Release_t;
+
+
+/******************************
+ * local function
+ */
+
+static uint64_t load_acquire(uint64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+
+static void store_release(uint64_t *p, uint64_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+
+static ShmSlot_t *ring_slot(ShmRing_t &ring, uint64_t seq)
+{
+    return (ShmSlot_t *) (ring.slots + (seq & (ring.hdr->num_slots - 1)) * (uint64_t) ring.hdr->slot_size);
+}
+
+
+static void backoff(unsigned &spins)
+{
+    if (++spins < SHM_SPIN_COUNT)
+    {
+        sched_yield();
+    }
+    else
+    {
+        struct timespec ts = { 0, 50000 };
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+/**
+ * Open name as "fd:N" or through shm_open(), creating it when create is
+ * set and it does not exist yet.
+ */
+static int open_shm(const char *name, bool create, bool &created)
+{
+    created = false;
+
+    if (strncmp(name, "fd:", 3) == 0)
+    {
+        return atoi(name + 3);
+    }
+
+    int fd = shm_open(name, O_RDWR, 0);
+
+    if (fd < 0 && errno == ENOENT && create)
+    {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        created = (fd >= 0);
+    }
+
+    return fd;
+}
+
+
+static int map_ring(ShmRing_t &ring, const char *name, bool create, uint32_t slot_size)
+{
+    bool created;
+    struct stat st;
+
+    int fd = open_shm(name, create, created);
+    if (fd < 0)
+    {
+        perror(name);
+        return -1;
+    }
+
+    if (created)
+    {
+        size_t size = sizeof(ShmRingHeader_t) + (size_t) SHM_OUT_SLOTS * slot_size;
+
+        if (ftruncate(fd, size) != 0)
+        {
+            perror(name);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ShmRingHeader_t))
+    {
+        fprintf(stderr, "%s: not a ring\n", name);
+        close(fd);
+        return -1;
+    }
+
+    ring.size = st.st_size;
+
+    void *addr = mmap(NULL, ring.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (addr == MAP_FAILED)
+    {
+        perror(name);
+        return -1;
+    }
+
+    ring.hdr    = (ShmRingHeader_t *) addr;
+    ring.slots  = (uint8_t *) addr + sizeof(ShmRingHeader_t);
+
+    if (created)
+    {
+        ring.hdr->num_slots = SHM_OUT_SLOTS;
+        ring.hdr->slot_size = slot_size;
+        ring.hdr->head      = 0;
+        ring.hdr->tail      = 0;
+        ring.hdr->closed    = 0;
+
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(ring.hdr->magic, SHM_RING_MAGIC, sizeof(ring.hdr->magic));
+    }
+
+    uint32_t n = ring.hdr->num_slots;
+
+    if (memcmp(ring.hdr->magic, SHM_RING_MAGIC, sizeof(ring.hdr->magic)) != 0
+     || n == 0 || (n & (n - 1)) != 0
+     || ring.hdr->slot_size < slot_size
+     || sizeof(ShmRingHeader_t) + (uint64_t) n * ring.hdr->slot_size > ring.size)
+    {
+        fprintf(stderr, "%s: not a ring or bad geometry\n", name);
+        munmap(addr, ring.size);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Give input slots back to the producer once the output consumer has
+ * released every descriptor that points into them.
+ */
+static void release_input(ShmRing_t &in, ShmRing_t &out, deque<Release_t> &pending)
+{
+    uint64_t done = load_acquire(&out.hdr->tail);
+
+    while (!pending.empty() && pending.front().out_seq <= done)
+    {
+        store_release(&in.hdr->tail, pending.front().in_seq);
+        pending.pop_front();
+    }
+}
+
+
+static void publish(ShmRing_t &in, ShmRing_t &out, deque<Release_t> &pending, ShmDesc_t &desc)
+{
+    unsigned spins = 0;
+    uint64_t head = out.hdr->head;
+
+    while (head - load_acquire(&out.hdr->tail) >= out.hdr->num_slots)
+    {
+        release_input(in, out, pending);
+        backoff(spins);
+    }
+
+    ShmSlot_t *slot = ring_slot(out, head);
+
+    slot->length = sizeof(desc);
+    memcpy(slot + 1, &desc, sizeof(desc));
+
+    store_release(&out.hdr->head, head + 1);
+}
+
+
+/**
+ * Rewrite the NALs of one input slot into descriptors. Every patched
+ * header starts a new descriptor, the bytes up to the next patched header
+ * ride along as its input range.
+ */
+static void process_slot(Rewrite_t &rw, ShmRing_t &in, ShmRing_t &out, deque<Release_t> &pending, uint64_t seq, uint64_t offset)
+{
+    ShmSlot_t *slot = ring_slot(in, seq);
+    const uint8_t *data = (const uint8_t *) (slot + 1);
+    uint64_t len = slot->length;
+    vector<uint8_t> patch;
+    NalIter_t it;
+    NalUnit_t unit;
+    ShmDesc_t desc;
+
+    desc.in_seq     = seq;
+    desc.offset     = 0;
+    desc.hdr_len    = 0;
+
+    InitNalIter(it, data, len, 0);
+
+    while (NextNal(it, unit))
+    {
+        uint64_t start      = unit.offset;
+        uint32_t prefix_len = unit.prefix_len;
+
+        // a header that ran past its NAL has already covered this one
+        if (start < desc.offset)
+        {
+            continue;
+        }
+
+        uint64_t replaced = (start + prefix_len < len)
+                          ? RewriteNal(rw, (uint8_t *) data + start, len - start, prefix_len, offset + start, patch)
+                          : 0;
+
+        if (replaced && patch.size() > SHM_HDR_MAX)
+        {
+            printf("Header at 0x%llx too long for a descriptor, left unchanged\n", (unsigned long long) (offset + start));
+            replaced = 0;
+        }
+
+        if (replaced == 0)
+        {
+            continue;
+        }
+
+        desc.length = start - desc.offset;
+
+        if (desc.length || desc.hdr_len)
+        {
+            publish(in, out, pending, desc);
+        }
+
+        desc.hdr_len = patch.size();
+        memcpy(desc.hdr, patch.data(), patch.size());
+        desc.offset = start + (replaced < len - start ? replaced : len - start);
+    }
+
+    desc.length = len - desc.offset;
+
+    if (desc.length || desc.hdr_len)
+    {
+        publish(in, out, pending, desc);
+    }
+}
+
+
+/**
+ * Fix a stream that arrives in a shared memory ring and describe the
+ * result in another one. Payload bytes are never copied: they are parsed
+ * in the input slots and referenced from the output descriptors, only
+ * the regenerated headers are written to shared memory.
+ *
+ * The output ring is created with SHM_OUT_SLOTS descriptor slots when it
+ * does not exist. It is closed when the input ring is closed and drained.
+ */
+int RunShm(const char *in_name, const char *out_name)
+{
+    ShmRing_t in;
+    ShmRing_t out;
+
+    if (map_ring(in, in_name, false, sizeof(ShmSlot_t) + NAL_HDR_WINDOW_SIZE) < 0)
+    {
+        return -1;
+    }
+
+    if (map_ring(out, out_name, true, sizeof(ShmSlot_t) + sizeof(ShmDesc_t)) < 0)
+    {
+        munmap(in.hdr, in.size);
+        return -1;
+    }
+
+    Rewrite_t rw;
+
+    if (InitRewrite(rw) < 0)
+    {
+        munmap(in.hdr, in.size);
+        munmap(out.hdr, out.size);
+        return -1;
+    }
+
+    deque<Release_t> pending;
+    uint64_t first = load_acquire(&in.hdr->tail);
+    uint64_t seq = first;
+    int ret = 0;
+    uint64_t offset = 0;
+    unsigned spins = 0;
+
+    for (;;)
+    {
+        if (seq == load_acquire(&in.hdr->head))
+        {
+            release_input(in, out, pending);
+
+            // closed is set after the last head update, so head is final here
+            if (__atomic_load_n(&in.hdr->closed, __ATOMIC_ACQUIRE) && seq == load_acquire(&in.hdr->head))
+            {
+                break;
+            }
+
+            backoff(spins);
+            continue;
+        }
+
+        spins = 0;
+
+        if (ring_slot(in, seq)->length > in.hdr->slot_size - sizeof(ShmSlot_t))
+        {
+            fprintf(stderr, "%s: slot %llu overruns the slot size\n", in_name, (unsigned long long) seq);
+            ret = -1;
+            break;
+        }
+
+        process_slot(rw, in, out, pending, seq, offset);
+
+        offset += ring_slot(in, seq)->length;
+        seq++;
+
+        Release_t r = { out.hdr->head, seq };
+
+        pending.push_back(r);
+        release_input(in, out, pending);
+    }
+
+    __atomic_store_n(&out.hdr->closed, 1, __ATOMIC_RELEASE);
+
+    printf("Shared memory: %llu input slots, %llu bytes, %llu descriptors\n",
+           (unsigned long long) (seq - first),
+           (unsigned long long) offset,
+           (unsigned long long) out.hdr->head);
+
+    FreeRewrite(rw);
+    munmap(in.hdr, in.size);
+    munmap(out.hdr, out.size);
+
+    return ret;
+}
@@ -0,0 +1,58 @@
+
+
+#ifndef ___I_AVC_SHM_H___
+#define ___I_AVC_SHM_H___
+
+
+#define SHM_RING_MAGIC          "IAVCRING"
+#define SHM_OUT_SLOTS           4096
+#define SHM_HDR_MAX             (NAL_HDR_WINDOW_SIZE + 8)
+
+
+/*
+ * Single producer, single consumer ring in a POSIX shared memory object
+ * (shm_open() name, or "fd:N" for an inherited memfd). The producer fills
+ * slot head % num_slots and then bumps head, the consumer reads slot tail
+ * and bumps tail once it is done with it. Each counter has one writer.
+ */
+typedef struct
+{
+    char     magic[8];
+    uint32_t num_slots;                                 // power of two
+    uint32_t slot_size;                                 // bytes per slot, ShmSlot_t included
+    uint64_t head   __attribute__((aligned(64)));       // slots published by the producer
+    uint64_t tail   __attribute__((aligned(64)));       // slots released by the consumer
+    uint32_t closed __attribute__((aligned(64)));       // producer is done, head is final
+} ShmRingHeader_t;
+
+
+typedef struct
+{
+    uint64_t length;                    // bytes of data following this header
+} ShmSlot_t;
+
+
+/*
+ * Input slots hold Annex-B data. A slot may end inside a NAL, but the
+ * first NAL_HDR_WINDOW_SIZE bytes of every NAL must sit in one slot.
+ *
+ * Each output slot holds one descriptor: hdr_len regenerated bytes
+ * followed by [offset, offset + length) of input slot in_seq. Input slots
+ * are released only after every descriptor pointing into them has been
+ * released from the output ring, so the consumer of the output reads the
+ * payload straight from the input ring.
+ */
+typedef struct
+{
+    uint64_t in_seq;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t hdr_len;
+    uint8_t  hdr[SHM_HDR_MAX];
+} ShmDesc_t;
+
+
+extern int RunShm(const char *in_name, const char *out_name);
+
+#endif
+
@@ -0,0 +1,314 @@
+//
+//  stream.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "nal.h"
+#include "output.h"
+#include "rewrite.h"
+#include "stream.h"
+
+
+using namespace std;
+
+
+/**
+ * Queue the unchanged bytes up to a completed NAL [nal, end) and its
+ * regenerated header.
+ */
+static void rewrite_nal(Stream_t &st, uint64_t end)
+{
+    uint64_t nal = st.nal;
+    uint64_t replaced = RewriteNal(st.rw, st.buf + nal, st.tail - nal, st.prefix_len, st.base + nal, st.patch);
+
+    if (replaced == 0 || nal < st.emitted)
+    {
+        return;
+    }
+
+    OutputRange(st.out, st.emitted, nal - st.emitted);
+    OutputBytes(st.out, st.patch.data(), st.patch.size());
+
+    st.emitted = nal + (replaced < end - nal ? replaced : end - nal);
+}
+
+
+int InitStream(Stream_t &st, int ofd, bool cut_through)
+{
+    st.cap          = 2 * STREAM_CHUNK_SIZE;
+    st.buf          = (uint8_t *) malloc(st.cap);
+
+    if (st.buf == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    if (InitRewrite(st.rw) < 0)
+    {
+        free(st.buf);
+        return -1;
+    }
+
+    ResetStream(st, ofd, cut_through);
+
+    return 0;
+}
+
+
+/**
+ * Start over on a new stream, keeping the buffer of the previous one but
+ * none of its parameter sets.
+ */
+void ResetStream(Stream_t &st, int ofd, bool cut_through)
+{
+    st.base         = 0;
+    st.tail         = 0;
+    st.scan         = 0;
+    st.nal          = -1;
+    st.pending      = false;
+    st.prefix_len   = 0;
+    st.cut_through  = cut_through;
+    st.keep         = 0;
+    st.emitted      = 0;
+
+    ResetRewrite(st.rw);
+    InitOutput(st.out, ofd, -1, st.buf);
+}
+
+
+/**
+ * Drop the bytes handed out last round, slide the rest down and return
+ * room for the next STREAM_CHUNK_SIZE bytes. The buffer only grows when a
+ * single NAL does not fit, so memory is bounded by the largest NAL, not
+ * by the length of the stream.
+ */
+uint8_t *StreamBuffer(Stream_t &st)
+{
+    uint64_t keep = st.keep;
+
+    if (keep)
+    {
+        memmove(st.buf, st.buf + keep, st.tail - keep);
+
+        st.base     += keep;
+        st.tail     -= keep;
+        st.scan     -= keep;
+        st.emitted  -= keep;
+        st.nal      -= (int64_t) keep;
+        st.keep     = 0;
+    }
+
+    if (st.cap - st.tail < STREAM_CHUNK_SIZE)
+    {
+        st.cap *= 2;
+        st.buf = (uint8_t *) realloc(st.buf, st.cap);
+
+        if (st.buf == NULL)
+        {
+            perror("realloc");
+            exit(-1);
+        }
+    }
+
+    st.out.base = st.buf;
+
+    return st.buf + st.tail;
+}
+
+
+/**
+ * Take len new bytes at StreamBuffer().
+ *
+ * A NAL is handed to RewriteNal once the next start code shows up, so
+ * start codes and emulation prevention bytes split across chunks are seen
+ * whole. Everything before the pending NAL is queued on st.out.
+ *
+ * With cut_through the NAL is rewritten as soon as its header window is
+ * in, and the rest of its payload is forwarded chunk by chunk as it
+ * arrives instead of waiting for the next start code. Only the last three
+ * bytes, which may open a start code, are held back.
+ */
+void StreamData(Stream_t &st, uint64_t len)
+{
+    st.tail += len;
+
+    // complete every NAL whose successor start code is now in the buffer
+    for (;;)
+    {
+        const uint8_t *sc = FindStartCode(st.buf + st.scan, st.buf + st.tail);
+
+        if (sc == st.buf + st.tail)
+        {
+            break;
+        }
+
+        uint64_t pos    = sc - st.buf;
+        uint64_t start  = (pos > 0 && st.buf[pos - 1] == 0x00) ? pos - 1 : pos;
+
+        if (st.pending)
+        {
+            rewrite_nal(st, start);
+        }
+
+        st.nal          = start;
+        st.pending      = true;
+        st.prefix_len   = pos + 3 - start;
+        st.scan         = pos + 3;
+    }
+
+    // the header is all RewriteNal looks at, the payload need not be complete
+    if (st.cut_through && st.pending && st.tail - st.nal >= NAL_HDR_WINDOW_SIZE)
+    {
+        rewrite_nal(st, st.tail);
+        st.pending = false;
+    }
+
+    // the last two bytes may open a start code completed by the next chunk
+    if (st.tail >= 2 && st.scan < st.tail - 2)
+    {
+        st.scan = st.tail - 2;
+    }
+
+    // hand out everything before the pending NAL (or the possible start code)
+    uint64_t keep = st.pending ? (uint64_t) st.nal : (st.scan > 1 ? st.scan - 1 : 0);
+
+    if (keep > st.emitted)
+    {
+        OutputRange(st.out, st.emitted, keep - st.emitted);
+        st.emitted = keep;
+    }
+
+    st.keep = keep;
+}
+
+
+/**
+ * End of input: finish the last NAL and queue everything left.
+ */
+void StreamEnd(Stream_t &st)
+{
+    if (st.pending && (uint64_t) st.nal + st.prefix_len < st.tail)
+    {
+        rewrite_nal(st, st.tail);
+    }
+
+    st.pending = false;
+
+    OutputRange(st.out, st.emitted, st.tail - st.emitted);
+
+    st.emitted  = st.tail;
+    st.keep     = st.tail;
+}
+
+
+void FreeStream(Stream_t &st)
+{
+    CloseOutput(st.out);
+
+    free(st.buf);
+    st.buf = NULL;
+
+    FreeRewrite(st.rw);
+}
+
+
+/**
+ * Read ifd to the end through the stream, flushing the output each round.
+ * Returns the number of bytes read, or -1.
+ */
+int64_t PumpStream(Stream_t &st, int ifd)
+{
+    // O_DIRECT output means batch mode: what has been read is not needed again
+    bool drop_cache = (st.out.direct != NULL);
+    uint64_t consumed = 0;
+    uint64_t dropped = 0;
+
+    posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (;;)
+    {
+        uint8_t *p = StreamBuffer(st);
+        ssize_t rd_sz = read(ifd, p, STREAM_CHUNK_SIZE);
+
+        if (rd_sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("read");
+            return -1;
+        }
+
+        if (rd_sz == 0)
+        {
+            break;
+        }
+
+        StreamData(st, rd_sz);
+        FlushOutput(st.out);
+
+        consumed += rd_sz;
+
+        if (drop_cache && consumed - dropped >= STREAM_DROP_SIZE)
+        {
+            posix_fadvise(ifd, dropped, consumed - dropped, POSIX_FADV_DONTNEED);
+            dropped = consumed;
+        }
+    }
+
+    if (drop_cache)
+    {
+        posix_fadvise(ifd, dropped, 0, POSIX_FADV_DONTNEED);
+    }
+
+    StreamEnd(st);
+    FlushOutput(st.out);
+    CloseOutput(st.out);
+
+    return consumed;
+}
+
+
+/**
+ * Fix a stream that can only be read front to back (stdin, pipe, socket),
+ * STREAM_CHUNK_SIZE at a time.
+ */
+int RunStream(int ifd, int ofd, bool cut_through)
+{
+    Stream_t st;
+
+    if (InitStream(st, ofd, cut_through) < 0)
+    {
+        return -1;
+    }
+
+    int64_t ret = PumpStream(st, ifd);
+
+    FreeStream(st);
+
+    return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,54 @@
+
+
+#ifndef ___I_AVC_STREAM_H___
+#define ___I_AVC_STREAM_H___
+
+
+#define STREAM_CHUNK_SIZE       (1 << 20)
+#define STREAM_DROP_SIZE        (8 << 20)     // input read between page cache drops in batch mode
+
+
+/*
+ * Push style NAL rewriter over data that arrives in order. The caller
+ * fills StreamBuffer() with up to STREAM_CHUNK_SIZE bytes, reports them
+ * with StreamData(), then consumes st.out (FlushOutput or GatherOutput)
+ * before asking for the next buffer.
+ */
+typedef struct
+{
+    uint8_t *buf;
+    uint64_t cap;
+    uint64_t base;              // stream offset of buf[0]
+    uint64_t tail;              // end of valid data
+    uint64_t scan;              // where the next start code search resumes
+    int64_t  nal;               // start of the current NAL
+    bool     pending;           // current NAL not rewritten yet
+    uint32_t prefix_len;
+    bool     cut_through;
+    uint64_t keep;              // bytes of buf already handed to out
+    uint64_t emitted;           // bytes of buf accounted for in out
+
+    Output_t out;
+    Rewrite_t rw;
+    std::vector<uint8_t> patch;
+} Stream_t;
+
+
+extern int InitStream(Stream_t &st, int ofd, bool cut_through);
+
+extern void ResetStream(Stream_t &st, int ofd, bool cut_through);
+
+extern uint8_t *StreamBuffer(Stream_t &st);
+
+extern void StreamData(Stream_t &st, uint64_t len);
+
+extern void StreamEnd(Stream_t &st);
+
+extern void FreeStream(Stream_t &st);
+
+extern int64_t PumpStream(Stream_t &st, int ifd);
+
+extern int RunStream(int ifd, int ofd, bool cut_through);
+
+#endif
+
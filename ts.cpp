@@ -0,0 +1,512 @@
+//
+//  ts.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "input.h"
+#include "nal.h"
+#include "output.h"
+#include "rewrite.h"
+#include "ts.h"
+
+
+using namespace std;
+
+
+typedef struct
+{
+    uint64_t es_off;
+    uint64_t file_off;
+    uint32_t len;
+} Extent_t;
+
+
+typedef struct
+{
+    uint64_t start;
+    uint32_t prefix_len;
+} PendingNal_t;
+
+
+/*
+ * Video elementary stream reassembled from TS payloads. Only a sliding
+ * window of it is kept: the bytes of NALs still waiting for their header
+ * and the extents that map them back to the file.
+ */
+typedef struct
+{
+    Input_t  *input;
+    Output_t  out;
+    Rewrite_t rw;
+
+    int      pmt_pid;
+    int      video_pid;
+    bool     in_pes;                    // video payload is ES data, not a PES header
+    int8_t   cc[TS_NUM_PIDS];           // last continuity_counter per PID, -1 before the first
+
+    vector<uint8_t>      es;
+    uint64_t             es_base;       // ES offset of es[0]
+    deque<Extent_t>      ext;
+    uint64_t             scan;          // ES offset where the start code search resumes
+    deque<PendingNal_t>  pending;
+    vector<uint8_t>      patch;
+
+    uint64_t emitted;                   // file bytes accounted for in out
+    uint64_t num_patches;
+    uint64_t num_skipped;
+} Ts_t;
+
+
+/******************************
+ * local function
+ */
+
+static uint64_t es_end(Ts_t &ts)
+{
+    return ts.es_base + ts.es.size();
+}
+
+
+/**
+ * Queue the changed bytes es[from, from + len) at the file offsets they
+ * came from; a run may cross any number of packet boundaries.
+ */
+static void output_es(Ts_t &ts, uint64_t from, const uint8_t *bytes, uint64_t len)
+{
+    for (size_t i = 0; i < ts.ext.size() && len > 0; i++)
+    {
+        Extent_t &e = ts.ext[i];
+
+        if (from >= e.es_off + e.len)
+        {
+            continue;
+        }
+
+        uint64_t skip   = from - e.es_off;
+        uint64_t n      = e.len - skip;
+        uint64_t fo     = e.file_off + skip;
+
+        if (n > len)
+        {
+            n = len;
+        }
+
+        OutputRange(ts.out, ts.emitted, fo - ts.emitted);
+        OutputBytes(ts.out, bytes, n);
+
+        ts.emitted = fo + n;
+
+        from    += n;
+        bytes   += n;
+        len     -= n;
+    }
+}
+
+
+static void rewrite(Ts_t &ts, PendingNal_t &nal)
+{
+    uint8_t *ptr = ts.es.data() + (nal.start - ts.es_base);
+    uint64_t avail = es_end(ts) - nal.start;
+    uint64_t replaced = RewriteNal(ts.rw, ptr, avail, nal.prefix_len, nal.start, ts.patch);
+
+    if (replaced == 0)
+    {
+        return;
+    }
+
+    if (replaced > avail)
+    {
+        replaced = avail;
+    }
+
+    vector<uint8_t> &patch = ts.patch;
+
+    // payload sizes are fixed, a header can shrink but not grow
+    if (patch.size() > replaced)
+    {
+        printf("Header at ES 0x%llx grows by %llu bytes, cannot patch inside TS, left unchanged\n",
+               (unsigned long long) nal.start, (unsigned long long) (patch.size() - replaced));
+        ts.num_skipped++;
+        return;
+    }
+
+    patch.insert(patch.begin(), replaced - patch.size(), 0x00);
+
+    uint64_t first = 0;
+    uint64_t last  = replaced;
+
+    while (first < last && patch[first] == ptr[first])
+    {
+        first++;
+    }
+
+    while (last > first && patch[last - 1] == ptr[last - 1])
+    {
+        last--;
+    }
+
+    if (first < last)
+    {
+        output_es(ts, nal.start + first, &patch[first], last - first);
+        ts.num_patches++;
+    }
+}
+
+
+/**
+ * Find new start codes, rewrite every NAL whose header window is complete
+ * (all of them at the end of the file) and drop what is no longer needed.
+ */
+static void process_es(Ts_t &ts, bool eof)
+{
+    const uint8_t *base = ts.es.data();
+    const uint8_t *end  = base + ts.es.size();
+    const uint8_t *sc   = FindStartCode(base + (ts.scan - ts.es_base), end);
+
+    while (sc != end)
+    {
+        uint64_t pos = ts.es_base + (sc - base);
+        PendingNal_t nal;
+
+        nal.start       = (sc > base && sc[-1] == 0x00) ? pos - 1 : pos;
+        nal.prefix_len  = pos + 3 - nal.start;
+
+        ts.pending.push_back(nal);
+
+        sc = FindStartCode(sc + 3, end);
+    }
+
+    ts.scan = (es_end(ts) > ts.es_base + 2) ? es_end(ts) - 2 : ts.es_base;
+
+    while (!ts.pending.empty())
+    {
+        PendingNal_t &nal = ts.pending.front();
+
+        if (!eof && es_end(ts) - nal.start < NAL_HDR_WINDOW_SIZE)
+        {
+            break;
+        }
+
+        if (nal.start + nal.prefix_len < es_end(ts))
+        {
+            rewrite(ts, nal);
+        }
+
+        ts.pending.pop_front();
+    }
+
+    // keep the pending NALs and the bytes a start code may still span
+    uint64_t keep = ts.pending.empty() ? ts.scan : ts.pending.front().start;
+
+    if (keep > ts.scan)
+    {
+        keep = ts.scan;
+    }
+
+    if (keep > ts.es_base + 1)
+    {
+        keep -= 1;
+    }
+
+    if (keep - ts.es_base >= TS_ES_TRIM_SIZE)
+    {
+        ts.es.erase(ts.es.begin(), ts.es.begin() + (keep - ts.es_base));
+        ts.es_base = keep;
+
+        while (!ts.ext.empty() && ts.ext.front().es_off + ts.ext.front().len <= keep)
+        {
+            ts.ext.pop_front();
+        }
+    }
+}
+
+
+/**
+ * A video packet went missing: finish the NALs pending with the bytes in
+ * front of the gap only, so no header is read across it, and drop the ES
+ * window. The rest of the PES is skipped up to the next PES header.
+ */
+static void es_gap(Ts_t &ts, uint64_t file_off)
+{
+    printf("TS: continuity gap at 0x%llx, rest of the PES skipped\n", (unsigned long long) file_off);
+
+    process_es(ts, true);
+
+    ts.es_base  = es_end(ts);
+    ts.scan     = ts.es_base;
+    ts.es.clear();
+    ts.ext.clear();
+    ts.pending.clear();
+    ts.in_pes   = false;
+}
+
+
+static void append_es(Ts_t &ts, uint64_t file_off, const uint8_t *p, uint32_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+
+    Extent_t e = { es_end(ts), file_off, len };
+
+    ts.ext.push_back(e);
+    ts.es.insert(ts.es.end(), p, p + len);
+
+    process_es(ts, false);
+}
+
+
+/**
+ * Pick the PMT PID from a PAT section, or the H.264 PID from a PMT.
+ */
+static void parse_psi(Ts_t &ts, const uint8_t *p, uint32_t len, bool pat)
+{
+    // sections are expected to fit in the packet that starts them
+    if (len < 1 || 1u + p[0] + 12 > len)
+    {
+        return;
+    }
+
+    const uint8_t *sec = p + 1 + p[0];      // skip pointer_field
+    uint32_t section_length = ((sec[1] & 0x0F) << 8) | sec[2];
+
+    if (section_length < 9 || (sec - p) + 3 + section_length > len)
+    {
+        return;
+    }
+
+    const uint8_t *end = sec + 3 + section_length - 4;      // CRC_32 excluded
+
+    if (pat && sec[0] == 0x00)
+    {
+        for (const uint8_t *e = sec + 8; e + 4 <= end; e += 4)
+        {
+            uint16_t program_number = (e[0] << 8) | e[1];
+
+            if (program_number != 0)
+            {
+                ts.pmt_pid = ((e[2] & 0x1F) << 8) | e[3];
+                return;
+            }
+        }
+    }
+    else if (!pat && sec[0] == 0x02)
+    {
+        uint32_t program_info_length = ((sec[10] & 0x0F) << 8) | sec[11];
+
+        for (const uint8_t *e = sec + 12 + program_info_length; e + 5 <= end; )
+        {
+            uint32_t es_info_length = ((e[3] & 0x0F) << 8) | e[4];
+
+            if (e[0] == TS_STREAM_TYPE_H264 && ts.video_pid < 0)
+            {
+                ts.video_pid = ((e[1] & 0x1F) << 8) | e[2];
+                printf("TS: H.264 on PID 0x%x\n", ts.video_pid);
+            }
+
+            e += 5 + es_info_length;
+        }
+    }
+}
+
+
+static void handle_packet(Ts_t &ts, const uint8_t *pkt, uint64_t file_off)
+{
+    bool     tei    = pkt[1] & 0x80;
+    bool     pusi   = pkt[1] & 0x40;
+    int      pid    = ((pkt[1] & 0x1F) << 8) | pkt[2];
+    uint8_t  scrambling = pkt[3] >> 6;
+    uint8_t  afc    = (pkt[3] >> 4) & 0x03;
+    uint32_t off    = 4;
+
+    if (tei || scrambling || !(afc & 0x01))
+    {
+        return;
+    }
+
+    if (afc & 0x02)
+    {
+        off += 1 + pkt[4];
+    }
+
+    if (off >= TS_PACKET_SIZE)
+    {
+        return;
+    }
+
+    const uint8_t *p = pkt + off;
+    uint32_t len = TS_PACKET_SIZE - off;
+
+    if (pid == 0 || pid == ts.pmt_pid)
+    {
+        if (pusi)
+        {
+            parse_psi(ts, p, len, pid == 0);
+        }
+        return;
+    }
+
+    if (pid != ts.video_pid)
+    {
+        return;
+    }
+
+    // the counter only moves on packets with payload (2.4.3.3)
+    bool    discontinuity = (afc & 0x02) && pkt[4] > 0 && (pkt[5] & 0x80);
+    uint8_t cc = pkt[3] & 0x0F;
+    int8_t  last = ts.cc[pid];
+
+    ts.cc[pid] = cc;
+
+    if (last >= 0 && !discontinuity)
+    {
+        if (cc == last)
+        {
+            // a duplicate packet, its payload is already in the ES
+            return;
+        }
+
+        if (cc != ((last + 1) & 0x0F) && ts.in_pes)
+        {
+            es_gap(ts, file_off);
+        }
+    }
+
+    if (pusi)
+    {
+        // the PES header is not part of the ES, skip it
+        if (len < 9 || p[0] != 0x00 || p[1] != 0x00 || p[2] != 0x01 || 9u + p[8] > len)
+        {
+            printf("TS: bad PES header at 0x%llx\n", (unsigned long long) file_off);
+            ts.in_pes = false;
+            return;
+        }
+
+        uint32_t hdr_len = 9 + p[8];
+
+        p   += hdr_len;
+        len -= hdr_len;
+        ts.in_pes = true;
+    }
+
+    if (ts.in_pes)
+    {
+        append_es(ts, file_off + (p - pkt), p, len);
+    }
+}
+
+
+/**
+ * True when the input looks like 188 byte MPEG-TS packets.
+ */
+bool IsTransportStream(const Input_t &input)
+{
+    if (input.size < 2 * TS_PACKET_SIZE)
+    {
+        return false;
+    }
+
+    return input.data[0] == TS_SYNC_BYTE && input.data[TS_PACKET_SIZE] == TS_SYNC_BYTE;
+}
+
+
+/**
+ * Fix the H.264 stream inside an MPEG-TS file in one pass.
+ *
+ * The video PES payloads are reassembled into a sliding ES window and run
+ * through the usual NAL rewrite; the bytes that change are written back
+ * at the file offsets they came from, wherever the packet boundaries fall.
+ * Everything else, TS and PES headers, PCR/PTS and all other PIDs, is
+ * copied as it is. Since payload sizes are fixed, a shorter header is
+ * padded in front with zero bytes and a longer one is left unchanged.
+ */
+int RunTs(Input_t &input, int ofd)
+{
+    Ts_t ts;
+
+    ts.input        = &input;
+    ts.pmt_pid      = -1;
+    ts.video_pid    = -1;
+    ts.in_pes       = false;
+    ts.es_base      = 0;
+
+    memset(ts.cc, -1, sizeof(ts.cc));
+
+    ts.scan         = 0;
+    ts.emitted      = 0;
+    ts.num_patches  = 0;
+    ts.num_skipped  = 0;
+
+    if (InitRewrite(ts.rw) < 0)
+    {
+        return -1;
+    }
+
+    InitOutput(ts.out, ofd, input.fd, input.data);
+
+    uint64_t pos = 0;
+
+    while (pos + TS_PACKET_SIZE <= input.size)
+    {
+        const uint8_t *pkt = input.data + pos;
+
+        if (pkt[0] != TS_SYNC_BYTE)
+        {
+            printf("TS: lost sync at 0x%llx, rest copied unchanged\n", (unsigned long long) pos);
+            break;
+        }
+
+        handle_packet(ts, pkt, pos);
+
+        pos += TS_PACKET_SIZE;
+
+        // file bytes in front of the oldest byte still in the ES window are final
+        uint64_t safe = ts.ext.empty() ? pos : ts.ext.front().file_off;
+
+        if (safe > ts.emitted && safe - ts.emitted + ts.out.queued >= TS_FLUSH_SIZE)
+        {
+            OutputRange(ts.out, ts.emitted, safe - ts.emitted);
+            ts.emitted = safe;
+
+            FlushOutput(ts.out);
+            ReleaseInput(input, ts.emitted);
+        }
+    }
+
+    process_es(ts, true);
+
+    OutputRange(ts.out, ts.emitted, input.size - ts.emitted);
+    FlushOutput(ts.out);
+    CloseOutput(ts.out);
+
+    FreeRewrite(ts.rw);
+
+    if (ts.video_pid < 0)
+    {
+        printf("TS: no H.264 stream found, copied unchanged\n");
+    }
+
+    printf("TS: %llu ranges patched, %llu headers left unchanged\n",
+           (unsigned long long) ts.num_patches,
+           (unsigned long long) ts.num_skipped);
+
+    return 0;
+}
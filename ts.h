@@ -0,0 +1,19 @@
+
+
+#ifndef ___I_AVC_TS_H___
+#define ___I_AVC_TS_H___
+
+
+#define TS_PACKET_SIZE          188
+#define TS_SYNC_BYTE            0x47
+#define TS_STREAM_TYPE_H264     0x1B
+#define TS_NUM_PIDS             8192
+
+#define TS_ES_TRIM_SIZE         4096
+#define TS_FLUSH_SIZE           (4 * 1024 * 1024)
+
+
+extern bool IsTransportStream(const Input_t &input);
+extern int RunTs(Input_t &input, int ofd);
+
+#endif
@@ -0,0 +1,543 @@
+//
+//  uring.cpp
+//  iAvc
+//
+//  Created by Hank Lee on 2026/10/17.
+//  Copyright (c) 2026 Hank Lee. All rights reserved.
+//
+
+/******************************
+ * include
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "output.h"
+#include "rewrite.h"
+#include "stream.h"
+#include "uring.h"
+
+
+using namespace std;
+
+
+#define URING_READ_SLOTS        8
+#define URING_WRITE_SLOTS       8
+
+#define URING_OP_READ           0
+#define URING_OP_WRITE          1
+
+
+typedef struct
+{
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void    *sq_ring;
+    size_t   sq_ring_size;
+    void    *cq_ring;
+    size_t   cq_ring_size;
+    size_t   sqes_size;
+
+    unsigned to_submit;
+    unsigned in_flight;
+
+    // statistics
+    unsigned max_in_flight;
+    uint64_t sum_in_flight;
+    uint64_t num_submits;
+} Ring_t;
+
+
+typedef struct
+{
+    vector<uint8_t> buf;
+    uint64_t offset;
+    uint64_t len;           // bytes requested
+    uint64_t done;          // bytes completed so far
+    bool     busy;
+} Slot_t;
+
+
+/******************************
+ * local function
+ */
+
+static int ring_init(Ring_t &ring, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&ring, 0, sizeof(ring));
+    memset(&p, 0, sizeof(p));
+
+    ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0)
+    {
+        return -1;
+    }
+
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring.cq_ring_size > ring.sq_ring_size)
+        {
+            ring.sq_ring_size = ring.cq_ring_size;
+        }
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED)
+    {
+        close(ring.fd);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring.cq_ring = ring.sq_ring;
+    }
+    else
+    {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED)
+        {
+            munmap(ring.sq_ring, ring.sq_ring_size);
+            close(ring.fd);
+            return -1;
+        }
+    }
+
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = (struct io_uring_sqe *) mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+    {
+        if (ring.cq_ring != ring.sq_ring)
+        {
+            munmap(ring.cq_ring, ring.cq_ring_size);
+        }
+        munmap(ring.sq_ring, ring.sq_ring_size);
+        close(ring.fd);
+        return -1;
+    }
+
+    uint8_t *sq = (uint8_t *) ring.sq_ring;
+    uint8_t *cq = (uint8_t *) ring.cq_ring;
+
+    ring.sq_head    = (unsigned *) (sq + p.sq_off.head);
+    ring.sq_tail    = (unsigned *) (sq + p.sq_off.tail);
+    ring.sq_mask    = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring.sq_array   = (unsigned *) (sq + p.sq_off.array);
+
+    ring.cq_head    = (unsigned *) (cq + p.cq_off.head);
+    ring.cq_tail    = (unsigned *) (cq + p.cq_off.tail);
+    ring.cq_mask    = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring.cqes       = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+
+static void ring_exit(Ring_t &ring)
+{
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ring != ring.sq_ring)
+    {
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+}
+
+
+static void ring_queue
+(
+    Ring_t &ring,
+    uint8_t opcode,
+    int fd,
+    void *addr,
+    uint32_t len,
+    uint64_t offset,
+    uint64_t user_data
+)
+{
+    unsigned tail = *ring.sq_tail;
+    unsigned idx  = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode     = opcode;
+    sqe->fd         = fd;
+    sqe->addr       = (uint64_t) (uintptr_t) addr;
+    sqe->len        = len;
+    sqe->off        = offset;
+    sqe->user_data  = user_data;
+
+    ring.sq_array[idx] = idx;
+
+    // the kernel must see the entry before the new tail
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring.to_submit++;
+    ring.in_flight++;
+
+    if (ring.in_flight > ring.max_in_flight)
+    {
+        ring.max_in_flight = ring.in_flight;
+    }
+    ring.sum_in_flight += ring.in_flight;
+    ring.num_submits++;
+}
+
+
+static int ring_enter(Ring_t &ring, unsigned min_complete)
+{
+    for (;;)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (ret >= 0)
+        {
+            ring.to_submit -= (unsigned) ret < ring.to_submit ? (unsigned) ret : ring.to_submit;
+            return 0;
+        }
+
+        if (errno != EINTR)
+        {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+
+static bool ring_peek(Ring_t &ring, struct io_uring_cqe &cqe)
+{
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+    {
+        return false;
+    }
+
+    cqe = ring.cqes[head & *ring.cq_mask];
+
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+    ring.in_flight--;
+
+    return true;
+}
+
+
+static void queue_read(Ring_t &ring, int ifd, Slot_t *slots, unsigned i)
+{
+    Slot_t &slot = slots[i];
+
+    ring_queue(ring, IORING_OP_READ, ifd, slot.buf.data() + slot.done, slot.len - slot.done,
+               slot.offset + slot.done, ((uint64_t) URING_OP_READ << 32) | i);
+}
+
+
+static void queue_write(Ring_t &ring, int ofd, bool seekable, Slot_t *slots, unsigned i)
+{
+    Slot_t &slot = slots[i];
+
+    ring_queue(ring, IORING_OP_WRITE, ofd, slot.buf.data() + slot.done, slot.len - slot.done,
+               seekable ? slot.offset + slot.done : (uint64_t) -1, ((uint64_t) URING_OP_WRITE << 32) | i);
+}
+
+
+/**
+ * Submit what is queued, wait for at least min_complete completions and
+ * account for every completion available. Short transfers are requeued
+ * for their remainder.
+ */
+static int ring_reap
+(
+    Ring_t &ring,
+    unsigned min_complete,
+    int ifd,
+    Slot_t *rd,
+    int ofd,
+    bool seekable,
+    Slot_t *wr
+)
+{
+    struct io_uring_cqe cqe;
+
+    if (ring_enter(ring, min_complete) < 0)
+    {
+        return -1;
+    }
+
+    while (ring_peek(ring, cqe))
+    {
+        unsigned op = cqe.user_data >> 32;
+        unsigned i  = cqe.user_data & 0xFFFFFFFF;
+        Slot_t &slot = (op == URING_OP_READ) ? rd[i] : wr[i];
+
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+        {
+            cqe.res = 0;
+        }
+        else if (cqe.res < 0)
+        {
+            fprintf(stderr, "io_uring %s: %s\n", op == URING_OP_READ ? "read" : "write", strerror(-cqe.res));
+            return -1;
+        }
+        else if (cqe.res == 0 && op == URING_OP_READ)
+        {
+            // file shrank under us
+            slot.len = slot.done;
+        }
+        else if (cqe.res == 0)
+        {
+            // would be requeued forever
+            fprintf(stderr, "io_uring write: no progress at offset %llu\n", (unsigned long long) (slot.offset + slot.done));
+            return -1;
+        }
+
+        slot.done += cqe.res;
+
+        if (slot.done < slot.len)
+        {
+            if (op == URING_OP_READ)
+            {
+                queue_read(ring, ifd, rd, i);
+            }
+            else
+            {
+                queue_write(ring, ofd, seekable, wr, i);
+            }
+        }
+        else if (op == URING_OP_WRITE)
+        {
+            slot.busy = false;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Fix a regular file with reads and writes kept in flight on io_uring.
+ *
+ * Up to URING_READ_SLOTS chunks are read ahead while the stream rewriter
+ * works on the oldest one, and each round of output is gathered into one
+ * of URING_WRITE_SLOTS buffers and written at its own offset while the
+ * next chunk is parsed. Falls back to plain read()/write() streaming when
+ * the kernel does not provide io_uring.
+ */
+int RunUring(int ifd, int ofd, bool cut_through)
+{
+    struct stat st_in;
+    struct stat st_out;
+    struct timeval t0;
+    struct timeval t1;
+
+    Ring_t ring;
+    Stream_t st;
+
+    if (fstat(ifd, &st_in) != 0 || !S_ISREG(st_in.st_mode))
+    {
+        fprintf(stderr, "io_uring mode needs a regular input file, streaming instead\n");
+        return RunStream(ifd, ofd, cut_through);
+    }
+
+    if (ring_init(ring, URING_READ_SLOTS + URING_WRITE_SLOTS) < 0)
+    {
+        fprintf(stderr, "io_uring unavailable (%s), streaming instead\n", strerror(errno));
+        return RunStream(ifd, ofd, cut_through);
+    }
+
+    if (InitStream(st, ofd, cut_through) < 0)
+    {
+        ring_exit(ring);
+        return -1;
+    }
+
+    // a pipe has no offsets, keep one write in flight to preserve order
+    bool seekable = (fstat(ofd, &st_out) == 0 && S_ISREG(st_out.st_mode));
+    unsigned num_wr = seekable ? URING_WRITE_SLOTS : 1;
+
+    Slot_t rd[URING_READ_SLOTS];
+    Slot_t wr[URING_WRITE_SLOTS];
+
+    uint64_t file_size  = st_in.st_size;
+    uint64_t rd_offset  = 0;        // next chunk to queue
+    uint64_t wr_offset  = 0;        // next output byte
+    unsigned cur        = 0;        // slot holding the oldest chunk
+    unsigned queued     = 0;        // read slots in use
+    int      ret        = 0;
+
+    gettimeofday(&t0, NULL);
+
+    for (unsigned i = 0; i < URING_READ_SLOTS; i++)
+    {
+        rd[i].buf.resize(STREAM_CHUNK_SIZE);
+        rd[i].busy = false;
+    }
+
+    for (unsigned i = 0; i < URING_WRITE_SLOTS; i++)
+    {
+        wr[i].busy = false;
+    }
+
+    for (;;)
+    {
+        // keep every free read slot busy with the next chunk
+        while (queued < URING_READ_SLOTS && rd_offset < file_size)
+        {
+            unsigned i = (cur + queued) % URING_READ_SLOTS;
+
+            rd[i].offset    = rd_offset;
+            rd[i].len       = (file_size - rd_offset < STREAM_CHUNK_SIZE) ? file_size - rd_offset : STREAM_CHUNK_SIZE;
+            rd[i].done      = 0;
+            rd[i].busy      = true;
+
+            queue_read(ring, ifd, rd, i);
+
+            rd_offset += rd[i].len;
+            queued++;
+        }
+
+        bool last = (queued == 0);
+
+        if (!last)
+        {
+            // chunks are consumed in file order
+            while (rd[cur].done < rd[cur].len)
+            {
+                if (ring_reap(ring, 1, ifd, rd, ofd, seekable, wr) < 0)
+                {
+                    ret = -1;
+                    break;
+                }
+            }
+
+            if (ret < 0)
+            {
+                break;
+            }
+
+            // read-ahead needs buffers of its own, the stream buffer moves between chunks
+            uint8_t *p = StreamBuffer(st);
+
+            memcpy(p, rd[cur].buf.data(), rd[cur].len);
+            StreamData(st, rd[cur].len);
+
+            rd[cur].busy = false;
+            cur = (cur + 1) % URING_READ_SLOTS;
+            queued--;
+        }
+        else
+        {
+            StreamEnd(st);
+        }
+
+        if (st.out.queued)
+        {
+            unsigned w = num_wr;
+
+            while (w == num_wr)
+            {
+                for (w = 0; w < num_wr && wr[w].busy; w++);
+
+                if (w == num_wr && ring_reap(ring, 1, ifd, rd, ofd, seekable, wr) < 0)
+                {
+                    ret = -1;
+                    break;
+                }
+            }
+
+            if (ret < 0)
+            {
+                break;
+            }
+
+            // the write outlives this round, the stream buffer does not
+            GatherOutput(st.out, wr[w].buf);
+
+            wr[w].offset    = wr_offset;
+            wr[w].len       = wr[w].buf.size();
+            wr[w].done      = 0;
+            wr[w].busy      = true;
+
+            queue_write(ring, ofd, seekable, wr, w);
+
+            wr_offset += wr[w].len;
+        }
+
+        if (last)
+        {
+            break;
+        }
+
+        // pick up whatever finished meanwhile without blocking
+        if (ring_reap(ring, 0, ifd, rd, ofd, seekable, wr) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    // drain the writes
+    while (ret == 0 && ring.in_flight)
+    {
+        if (ring_reap(ring, 1, ifd, rd, ofd, seekable, wr) < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    gettimeofday(&t1, NULL);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+
+    printf("io_uring: read %llu bytes, wrote %llu bytes in %.3f s, %.1f MB/s, queue depth max %u avg %.1f\n",
+           (unsigned long long) file_size,
+           (unsigned long long) wr_offset,
+           secs,
+           secs > 0 ? file_size / secs / 1e6 : 0.0,
+           ring.max_in_flight,
+           ring.num_submits ? (double) ring.sum_in_flight / ring.num_submits : 0.0);
+
+    FreeStream(st);
+    ring_exit(ring);
+
+    return ret;
+}
@@ -0,0 +1,10 @@
+
+
+#ifndef ___I_AVC_URING_H___
+#define ___I_AVC_URING_H___
+
+
+extern int RunUring(int ifd, int ofd, bool cut_through);
+
+#endif
+